@@ -0,0 +1,323 @@
+/*
+** bpf_lookup.c - oidentd eBPF socket ownership map.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "bpf_lookup.h"
+
+#if BPF_SUPPORT
+
+#include <endian.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+/*
+** Number of connections tracked by the socket ownership map.  The map is an
+** LRU hash, so connections beyond this limit evict the least recently used
+** entries; evicted connections are then resolved by the netlink or /proc
+** lookups instead.
+*/
+
+#define BPF_MAP_ENTRIES		65536
+
+/*
+** Key of the socket ownership map.  The layout is shared with the program
+** generated by bpf_gen_prog(): the local port is stored in host byte order
+** and the foreign port in network byte order, as presented by the sock_ops
+** context.  IPv4 addresses occupy the first word of each address.
+*/
+
+struct bpf_sock_key {
+	u_int32_t family;
+	u_int32_t lport;
+	u_int32_t fport;
+	u_int32_t laddr[4];
+	u_int32_t faddr[4];
+};
+
+#define BPF_INSN(c, d, s, o, i) \
+	((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+#define MOV64_REG(d, s)		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i)		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i)		BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define RSH32_IMM(d, i)		BPF_INSN(BPF_ALU | BPF_RSH | BPF_K, d, 0, 0, i)
+#define LDX_W(d, s, o)		BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, d, s, o, 0)
+#define STX_W(d, s, o)		BPF_INSN(BPF_STX | BPF_MEM | BPF_W, d, s, o, 0)
+#define ST_DW(d, o, i)		BPF_INSN(BPF_ST | BPF_MEM | BPF_DW, d, 0, o, i)
+#define JEQ_IMM(d, i, o)	BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, d, 0, o, i)
+#define JNE_IMM(d, i, o)	BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, d, 0, o, i)
+#define JA(o)				BPF_INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define CALL(f)				BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()				BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#define LD_MAP_FD(d, fd)	BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), \
+							BPF_INSN(0, 0, 0, 0, 0)
+
+#define SOCK_OPS(field)		((short) offsetof(struct bpf_sock_ops, field))
+#define KEY(field)			((short) (-48 + offsetof(struct bpf_sock_key, field)))
+
+/* Stack slot holding the UID stored as the map value */
+#define VAL_OFF				(-56)
+
+/*
+** Little-endian kernels present the foreign port shifted into the upper
+** half of the context field.
+*/
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#	define FPORT_FIXUP()	RSH32_IMM(BPF_REG_2, 16)
+#else
+#	define FPORT_FIXUP()	MOV64_REG(BPF_REG_2, BPF_REG_2)
+#endif
+
+static int bpf_map_fd = -1;
+static int bpf_link_fd = -1;
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr);
+static int bpf_gen_prog(int map_fd);
+
+static inline int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr) {
+	return (int) syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+** Load the sock_ops program maintaining the socket ownership map.
+**
+** The program records the UID of the connecting process when a TCP
+** connection is initiated, which runs in the context of the process calling
+** connect(2), and removes the entry once the connection is closed.
+** Returns the program file descriptor, or -1 on failure.
+*/
+
+static int bpf_gen_prog(int map_fd) {
+	union bpf_attr attr;
+	struct bpf_insn prog[] = {
+		/* r6 = ctx, r7 = 1 to record the connection, 0 to remove it */
+		MOV64_REG(BPF_REG_6, BPF_REG_1),
+		LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS(op)),
+		MOV64_IMM(BPF_REG_7, 1),
+		JEQ_IMM(BPF_REG_2, BPF_SOCK_OPS_TCP_CONNECT_CB, 4),
+		JNE_IMM(BPF_REG_2, BPF_SOCK_OPS_STATE_CB, 60),
+		LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS(args[1])),
+		JNE_IMM(BPF_REG_2, BPF_TCP_CLOSE, 58),
+		MOV64_IMM(BPF_REG_7, 0),
+
+		/* Build the key on the stack */
+		ST_DW(BPF_REG_10, -48, 0),
+		ST_DW(BPF_REG_10, -40, 0),
+		ST_DW(BPF_REG_10, -32, 0),
+		ST_DW(BPF_REG_10, -24, 0),
+		ST_DW(BPF_REG_10, -16, 0),
+		ST_DW(BPF_REG_10, -8, 0),
+		LDX_W(BPF_REG_2, BPF_REG_6, SOCK_OPS(family)),
+		STX_W(BPF_REG_10, BPF_REG_2, KEY(family)),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(local_port)),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(lport)),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(remote_port)),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(fport)),
+		JEQ_IMM(BPF_REG_2, AF_INET6, 5),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(local_ip4)),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(laddr[0])),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(remote_ip4)),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(faddr[0])),
+		JA(16),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(local_ip6[0])),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(laddr[0])),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(local_ip6[1])),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(laddr[1])),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(local_ip6[2])),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(laddr[2])),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(local_ip6[3])),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(laddr[3])),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(remote_ip6[0])),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(faddr[0])),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(remote_ip6[1])),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(faddr[1])),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(remote_ip6[2])),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(faddr[2])),
+		LDX_W(BPF_REG_3, BPF_REG_6, SOCK_OPS(remote_ip6[3])),
+		STX_W(BPF_REG_10, BPF_REG_3, KEY(faddr[3])),
+
+		/* Fix up the foreign port (key.fport) */
+		LDX_W(BPF_REG_2, BPF_REG_10, KEY(fport)),
+		FPORT_FIXUP(),
+		STX_W(BPF_REG_10, BPF_REG_2, KEY(fport)),
+		JEQ_IMM(BPF_REG_7, 0, 14),
+
+		/* Record the UID of the connecting process */
+		CALL(BPF_FUNC_get_current_uid_gid),
+		STX_W(BPF_REG_10, BPF_REG_0, VAL_OFF),
+		LD_MAP_FD(BPF_REG_1, map_fd),
+		MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, -48),
+		MOV64_REG(BPF_REG_3, BPF_REG_10),
+		ADD64_IMM(BPF_REG_3, VAL_OFF),
+		MOV64_IMM(BPF_REG_4, BPF_ANY),
+		CALL(BPF_FUNC_map_update_elem),
+		MOV64_REG(BPF_REG_1, BPF_REG_6),
+		MOV64_IMM(BPF_REG_2, BPF_SOCK_OPS_STATE_CB_FLAG),
+		CALL(BPF_FUNC_sock_ops_cb_flags_set),
+		JA(5),
+
+		/* Remove the entry of a closed connection */
+		LD_MAP_FD(BPF_REG_1, map_fd),
+		MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, -48),
+		CALL(BPF_FUNC_map_delete_elem),
+
+		MOV64_IMM(BPF_REG_0, 1),
+		EXIT(),
+	};
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCK_OPS;
+	attr.insns = (u_int64_t) (unsigned long) prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (u_int64_t) (unsigned long) "GPL";
+
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/*
+** Create the socket ownership map, load the program maintaining it and
+** attach the program to the cgroup v2 hierarchy at "cgroup".
+** Called before privileges are dropped.
+** Returns 0 on success, or -1 with errno set.
+*/
+
+int bpf_lookup_open(const char *cgroup) {
+	union bpf_attr attr;
+	int prog_fd;
+	int cgroup_fd;
+	int saved_errno;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_LRU_HASH;
+	attr.key_size = sizeof(struct bpf_sock_key);
+	attr.value_size = sizeof(u_int32_t);
+	attr.max_entries = BPF_MAP_ENTRIES;
+
+	bpf_map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (bpf_map_fd == -1) {
+		debug("bpf(BPF_MAP_CREATE): %s", strerror(errno));
+		return -1;
+	}
+
+	prog_fd = bpf_gen_prog(bpf_map_fd);
+	if (prog_fd == -1) {
+		debug("bpf(BPF_PROG_LOAD): %s", strerror(errno));
+		goto out_fail;
+	}
+
+	cgroup_fd = open(cgroup, O_RDONLY | O_DIRECTORY);
+	if (cgroup_fd == -1) {
+		debug("open: %s: %s", cgroup, strerror(errno));
+		close(prog_fd);
+		goto out_fail;
+	}
+
+	/*
+	** The link detaches the program once the last reference to it is
+	** closed, so the program never outlives the daemon.
+	*/
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = (u_int32_t) prog_fd;
+	attr.link_create.target_fd = (u_int32_t) cgroup_fd;
+	attr.link_create.attach_type = BPF_CGROUP_SOCK_OPS;
+
+	bpf_link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	saved_errno = errno;
+
+	close(cgroup_fd);
+	close(prog_fd);
+
+	if (bpf_link_fd == -1) {
+		errno = saved_errno;
+		debug("bpf(BPF_LINK_CREATE): %s: %s", cgroup, strerror(errno));
+		goto out_fail;
+	}
+
+	return 0;
+
+out_fail:
+	saved_errno = errno;
+	close(bpf_map_fd);
+	bpf_map_fd = -1;
+	errno = saved_errno;
+	return -1;
+}
+
+/*
+** Returns the UID of the owner of a connection recorded in the socket
+** ownership map under the address family "family", or MISSING_UID if the
+** connection is not in the map.
+*/
+
+uid_t bpf_lookup(const struct conn_tuple *tuple, int family) {
+	union bpf_attr attr;
+	struct bpf_sock_key key;
+	u_int32_t uid;
+
+	if (bpf_map_fd == -1)
+		return MISSING_UID;
+
+	memset(&key, 0, sizeof(key));
+	key.family = (u_int32_t) family;
+	key.lport = ntohs(tuple->lport);
+	key.fport = tuple->fport;
+	memcpy(key.laddr, tuple_addr_raw(&tuple->laddr, family),
+		tuple_addr_len(family));
+	memcpy(key.faddr, tuple_addr_raw(&tuple->faddr, family),
+		tuple_addr_len(family));
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (u_int32_t) bpf_map_fd;
+	attr.key = (u_int64_t) (unsigned long) &key;
+	attr.value = (u_int64_t) (unsigned long) &uid;
+
+	if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) != 0) {
+		if (errno != ENOENT)
+			debug("bpf(BPF_MAP_LOOKUP_ELEM): %s", strerror(errno));
+
+		return MISSING_UID;
+	}
+
+	return (uid_t) uid;
+}
+
+#endif
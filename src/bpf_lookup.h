@@ -0,0 +1,30 @@
+/*
+** bpf_lookup.h - oidentd eBPF socket ownership map.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_BPF_LOOKUP_H
+#define __OIDENTD_BPF_LOOKUP_H
+
+#if BPF_SUPPORT
+
+int bpf_lookup_open(const char *cgroup);
+
+uid_t bpf_lookup(const struct conn_tuple *tuple, int family);
+
+#endif
+
+#endif
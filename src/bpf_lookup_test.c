@@ -0,0 +1,243 @@
+/*
+** bpf_lookup_test.c - Loopback test of the oidentd eBPF socket ownership map.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "options.h"
+#include "bpf_lookup.h"
+
+/*
+** Exit status telling the test harness that the test was skipped.
+*/
+
+#define TEST_SKIP			77
+
+/*
+** Number of times the map is checked for the removal of a closed
+** connection, and the number of microseconds between checks.
+*/
+
+#define TEST_CLOSE_TRIES	100
+#define TEST_CLOSE_DELAY	10000
+
+bool opt_enabled(u_int32_t option __notused) {
+	return false;
+}
+
+#if BPF_SUPPORT
+
+#include <linux/magic.h>
+
+static int cgroup_join(const char *cgroup);
+static int test_lookup(void);
+
+/*
+** Move the calling process into the cgroup "cgroup".
+** Returns 0 on success, or -1 with errno set.
+*/
+
+static int cgroup_join(const char *cgroup) {
+	char path[PATH_MAX];
+	char pid[32];
+	int fd;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup);
+	snprintf(pid, sizeof(pid), "%ld\n", (long) getpid());
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1)
+		return -1;
+
+	ret = write(fd, pid, strlen(pid)) == (ssize_t) strlen(pid) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/*
+** Connect to a listener over 127.0.0.1 and check that the map records the
+** connection as ours while it is open, and forgets it once it is closed.
+** Returns 0 on success, or -1 on failure.
+*/
+
+static int test_lookup(void) {
+	struct sockaddr_storage laddr;
+	struct sockaddr_storage faddr;
+	struct conn_tuple tuple;
+	socklen_t len;
+	int listener;
+	int client;
+	int server;
+	uid_t uid;
+	int i;
+
+	memset(&faddr, 0, sizeof(faddr));
+	sin_setv4(htonl(INADDR_LOOPBACK), &faddr);
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == -1 ||
+		bind(listener, (struct sockaddr *) &faddr, sin_len(&faddr)) != 0 ||
+		listen(listener, 1) != 0)
+	{
+		fprintf(stderr, "listen: 127.0.0.1: %s\n", strerror(errno));
+		return -1;
+	}
+
+	len = sizeof(faddr);
+	getsockname(listener, (struct sockaddr *) &faddr, &len);
+
+	client = socket(AF_INET, SOCK_STREAM, 0);
+	if (client == -1 ||
+		connect(client, (struct sockaddr *) &faddr, sin_len(&faddr)) != 0)
+	{
+		fprintf(stderr, "connect: 127.0.0.1: %s\n", strerror(errno));
+		return -1;
+	}
+
+	server = accept(listener, NULL, NULL);
+	close(listener);
+
+	if (server == -1) {
+		fprintf(stderr, "accept: %s\n", strerror(errno));
+		return -1;
+	}
+
+	len = sizeof(laddr);
+	getsockname(client, (struct sockaddr *) &laddr, &len);
+	tuple_set(&tuple, &laddr, &faddr, sin_port(&laddr), sin_port(&faddr));
+
+	uid = bpf_lookup(&tuple, AF_INET);
+	if (uid != getuid()) {
+		if (uid == MISSING_UID)
+			fprintf(stderr, "FAIL: open connection not in the map\n");
+		else
+			fprintf(stderr, "FAIL: map returned %lu, expected %lu\n",
+				(unsigned long) uid, (unsigned long) getuid());
+
+		close(client);
+		close(server);
+		return -1;
+	}
+
+	/*
+	** The entry is removed once the connection reaches TCP_CLOSE, which
+	** happens once the peer acknowledges our FIN after its own.
+	*/
+
+	close(server);
+	close(client);
+
+	for (i = 0; i < TEST_CLOSE_TRIES; ++i) {
+		if (bpf_lookup(&tuple, AF_INET) == MISSING_UID)
+			return 0;
+
+		usleep(TEST_CLOSE_DELAY);
+	}
+
+	fprintf(stderr, "FAIL: closed connection still in the map\n");
+	return -1;
+}
+
+/*
+** Load the program on a cgroup created under the cgroup2 mount named by
+** OIDENTD_TEST_CGROUP, or DEFAULT_BPF_CGROUP, and run the test from within
+** that cgroup.  Skipped unless run as root.
+*/
+
+int main(void) {
+	char cgroup[PATH_MAX];
+	struct statfs sfs;
+	const char *mount;
+	int ret;
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "SKIP: must be run as root\n");
+		return TEST_SKIP;
+	}
+
+	mount = getenv("OIDENTD_TEST_CGROUP");
+	if (!mount)
+		mount = DEFAULT_BPF_CGROUP;
+
+	if (statfs(mount, &sfs) != 0 || sfs.f_type != CGROUP2_SUPER_MAGIC) {
+		fprintf(stderr, "SKIP: %s is not a cgroup2 mount\n", mount);
+		return TEST_SKIP;
+	}
+
+	snprintf(cgroup, sizeof(cgroup), "%s/oidentd-test.%ld",
+		mount, (long) getpid());
+
+	if (mkdir(cgroup, 0755) != 0) {
+		fprintf(stderr, "SKIP: mkdir: %s: %s\n", cgroup, strerror(errno));
+		return TEST_SKIP;
+	}
+
+	if (bpf_lookup_open(cgroup) != 0) {
+		fprintf(stderr, "SKIP: cannot load the program on %s: %s\n",
+			cgroup, strerror(errno));
+		rmdir(cgroup);
+		return TEST_SKIP;
+	}
+
+	if (cgroup_join(cgroup) != 0) {
+		fprintf(stderr, "SKIP: cannot join %s: %s\n", cgroup, strerror(errno));
+		rmdir(cgroup);
+		return TEST_SKIP;
+	}
+
+	ret = test_lookup();
+
+	if (cgroup_join(mount) == 0)
+		rmdir(cgroup);
+
+	if (ret == 0)
+		printf("PASS: bpf_lookup\n");
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#else
+
+int main(void) {
+	fprintf(stderr, "SKIP: built without eBPF support\n");
+	return TEST_SKIP;
+}
+
+#endif
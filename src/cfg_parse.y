@@ -48,6 +48,9 @@ extern int parser_mode;
 
 static FILE *open_user_config(const struct passwd *pw);
 static int extract_port_range(const char *token, struct port_range *range);
+static int extract_cgroup(char *token, struct cgroup_match *cgroup);
+static int extract_mark(const char *token, struct mark_match *mark);
+static int extract_forward_hosts(const char *token, struct forward_data *forward);
 static void free_cap_entries(struct user_cap *free_cap);
 static void yyerror(const char *err);
 
@@ -74,6 +77,9 @@ u_int16_t default_caps;
 %token TOK_TO
 %token TOK_FPORT
 %token TOK_LPORT
+%token TOK_COMM
+%token TOK_CGROUP
+%token TOK_MARK
 %token TOK_FORCE
 %token TOK_REPLY
 %token TOK_FORWARD
@@ -199,10 +205,18 @@ rule_specification:
 	from_statement
 |
 	lport_statement
+|
+	comm_statement
+|
+	cgroup_statement
+|
+	mark_statement
 ;
 
 to_statement:
 	TOK_TO TOK_STRING {
+		struct sockaddr_storage addr;
+
 		if (cur_cap->dest) {
 			if (parser_mode == PARSE_SYSTEM) {
 				o_log(LOG_CRIT, "[line %u] 'to' can only be specified once",
@@ -214,9 +228,7 @@ to_statement:
 			YYABORT;
 		}
 
-		cur_cap->dest = xmalloc(sizeof(struct sockaddr_storage));
-
-		if (get_addr($2, cur_cap->dest) == -1) {
+		if (get_addr($2, &addr) == -1) {
 			if (parser_mode == PARSE_SYSTEM) {
 				o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"",
 					current_line, $2);
@@ -227,6 +239,9 @@ to_statement:
 			YYABORT;
 		}
 
+		cur_cap->dest = xmalloc(sizeof(struct tuple_addr));
+		tuple_addr_from_sin(cur_cap->dest, &addr);
+
 		free($2);
 	}
 ;
@@ -261,6 +276,8 @@ fport_statement:
 
 from_statement:
 	TOK_FROM TOK_STRING {
+		struct sockaddr_storage addr;
+
 		if (cur_cap->src) {
 			if (parser_mode == PARSE_SYSTEM) {
 				o_log(LOG_CRIT, "[line %u] 'from' can only be specified once",
@@ -272,9 +289,7 @@ from_statement:
 			YYABORT;
 		}
 
-		cur_cap->src = xmalloc(sizeof(struct sockaddr_storage));
-
-		if (get_addr($2, cur_cap->src) == -1) {
+		if (get_addr($2, &addr) == -1) {
 			if (parser_mode == PARSE_SYSTEM) {
 				o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"",
 					current_line, $2);
@@ -285,6 +300,9 @@ from_statement:
 			YYABORT;
 		}
 
+		cur_cap->src = xmalloc(sizeof(struct tuple_addr));
+		tuple_addr_from_sin(cur_cap->src, &addr);
+
 		free($2);
 	}
 ;
@@ -317,6 +335,88 @@ lport_statement:
 	}
 ;
 
+comm_statement:
+	TOK_COMM TOK_STRING {
+		if (cur_cap->comm) {
+			if (parser_mode == PARSE_SYSTEM) {
+				o_log(LOG_CRIT, "[line %u] 'comm' can only be specified once",
+					current_line);
+			}
+
+			free($2);
+			free_cap_entries(cur_cap);
+			YYABORT;
+		}
+
+		if (*$2 == '\0' || strlen($2) >= MAX_COMM_LEN) {
+			if (parser_mode == PARSE_SYSTEM) {
+				o_log(LOG_CRIT, "[line %u] Bad process name: \"%s\"",
+					current_line, $2);
+			}
+
+			free($2);
+			free_cap_entries(cur_cap);
+			YYABORT;
+		}
+
+		cur_cap->comm = $2;
+	}
+;
+
+cgroup_statement:
+	TOK_CGROUP TOK_STRING {
+		if (cur_cap->cgroup) {
+			if (parser_mode == PARSE_SYSTEM) {
+				o_log(LOG_CRIT, "[line %u] 'cgroup' can only be specified once",
+					current_line);
+			}
+
+			free($2);
+			free_cap_entries(cur_cap);
+			YYABORT;
+		}
+
+		cur_cap->cgroup = xcalloc(1, sizeof(struct cgroup_match));
+
+		if (extract_cgroup($2, cur_cap->cgroup) == -1) {
+			if (parser_mode == PARSE_SYSTEM)
+				o_log(LOG_CRIT, "[line %u] Bad cgroup: \"%s\"", current_line, $2);
+
+			free($2);
+			free_cap_entries(cur_cap);
+			YYABORT;
+		}
+	}
+;
+
+mark_statement:
+	TOK_MARK TOK_STRING {
+		if (cur_cap->mark) {
+			if (parser_mode == PARSE_SYSTEM) {
+				o_log(LOG_CRIT, "[line %u] 'mark' can only be specified once",
+					current_line);
+			}
+
+			free($2);
+			free_cap_entries(cur_cap);
+			YYABORT;
+		}
+
+		cur_cap->mark = xmalloc(sizeof(struct mark_match));
+
+		if (extract_mark($2, cur_cap->mark) == -1) {
+			if (parser_mode == PARSE_SYSTEM)
+				o_log(LOG_CRIT, "[line %u] Bad mark: \"%s\"", current_line, $2);
+
+			free($2);
+			free_cap_entries(cur_cap);
+			YYABORT;
+		}
+
+		free($2);
+	}
+;
+
 cap_rule:
 	cap_statement
 |
@@ -351,12 +451,12 @@ force_forward:
 	TOK_FORCE TOK_FORWARD TOK_STRING TOK_STRING {
 		cur_cap->caps = CAP_FORWARD;
 		cur_cap->action = ACTION_FORCE;
-		cur_cap->data.forward.host = xmalloc(sizeof(struct sockaddr_storage));
 
-		if (get_addr($3, cur_cap->data.forward.host) == -1) {
+		if (extract_forward_hosts($3, &cur_cap->data.forward) == -1) {
 			if (parser_mode == PARSE_SYSTEM) {
-				o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"",
-					current_line, $3);
+				o_log(LOG_CRIT,
+					"[line %u] Bad address or more than %d addresses: \"%s\"",
+					current_line, MAX_FORWARD_HOSTS, $3);
 			}
 
 			free($3); free($4);
@@ -434,12 +534,12 @@ user_reply:
 user_forward:
 	TOK_FORWARD TOK_STRING TOK_STRING {
 		cur_cap->caps = CAP_FORWARD;
-		cur_cap->data.forward.host = xmalloc(sizeof(struct sockaddr_storage));
 
-		if (get_addr($2, cur_cap->data.forward.host) == -1) {
+		if (extract_forward_hosts($2, &cur_cap->data.forward) == -1) {
 			if (parser_mode == PARSE_SYSTEM) {
-				o_log(LOG_CRIT, "[line %u] Bad address: \"%s\"",
-					current_line, $2);
+				o_log(LOG_CRIT,
+					"[line %u] Bad address or more than %d addresses: \"%s\"",
+					current_line, MAX_FORWARD_HOSTS, $2);
 			}
 
 			free($2); free($3);
@@ -616,6 +716,94 @@ static int extract_port_range(const char *token, struct port_range *range) {
 	return 0;
 }
 
+/*
+** Extract a cgroup from a token: either a numeric cgroup ID, or the path of
+** a cgroup relative to the root of the cgroup v2 hierarchy.  Takes
+** ownership of the token.
+*/
+
+static int extract_cgroup(char *token, struct cgroup_match *cgroup) {
+	if (isdigit((unsigned char) *token)) {
+		char *end;
+
+		cgroup->id = strtoull(token, &end, 10);
+		if (*end != '\0')
+			return -1;
+
+		free(token);
+		return 0;
+	}
+
+	if (*token != '/')
+		return -1;
+
+	cgroup->path = token;
+	return 0;
+}
+
+/*
+** Extract a socket mark from a token of the form "value[/mask]".
+*/
+
+static int extract_mark(const char *token, struct mark_match *mark) {
+	unsigned long value;
+	unsigned long mask = 0xffffffffUL;
+	char *end;
+
+	errno = 0;
+	value = strtoul(token, &end, 0);
+	if (errno != 0 || end == token || value > 0xffffffffUL)
+		return -1;
+
+	if (*end == '/') {
+		const char *p = end + 1;
+
+		mask = strtoul(p, &end, 0);
+		if (errno != 0 || end == p || mask > 0xffffffffUL)
+			return -1;
+	}
+
+	if (*end != '\0')
+		return -1;
+
+	mark->value = (u_int32_t) (value & mask);
+	mark->mask = (u_int32_t) mask;
+	return 0;
+}
+
+/*
+** Extract the hosts to forward queries to from a comma-separated list of
+** addresses.
+*/
+
+static int extract_forward_hosts(const char *token, struct forward_data *forward) {
+	char *copy = xstrdup(token);
+	char *saveptr;
+	char *tok;
+	int ret = 0;
+
+	for (tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		if (forward->num >= MAX_FORWARD_HOSTS) {
+			ret = -1;
+			break;
+		}
+
+		forward->host = xrealloc(forward->host,
+			++forward->num * sizeof(struct sockaddr_storage));
+
+		if (get_addr(tok, &forward->host[forward->num - 1]) == -1) {
+			ret = -1;
+			break;
+		}
+	}
+
+	if (forward->num == 0)
+		ret = -1;
+
+	free(copy);
+	return ret;
+}
+
 static void free_cap_entries(struct user_cap *free_cap) {
 	user_db_cap_destroy_data(free_cap);
 
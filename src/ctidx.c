@@ -0,0 +1,954 @@
+/*
+** ctidx.c - oidentd Linux conntrack NAT index.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+/*
+** Looking up the conntrack entry of a masqueraded connection costs a
+** netlink round trip per query, and requires privileges oidentd does not
+** keep.
+**
+** Instead, a privileged indexer process is started before privileges are
+** dropped.  It subscribes to the conntrack events of new and destroyed
+** connections, seeds an index with a dump of the conntrack table, and keeps
+** the index up to date from the events.  The index only holds TCP
+** connections whose addresses are translated, keyed on their reply tuple,
+** which is the reverse of the tuple of an Ident query for them, and their
+** conntrack zone, since connections in different zones may share a reply
+** tuple; the zone is left out of the hash, so that lookups may ignore it.
+** Marks are recorded as they were when the connection was created,
+** as changes to them are not subscribed to.  If events
+** are lost because the socket buffer overran, the index is rebuilt from a
+** new dump.  Connections that were created while the index was full are
+** missing from it, so it is rebuilt as well once enough of them are gone,
+** or if the dump failed; such rebuilds are attempted at most once every
+** CTIDX_REBUILD_INTERVAL seconds.
+**
+** As with the process index, the index consists of two open-addressed hash
+** tables: events are applied to the active table, and rebuilds fill the
+** inactive one and then swap them.  The indexer is the only writer; readers
+** retry if the sequence counter of the table they read changed while they
+** read it.
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <endian.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "inet_util.h"
+#include "missing.h"
+#include "ctidx.h"
+
+#if CTIDX_SUPPORT
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+
+/*
+** Number of slots of each table; must be a power of two.  Connections are
+** not indexed once three quarters of the slots are in use.
+*/
+
+#define CTIDX_SLOTS		131072
+
+/*
+** Minimum number of seconds between rebuilds of a table that is full or
+** could not be filled.  A full table is rebuilt once less than half of its
+** slots are in use.
+*/
+
+#define CTIDX_REBUILD_INTERVAL	1
+
+/*
+** Receive buffer size of the event socket.  Events are lost, and the index
+** rebuilt, if more than this many bytes of events are pending.
+*/
+
+#define CTIDX_RCVBUF	(4 * 1024 * 1024)
+
+/*
+** Number of times a lookup is retried while the indexer modifies the table.
+*/
+
+#define CTIDX_RETRIES	16
+
+struct ctidx_entry {
+	struct conn_tuple reply;
+	struct conn_tuple orig;
+	u_int32_t hash;
+	u_int16_t family;
+	u_int16_t zone;
+	u_int32_t mark;
+};
+
+struct ctidx_table {
+	volatile u_int32_t seq;
+	u_int32_t used;
+	u_int32_t full;
+	struct ctidx_entry entries[CTIDX_SLOTS];
+};
+
+struct ctidx_shared {
+	volatile u_int32_t active;
+	volatile u_int32_t ready;
+	unsigned long events;
+	unsigned long resyncs;
+	unsigned long lag_samples;
+	unsigned long lag_last;
+	unsigned long lag_max;
+	struct ctidx_table tables[2];
+};
+
+/*
+** A conntrack entry, as decoded from a netlink message.  "tstamp" is the
+** time the connection was created, or destroyed for destroy events, in
+** nanoseconds since the epoch, or 0 if conntrack timestamps are disabled.
+*/
+
+struct ctidx_ct {
+	int family;
+	u_int8_t proto;
+	u_int16_t zone;
+	u_int32_t mark;
+	u_int32_t status;
+	u_int64_t tstamp;
+	struct conn_tuple orig;
+	struct conn_tuple reply;
+};
+
+static struct ctidx_shared *ctidx_shm;
+
+static void ctidx_indexer(int life_fd, int ev_sock) __noreturn;
+static int ctidx_ev_open(void);
+static void ctidx_ev_read(int sock);
+static bool ctidx_dump(struct ctidx_table *table);
+static void ctidx_rebuild(void);
+static void ctidx_recover(void);
+static void ctidx_apply(struct ctidx_table *table, struct nlmsghdr *h,
+			bool event);
+static bool ctidx_parse(struct nlmsghdr *h, struct ctidx_ct *ct);
+static bool ctidx_parse_tuple(struct rtattr *attr, int family,
+			struct conn_tuple *tuple, u_int8_t *proto);
+static void ctidx_record_lag(u_int64_t tstamp);
+static size_t ctidx_slot(u_int32_t hash);
+static int ctidx_find(const struct conn_tuple *reply, int zone,
+			u_int32_t hash, struct conn_tuple *orig, int *family,
+			u_int32_t *mark);
+static void ctidx_begin(struct ctidx_table *table);
+static void ctidx_end(struct ctidx_table *table);
+static bool ctidx_put(struct ctidx_table *table, const struct ctidx_ct *ct);
+static void ctidx_del(struct ctidx_table *table, const struct conn_tuple *reply,
+			u_int16_t zone);
+
+/*
+** Set up the index, subscribe to conntrack events, and start the indexer
+** process.
+** Called before privileges are dropped.
+** Returns 0 on success, or -1 with errno set.
+*/
+
+int ctidx_open(void) {
+	int fds[2];
+	int ev_sock;
+	pid_t child;
+	void *mem;
+
+	ev_sock = ctidx_ev_open();
+	if (ev_sock == -1)
+		return -1;
+
+	mem = mmap(NULL, sizeof(*ctidx_shm), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		debug("mmap: %s", strerror(errno));
+		close(ev_sock);
+		return -1;
+	}
+
+	if (pipe(fds) == -1) {
+		debug("pipe: %s", strerror(errno));
+		munmap(mem, sizeof(*ctidx_shm));
+		close(ev_sock);
+		return -1;
+	}
+
+	ctidx_shm = mem;
+
+	/*
+	** As with the process indexer, the indexer is detached by forking
+	** twice, and exits once every copy of the write end of the pipe has
+	** been closed.  Nothing is ever written to the pipe.
+	*/
+
+	child = fork();
+	if (child == -1) {
+		debug("fork: %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		close(ev_sock);
+		munmap(mem, sizeof(*ctidx_shm));
+		ctidx_shm = NULL;
+		return -1;
+	}
+
+	if (child == 0) {
+		close(fds[1]);
+
+		if (fork() == 0)
+			ctidx_indexer(fds[0], ev_sock);
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[0]);
+	close(ev_sock);
+	waitpid(child, NULL, 0);
+
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+static size_t ctidx_slot(u_int32_t hash) {
+	return (size_t) hash & (CTIDX_SLOTS - 1);
+}
+
+/*
+** Look up a reply tuple of a zone, or of any zone if "zone" is -1, in the
+** active table.  Returns 1 if it was found, 0 if it was not, or -1 if the
+** table was modified during the lookup.
+*/
+
+static int ctidx_find(const struct conn_tuple *reply, int zone,
+			u_int32_t hash, struct conn_tuple *orig, int *family,
+			u_int32_t *mark)
+{
+	struct ctidx_table *table;
+	u_int32_t active;
+	u_int32_t seq;
+	size_t i;
+	size_t n;
+	int ret = 0;
+
+	active = ctidx_shm->active;
+	table = &ctidx_shm->tables[active & 1];
+
+	seq = table->seq;
+	__sync_synchronize();
+
+	if (seq & 1)
+		return -1;
+
+	for (i = ctidx_slot(hash), n = 0; n < CTIDX_SLOTS; i = (i + 1) & (CTIDX_SLOTS - 1), ++n) {
+		const struct ctidx_entry *entry = &table->entries[i];
+
+		if (entry->family == 0)
+			break;
+
+		if (entry->hash == hash && (zone == -1 || entry->zone == zone) &&
+			tuple_equal(&entry->reply, reply))
+		{
+			*orig = entry->orig;
+			*family = entry->family;
+			*mark = entry->mark;
+			ret = 1;
+			break;
+		}
+	}
+
+	__sync_synchronize();
+	if (table->seq != seq || ctidx_shm->active != active)
+		return -1;
+
+	return ret;
+}
+
+/*
+** Find the translated connection of conntrack zone "zone", or of any zone if
+** it is -1, whose reply tuple is "reply", and store its original tuple,
+** address family and mark in "orig", "family" and "mark".
+** Returns 1 if it was found, 0 if no such connection exists, or -1 if the
+** index cannot tell.
+*/
+
+int ctidx_lookup(	const struct conn_tuple *reply,
+					int zone,
+					struct conn_tuple *orig,
+					int *family,
+					u_int32_t *mark)
+{
+	u_int32_t hash;
+	size_t i;
+
+	if (!ctidx_shm || !ctidx_shm->ready)
+		return -1;
+
+	hash = tuple_hash(reply);
+
+	for (i = 0; i < CTIDX_RETRIES; ++i) {
+		int ret = ctidx_find(reply, zone, hash, orig, family, mark);
+
+		/* A full table does not hold every translated connection. */
+		if (ret == 0 && ctidx_shm->tables[ctidx_shm->active & 1].full)
+			return -1;
+
+		if (ret != -1)
+			return ret;
+
+		sched_yield();
+	}
+
+	debug("Conntrack index unavailable");
+	return -1;
+}
+
+/*
+** Log the size of the index and the number of events it has processed.
+*/
+
+void ctidx_report(void) {
+	const struct ctidx_table *table;
+
+	if (!ctidx_shm)
+		return;
+
+	table = &ctidx_shm->tables[ctidx_shm->active & 1];
+
+	if (ctidx_shm->lag_samples == 0) {
+		o_log(LOG_INFO, "Conntrack index: %lu connections%s, %lu events, "
+			"%lu resynchronizations, event lag unknown",
+			(unsigned long) table->used, table->full ? " (full)" : "",
+			ctidx_shm->events, ctidx_shm->resyncs);
+
+		return;
+	}
+
+	o_log(LOG_INFO, "Conntrack index: %lu connections%s, %lu events, "
+		"%lu resynchronizations, event lag %lu us (max %lu us)",
+		(unsigned long) table->used, table->full ? " (full)" : "",
+		ctidx_shm->events, ctidx_shm->resyncs,
+		ctidx_shm->lag_last, ctidx_shm->lag_max);
+}
+
+/*
+** Mark a table as being modified.
+*/
+
+static void ctidx_begin(struct ctidx_table *table) {
+	++table->seq;
+	__sync_synchronize();
+}
+
+static void ctidx_end(struct ctidx_table *table) {
+	__sync_synchronize();
+	++table->seq;
+}
+
+/*
+** Add a connection to the index, or replace the connection with the same
+** reply tuple and zone.  Returns false if the table is full.
+*/
+
+static bool ctidx_put(struct ctidx_table *table, const struct ctidx_ct *ct) {
+	struct ctidx_entry *entry;
+	u_int32_t hash = tuple_hash(&ct->reply);
+	size_t i = ctidx_slot(hash);
+
+	while (table->entries[i].family != 0 &&
+		(table->entries[i].hash != hash ||
+		table->entries[i].zone != ct->zone ||
+		!tuple_equal(&table->entries[i].reply, &ct->reply)))
+	{
+		i = (i + 1) & (CTIDX_SLOTS - 1);
+	}
+
+	entry = &table->entries[i];
+
+	if (entry->family == 0) {
+		if (table->used >= CTIDX_SLOTS / 4 * 3) {
+			table->full = 1;
+			return false;
+		}
+
+		++table->used;
+	}
+
+	entry->reply = ct->reply;
+	entry->orig = ct->orig;
+	entry->hash = hash;
+	entry->family = (u_int16_t) ct->family;
+	entry->zone = ct->zone;
+	entry->mark = ct->mark;
+
+	return true;
+}
+
+/*
+** Remove the connection with the given reply tuple and zone from the index.
+** The entries following it in its probe sequence are moved back, so that no
+** tombstones are left behind.
+*/
+
+static void ctidx_del(struct ctidx_table *table, const struct conn_tuple *reply,
+			u_int16_t zone)
+{
+	u_int32_t hash = tuple_hash(reply);
+	size_t i = ctidx_slot(hash);
+	size_t j;
+
+	for (;;) {
+		const struct ctidx_entry *entry = &table->entries[i];
+
+		if (entry->family == 0)
+			return;
+
+		if (entry->hash == hash && entry->zone == zone &&
+			tuple_equal(&entry->reply, reply))
+		{
+			break;
+		}
+
+		i = (i + 1) & (CTIDX_SLOTS - 1);
+	}
+
+	for (j = (i + 1) & (CTIDX_SLOTS - 1);
+		table->entries[j].family != 0;
+		j = (j + 1) & (CTIDX_SLOTS - 1))
+	{
+		size_t home = ctidx_slot(table->entries[j].hash);
+
+		/* The entry cannot move before its home slot. */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		table->entries[i] = table->entries[j];
+		i = j;
+	}
+
+	memset(&table->entries[i], 0, sizeof(table->entries[i]));
+	--table->used;
+}
+
+/*
+** Record the delay between a conntrack event and its processing.
+*/
+
+static void ctidx_record_lag(u_int64_t tstamp) {
+	struct timespec ts;
+	u_int64_t now;
+	unsigned long lag = 0;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
+		return;
+
+	now = (u_int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (now > tstamp)
+		lag = (unsigned long) ((now - tstamp) / 1000);
+
+	ctidx_shm->lag_last = lag;
+	if (lag > ctidx_shm->lag_max)
+		ctidx_shm->lag_max = lag;
+
+	++ctidx_shm->lag_samples;
+}
+
+/*
+** Decode a tuple attribute of a conntrack message.
+** Returns false if the tuple is incomplete.
+*/
+
+static bool ctidx_parse_tuple(struct rtattr *attr, int family,
+			struct conn_tuple *tuple, u_int8_t *proto)
+{
+	const size_t addr_len = family == AF_INET ? 4 : 16;
+	struct rtattr *rta;
+	int len;
+	int have = 0;
+
+	rta = RTA_DATA(attr);
+	len = RTA_PAYLOAD(attr);
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		struct rtattr *sub = RTA_DATA(rta);
+		int sublen = RTA_PAYLOAD(rta);
+
+		switch (rta->rta_type & NLA_TYPE_MASK) {
+			case CTA_TUPLE_IP:
+				for (; RTA_OK(sub, sublen); sub = RTA_NEXT(sub, sublen)) {
+					if (RTA_PAYLOAD(sub) < addr_len)
+						continue;
+
+					switch (sub->rta_type & NLA_TYPE_MASK) {
+						case CTA_IP_V4_SRC:
+						case CTA_IP_V6_SRC:
+							tuple_addr_set(&tuple->laddr, family, RTA_DATA(sub));
+							have |= 1;
+							break;
+
+						case CTA_IP_V4_DST:
+						case CTA_IP_V6_DST:
+							tuple_addr_set(&tuple->faddr, family, RTA_DATA(sub));
+							have |= 2;
+							break;
+					}
+				}
+
+				break;
+
+			case CTA_TUPLE_PROTO:
+				for (; RTA_OK(sub, sublen); sub = RTA_NEXT(sub, sublen)) {
+					switch (sub->rta_type & NLA_TYPE_MASK) {
+						case CTA_PROTO_NUM:
+							if (RTA_PAYLOAD(sub) >= sizeof(u_int8_t))
+								*proto = *(u_int8_t *) RTA_DATA(sub);
+							break;
+
+						case CTA_PROTO_SRC_PORT:
+							if (RTA_PAYLOAD(sub) >= sizeof(in_port_t)) {
+								memcpy(&tuple->lport, RTA_DATA(sub), sizeof(in_port_t));
+								have |= 4;
+							}
+							break;
+
+						case CTA_PROTO_DST_PORT:
+							if (RTA_PAYLOAD(sub) >= sizeof(in_port_t)) {
+								memcpy(&tuple->fport, RTA_DATA(sub), sizeof(in_port_t));
+								have |= 8;
+							}
+							break;
+					}
+				}
+
+				break;
+		}
+	}
+
+	return have == 15;
+}
+
+/*
+** Decode a conntrack message.
+** Returns false if the message does not describe a complete IP connection.
+*/
+
+static bool ctidx_parse(struct nlmsghdr *h, struct ctidx_ct *ct) {
+	struct nfgenmsg *nfg = NLMSG_DATA(h);
+	struct rtattr *rta;
+	int len;
+	int have = 0;
+
+	if (h->nlmsg_len < NLMSG_LENGTH(sizeof(*nfg)))
+		return false;
+
+	memset(ct, 0, sizeof(*ct));
+	ct->family = nfg->nfgen_family;
+
+	if (ct->family != AF_INET && (!WANT_IPV6 || ct->family != AF_INET6))
+		return false;
+
+	rta = (struct rtattr *) ((char *) nfg + NLMSG_ALIGN(sizeof(*nfg)));
+	len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*nfg));
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type & NLA_TYPE_MASK) {
+			case CTA_TUPLE_ORIG:
+				if (ctidx_parse_tuple(rta, ct->family, &ct->orig, &ct->proto))
+					have |= 1;
+				break;
+
+			case CTA_TUPLE_REPLY:
+			{
+				u_int8_t proto;
+
+				if (ctidx_parse_tuple(rta, ct->family, &ct->reply, &proto))
+					have |= 2;
+				break;
+			}
+
+			case CTA_STATUS:
+				if (RTA_PAYLOAD(rta) >= sizeof(u_int32_t)) {
+					memcpy(&ct->status, RTA_DATA(rta), sizeof(u_int32_t));
+					ct->status = ntohl(ct->status);
+				}
+				break;
+
+			/* Absent for connections of the default zone. */
+			case CTA_ZONE:
+				if (RTA_PAYLOAD(rta) >= sizeof(u_int16_t)) {
+					memcpy(&ct->zone, RTA_DATA(rta), sizeof(u_int16_t));
+					ct->zone = ntohs(ct->zone);
+				}
+				break;
+
+			case CTA_MARK:
+				if (RTA_PAYLOAD(rta) >= sizeof(u_int32_t)) {
+					memcpy(&ct->mark, RTA_DATA(rta), sizeof(u_int32_t));
+					ct->mark = ntohl(ct->mark);
+				}
+				break;
+
+			case CTA_TIMESTAMP:
+			{
+				struct rtattr *sub = RTA_DATA(rta);
+				int sublen = RTA_PAYLOAD(rta);
+				int type = NFNL_MSG_TYPE(h->nlmsg_type) == IPCTNL_MSG_CT_DELETE ?
+					CTA_TIMESTAMP_STOP : CTA_TIMESTAMP_START;
+
+				for (; RTA_OK(sub, sublen); sub = RTA_NEXT(sub, sublen)) {
+					if ((sub->rta_type & NLA_TYPE_MASK) == type &&
+						RTA_PAYLOAD(sub) >= sizeof(u_int64_t))
+					{
+						memcpy(&ct->tstamp, RTA_DATA(sub), sizeof(u_int64_t));
+						ct->tstamp = be64toh(ct->tstamp);
+					}
+				}
+
+				break;
+			}
+		}
+	}
+
+	return have == 3;
+}
+
+/*
+** Apply a conntrack message to a table.  "event" is set for messages
+** received as events, rather than as part of a dump.
+*/
+
+static void ctidx_apply(struct ctidx_table *table, struct nlmsghdr *h,
+			bool event)
+{
+	struct ctidx_ct ct;
+
+	if (NFNL_SUBSYS_ID(h->nlmsg_type) != NFNL_SUBSYS_CTNETLINK)
+		return;
+
+	if (!ctidx_parse(h, &ct) || ct.proto != IPPROTO_TCP)
+		return;
+
+	if (event) {
+		++ctidx_shm->events;
+
+		if (ct.tstamp != 0)
+			ctidx_record_lag(ct.tstamp);
+	}
+
+	switch (NFNL_MSG_TYPE(h->nlmsg_type)) {
+		case IPCTNL_MSG_CT_NEW:
+		{
+			bool full = table->full;
+
+			if (!(ct.status & IPS_NAT_MASK))
+				break;
+
+			if (!ctidx_put(table, &ct) && !full)
+				o_log(LOG_INFO, "Conntrack index full; not all connections are indexed");
+			break;
+		}
+
+		case IPCTNL_MSG_CT_DELETE:
+			ctidx_del(table, &ct.reply, ct.zone);
+			break;
+	}
+}
+
+/*
+** Fill a table with a dump of the conntrack table.
+** Returns false if the dump failed.
+*/
+
+static bool ctidx_dump(struct ctidx_table *table) {
+	struct sockaddr_nl nladdr;
+	struct {
+		struct nlmsghdr nlh;
+		struct nfgenmsg nfg;
+	} req;
+	char buf[65536];
+	bool ret = false;
+	int sock;
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+	if (sock == -1) {
+		debug("socket: %s", strerror(errno));
+		return false;
+	}
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = 1;
+	req.nfg.nfgen_family = AF_UNSPEC;
+	req.nfg.version = NFNETLINK_V0;
+
+	if (sendto(sock, &req, sizeof(req), 0,
+			(struct sockaddr *) &nladdr, sizeof(nladdr)) == -1)
+	{
+		debug("sendto: %s", strerror(errno));
+		goto out;
+	}
+
+	for (;;) {
+		struct nlmsghdr *h;
+		ssize_t n;
+		size_t len;
+
+		n = recv(sock, buf, sizeof(buf), 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			debug("recv: %s", strerror(errno));
+			goto out;
+		}
+
+		if (n == 0)
+			goto out;
+
+		h = (struct nlmsghdr *) buf;
+		len = (size_t) n;
+
+		for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE) {
+				ret = true;
+				goto out;
+			}
+
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(h);
+
+				debug("Conntrack dump failed: %s", strerror(-err->error));
+				goto out;
+			}
+
+			ctidx_apply(table, h, false);
+		}
+	}
+
+out:
+	close(sock);
+	return ret;
+}
+
+/*
+** Rebuild the index from a dump of the conntrack table into the inactive
+** table, and make it the active one.
+*/
+
+static void ctidx_rebuild(void) {
+	u_int32_t active = ctidx_shm->active;
+	struct ctidx_table *table = &ctidx_shm->tables[!(active & 1)];
+
+	ctidx_begin(table);
+	memset(table->entries, 0, sizeof(table->entries));
+	table->used = 0;
+	table->full = 0;
+
+	if (!ctidx_dump(table)) {
+		o_log(LOG_INFO, "Unable to dump conntrack table; "
+			"not all connections are indexed");
+		table->full = 1;
+	}
+
+	ctidx_end(table);
+
+	__sync_synchronize();
+	ctidx_shm->active = !(active & 1);
+
+	debug("Rebuilt conntrack index: %lu connections", (unsigned long) table->used);
+}
+
+/*
+** Rebuild the index if it does not hold every translated connection, and
+** it has room for them.
+*/
+
+static void ctidx_recover(void) {
+	static time_t last_attempt;
+	const struct ctidx_table *table = &ctidx_shm->tables[ctidx_shm->active & 1];
+	time_t now;
+
+	if (!table->full || table->used >= CTIDX_SLOTS / 2)
+		return;
+
+	now = time(NULL);
+	if (now - last_attempt < CTIDX_REBUILD_INTERVAL)
+		return;
+
+	last_attempt = now;
+
+	debug("Conntrack index incomplete; rebuilding");
+	++ctidx_shm->resyncs;
+	ctidx_rebuild();
+}
+
+/*
+** Subscribe to the events of new and destroyed conntrack entries.
+** Returns the socket, or -1 with errno set.
+*/
+
+static int ctidx_ev_open(void) {
+	struct sockaddr_nl nladdr;
+	const int groups[] = { NFNLGRP_CONNTRACK_NEW, NFNLGRP_CONNTRACK_DESTROY };
+	int rcvbuf = CTIDX_RCVBUF;
+	size_t i;
+	int sock;
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+	if (sock == -1)
+		return -1;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	if (bind(sock, (struct sockaddr *) &nladdr, sizeof(nladdr)) == -1)
+		goto out_fail;
+
+	for (i = 0; i < sizeof(groups) / sizeof(groups[0]); ++i) {
+		if (setsockopt(sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+				&groups[i], sizeof(groups[i])) == -1)
+		{
+			goto out_fail;
+		}
+	}
+
+	/* Going beyond rmem_max requires privileges. */
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE,
+			&rcvbuf, sizeof(rcvbuf)) == -1)
+	{
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	}
+
+	return sock;
+
+out_fail:
+	close(sock);
+	return -1;
+}
+
+/*
+** Apply the pending conntrack events.  If events were lost, the index is
+** rebuilt before the remaining events are applied.
+*/
+
+static void ctidx_ev_read(int sock) {
+	char buf[65536];
+
+	for (;;) {
+		struct ctidx_table *table;
+		struct nlmsghdr *h;
+		ssize_t ret;
+		size_t len;
+
+		ret = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret == -1) {
+			if (errno != ENOBUFS)
+				return;
+
+			debug("Conntrack events lost; rebuilding index");
+			++ctidx_shm->resyncs;
+			ctidx_rebuild();
+			continue;
+		}
+
+		h = (struct nlmsghdr *) buf;
+		len = (size_t) ret;
+		table = &ctidx_shm->tables[ctidx_shm->active & 1];
+
+		ctidx_begin(table);
+
+		for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len))
+			ctidx_apply(table, h, true);
+
+		ctidx_end(table);
+	}
+}
+
+/*
+** Main loop of the indexer process.
+*/
+
+static void ctidx_indexer(int life_fd, int ev_sock) {
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	/*
+	** Events received while the table is dumped are queued on the event
+	** socket, and applied once the dump is complete.
+	*/
+
+	ctidx_rebuild();
+	ctidx_shm->ready = 1;
+
+	for (;;) {
+		struct pollfd pfd[2];
+		int timeout = -1;
+
+		pfd[0].fd = life_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = ev_sock;
+		pfd[1].events = POLLIN;
+
+		/* An incomplete index is rebuilt even if no events arrive. */
+		if (ctidx_shm->tables[ctidx_shm->active & 1].full)
+			timeout = CTIDX_REBUILD_INTERVAL * 1000;
+
+		if (poll(pfd, 2, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			_exit(EXIT_FAILURE);
+		}
+
+		if (pfd[0].revents != 0)
+			_exit(EXIT_SUCCESS);
+
+		if (pfd[1].revents != 0)
+			ctidx_ev_read(ev_sock);
+
+		ctidx_recover();
+	}
+}
+
+#endif
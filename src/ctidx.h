@@ -0,0 +1,36 @@
+/*
+** ctidx.h - oidentd Linux conntrack NAT index.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_CTIDX_H
+#define __OIDENTD_CTIDX_H
+
+#if CTIDX_SUPPORT
+
+struct conn_tuple;
+
+int ctidx_open(void);
+int ctidx_lookup(	const struct conn_tuple *reply,
+					int zone,
+					struct conn_tuple *orig,
+					int *family,
+					u_int32_t *mark);
+void ctidx_report(void);
+
+#endif
+
+#endif
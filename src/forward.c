@@ -23,14 +23,15 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <signal.h>
-#include <setjmp.h>
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <pwd.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -41,102 +42,741 @@
 #include "inet_util.h"
 #include "options.h"
 #include "forward.h"
+#include "fwd_pool.h"
 
-static sigjmp_buf timebuf;
-static int fsock;
-static void fwd_alarm(int sig) __noreturn;
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
 
 /*
-** Make an Ident request to another machine and return its response,
-** if the request was successful.
+** Number of forwarded queries that can be tracked as in flight at once.
 */
 
-int forward_request(const struct sockaddr_storage *host,
+#define FWD_SLOTS		256
+
+/*
+** A forwarded query in flight.  Requests are served by forked children, so
+** the table lives in anonymous shared memory mapped by the parent.  A slot
+** is held until "expires", the deadline of the query it was taken for, so
+** that slots left behind by processes killed while forwarding a query are
+** freed.  Slots are taken by swapping in a new deadline with
+** FWD_SLOT_CLAIMING set, which is cleared once the address of the query has
+** been stored; until then, the slot is held but not counted.
+*/
+
+#define FWD_SLOT_CLAIMING	(1ULL << 63)
+
+struct fwd_slot {
+	struct tuple_addr addr;
+	in_port_t port;
+	volatile u_int64_t expires;
+};
+
+/*
+** Number of slots of the reply cache a key may be stored in, and the
+** longest user name it holds.
+*/
+
+#define FWD_CACHE_PROBE		4
+#define FWD_CACHE_ULEN		64
+
+/*
+** A reply to a forwarded query.  The key is the query as a tuple whose
+** local address is the host it was forwarded to and whose ports are those
+** of the query; "port" is the port of the Ident server of the host.  As in
+** the negative lookup cache, every slot is guarded by a sequence counter.
+*/
+
+struct fwd_cache_slot {
+	volatile u_int32_t seq;
+	struct conn_key key;
+	in_port_t port;
+	u_int64_t expires;
+	char user[FWD_CACHE_ULEN];
+};
+
+struct fwd_cache {
+	volatile unsigned long hits;
+	volatile unsigned long misses;
+	u_int32_t mask;
+	struct fwd_cache_slot slots[];
+};
+
+extern u_int32_t forward_timeout;
+extern u_int32_t forward_limit;
+extern u_int32_t forward_cache_ttl;
+extern u_int32_t forward_cache_size;
+
+static struct fwd_slot *fwd_slots;
+static struct fwd_cache *fwd_cache;
+
+static u_int64_t fwd_now(void);
+static int fwd_slot_take(const struct sockaddr_storage *addr, u_int64_t expires);
+static void fwd_slot_put(int slot);
+static void fwd_cache_key(	struct conn_key *key,
+						const struct sockaddr_storage *addr,
+						in_port_t lport,
+						in_port_t fport);
+static bool fwd_cache_read(	struct fwd_cache_slot *slot,
+						struct conn_key *key,
+						in_port_t *port,
+						u_int64_t *expires,
+						char *user);
+static bool fwd_cache_lookup(	const struct conn_key *key,
+							in_port_t port,
+							char *reply,
+							size_t len);
+static void fwd_cache_insert(	const struct conn_key *key,
+							in_port_t port,
+							const char *user);
+
+/*
+** Map the table of forwarded queries in flight, which limits the number of
+** queries forwarded to each host at once to "forward_limit", and the cache
+** of replies to forwarded queries, which holds up to "forward_cache_size"
+** replies for "forward_cache_ttl" milliseconds.  A limit, size or TTL of 0
+** disables the limit or the cache.  Must be called before the first child
+** is forked.
+** Returns 0 on success, or -1 with errno set.
+*/
+
+int forward_init(void) {
+	void *mem;
+
+	if (forward_limit != 0) {
+		mem = mmap(NULL, sizeof(*fwd_slots) * FWD_SLOTS, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+		if (mem == MAP_FAILED) {
+			debug("mmap: %s", strerror(errno));
+			return -1;
+		}
+
+		fwd_slots = mem;
+	}
+
+	if (forward_cache_ttl != 0 && forward_cache_size != 0) {
+		u_int32_t nslots = 1;
+
+		/* The number of slots is rounded up to a power of two. */
+		while (nslots < forward_cache_size)
+			nslots <<= 1;
+
+		mem = mmap(NULL, sizeof(*fwd_cache) + sizeof(fwd_cache->slots[0]) * nslots,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+		if (mem == MAP_FAILED) {
+			debug("mmap: %s", strerror(errno));
+			return -1;
+		}
+
+		fwd_cache = mem;
+		fwd_cache->mask = nslots - 1;
+	}
+
+	return 0;
+}
+
+/*
+** Returns the value of a monotonic clock in milliseconds.
+*/
+
+static u_int64_t fwd_now(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+
+	return (u_int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+** Take a slot for a query forwarded to "addr", unless "forward_limit"
+** queries are already in flight to it.  The slot is taken before the
+** queries in flight are counted, so that processes racing for the last
+** slot of a host both give up rather than both go ahead.
+** Returns the slot, -1 if no slot is needed, or -2 if the limit is reached.
+*/
+
+static int fwd_slot_take(const struct sockaddr_storage *addr, u_int64_t expires) {
+	struct tuple_addr taddr;
+	in_port_t port = sin_port(addr);
+	u_int64_t now = fwd_now();
+	u_int32_t count = 0;
+	int slot = -1;
+	size_t i;
+
+	if (!fwd_slots)
+		return -1;
+
+	tuple_addr_from_sin(&taddr, (struct sockaddr_storage *) addr);
+
+	for (i = 0; i < FWD_SLOTS; ++i) {
+		u_int64_t cur = fwd_slots[i].expires;
+
+		if ((cur & ~FWD_SLOT_CLAIMING) >= now)
+			continue;
+
+		if (__sync_bool_compare_and_swap(&fwd_slots[i].expires, cur,
+				expires | FWD_SLOT_CLAIMING))
+		{
+			slot = (int) i;
+			break;
+		}
+	}
+
+	/* Without a slot, the query cannot be counted, but is not refused. */
+	if (slot == -1) {
+		debug("Too many forwarded queries in flight to track");
+		return -1;
+	}
+
+	fwd_slots[slot].addr = taddr;
+	fwd_slots[slot].port = port;
+	__sync_synchronize();
+	fwd_slots[slot].expires = expires;
+	__sync_synchronize();
+
+	for (i = 0; i < FWD_SLOTS; ++i) {
+		const struct fwd_slot *cur = &fwd_slots[i];
+		u_int64_t cur_expires = cur->expires;
+
+		if (!(cur_expires & FWD_SLOT_CLAIMING) && cur_expires >= now &&
+			cur->port == port && tuple_addr_equal(&cur->addr, &taddr))
+		{
+			++count;
+		}
+	}
+
+	if (count > forward_limit) {
+		fwd_slot_put(slot);
+		return -2;
+	}
+
+	return slot;
+}
+
+static void fwd_slot_put(int slot) {
+	if (slot < 0)
+		return;
+
+	__sync_synchronize();
+	fwd_slots[slot].expires = 0;
+}
+
+/*
+** Fill in the reply cache key of a query forwarded to "addr".
+*/
+
+static void fwd_cache_key(	struct conn_key *key,
+						const struct sockaddr_storage *addr,
+						in_port_t lport,
+						in_port_t fport)
+{
+	memset(&key->tuple, 0, sizeof(key->tuple));
+	tuple_addr_from_sin(&key->tuple.laddr, (struct sockaddr_storage *) addr);
+	key->tuple.lport = htons(lport);
+	key->tuple.fport = htons(fport);
+	key->hash = tuple_hash(&key->tuple);
+}
+
+/*
+** Take a consistent snapshot of a reply cache slot.  Returns false if the
+** slot is being written to.
+*/
+
+static bool fwd_cache_read(	struct fwd_cache_slot *slot,
+						struct conn_key *key,
+						in_port_t *port,
+						u_int64_t *expires,
+						char *user)
+{
+	u_int32_t seq;
+	int tries;
+
+	for (tries = 0; tries < 3; ++tries) {
+		seq = slot->seq;
+		__sync_synchronize();
+
+		if (seq & 1)
+			continue;
+
+		memcpy(key, &slot->key, sizeof(*key));
+		*port = slot->port;
+		*expires = slot->expires;
+
+		if (user)
+			memcpy(user, slot->user, sizeof(slot->user));
+
+		__sync_synchronize();
+		if (slot->seq == seq)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+** Find the cached reply to a forwarded query, and copy its user name to
+** "reply".  Returns true if it was found.
+*/
+
+static bool fwd_cache_lookup(	const struct conn_key *key,
+							in_port_t port,
+							char *reply,
+							size_t len)
+{
+	u_int64_t now;
+	size_t i;
+
+	if (!fwd_cache)
+		return false;
+
+	now = fwd_now();
+
+	for (i = 0; i < FWD_CACHE_PROBE; ++i) {
+		struct fwd_cache_slot *slot;
+		struct conn_key cur;
+		in_port_t cur_port;
+		u_int64_t expires;
+		char user[FWD_CACHE_ULEN];
+
+		slot = &fwd_cache->slots[(key->hash + i) & fwd_cache->mask];
+
+		if (!fwd_cache_read(slot, &cur, &cur_port, &expires, user))
+			continue;
+
+		if (expires > now && cur.hash == key->hash && cur_port == port &&
+			tuple_equal(&cur.tuple, &key->tuple))
+		{
+			__sync_fetch_and_add(&fwd_cache->hits, 1);
+			user[sizeof(user) - 1] = '\0';
+			xstrncpy(reply, user, len);
+			return true;
+		}
+	}
+
+	__sync_fetch_and_add(&fwd_cache->misses, 1);
+	return false;
+}
+
+/*
+** Cache the user name of a successful reply to a forwarded query.  The
+** entry replaces an existing entry for the same query, an expired entry,
+** or the entry that expires first, in that order of preference.  Names too
+** long for the cache are not cached.
+*/
+
+static void fwd_cache_insert(	const struct conn_key *key,
+							in_port_t port,
+							const char *user)
+{
+	struct fwd_cache_slot *victim = NULL;
+	u_int64_t victim_expires = 0;
+	u_int64_t now;
+	u_int32_t seq;
+	size_t i;
+
+	if (!fwd_cache || strlen(user) >= FWD_CACHE_ULEN)
+		return;
+
+	now = fwd_now();
+
+	for (i = 0; i < FWD_CACHE_PROBE; ++i) {
+		struct fwd_cache_slot *slot;
+		struct conn_key cur;
+		in_port_t cur_port;
+		u_int64_t expires;
+
+		slot = &fwd_cache->slots[(key->hash + i) & fwd_cache->mask];
+
+		if (!fwd_cache_read(slot, &cur, &cur_port, &expires, NULL))
+			continue;
+
+		if ((cur.hash == key->hash && cur_port == port &&
+			tuple_equal(&cur.tuple, &key->tuple)) || expires <= now)
+		{
+			victim = slot;
+			break;
+		}
+
+		if (!victim || expires < victim_expires) {
+			victim = slot;
+			victim_expires = expires;
+		}
+	}
+
+	if (!victim)
+		return;
+
+	/* Writers give up if another process holds the slot. */
+	seq = victim->seq;
+	if ((seq & 1) || !__sync_bool_compare_and_swap(&victim->seq, seq, seq + 1))
+		return;
+
+	victim->key = *key;
+	victim->port = port;
+	victim->expires = now + forward_cache_ttl;
+	xstrncpy(victim->user, user, sizeof(victim->user));
+
+	__sync_synchronize();
+	__sync_fetch_and_add(&victim->seq, 1);
+}
+
+/*
+** Start forwarding a query for the connection from "lport" to "fport" to
+** the Ident server listening on "port" of "host".  The query is sent and
+** its reply read by fwd_query_step() as its socket becomes ready.
+** Returns 0 on success, or -1 on failure.
+*/
+
+int fwd_query_start(struct fwd_query *query,
+					const struct sockaddr_storage *host,
 					in_port_t port,
 					in_port_t lport,
-					in_port_t fport,
-					char *reply,
-					size_t len)
+					in_port_t fport)
 {
-	struct sockaddr_storage addr;
 	char ipbuf[MAX_IPLEN];
-	char user[512];
-	char buf[1024];
+	int ret;
 
-	sin_copy(&addr, host);
-	sin_set_port(htons(port), &addr);
+	sin_copy(&query->addr, host);
+	sin_set_port(htons(port), &query->addr);
 
-	fsock = socket(addr.ss_family, SOCK_STREAM, 0);
-	if (fsock == -1) {
-		debug("socket: %s", strerror(errno));
+	query->sock = -1;
+	query->state = FWD_FAILED;
+	query->slot = -1;
+	query->off = 0;
+
+	ret = snprintf(query->buf, sizeof(query->buf), "%d,%d\r\n", lport, fport);
+	if (ret < 0 || (size_t) ret >= sizeof(query->buf))
 		return -1;
-	}
 
-	if (sigsetjmp(timebuf, 1) != 0) {
-		debug("sigsetjmp: %s", strerror(errno));
+	query->len = (size_t) ret;
+
+	query->slot = fwd_slot_take(&query->addr, fwd_now() + forward_timeout);
+	if (query->slot == -2) {
+		get_ip(&query->addr, ipbuf, sizeof(ipbuf));
+		o_log(LOG_INFO, "Too many queries forwarded to %s; not forwarding", ipbuf);
+		query->slot = -1;
 		return -1;
 	}
 
-	signal(SIGALRM, fwd_alarm);
+	/* Replies to queries handed to the pool are read as if connected. */
+	query->sock = fwd_pool_submit(&query->addr, lport, fport);
+	if (query->sock != -1) {
+		query->state = FWD_READ;
+		return 0;
+	}
+
+	query->sock = socket(query->addr.ss_family, SOCK_STREAM, 0);
+	if (query->sock == -1) {
+		debug("socket: %s", strerror(errno));
+		fwd_query_end(query);
+		return -1;
+	}
 
-	/*
-	** Five seconds should be plenty, seeing as we're forwarding to a machine
-	** on a local network.
-	*/
+	if (fcntl(query->sock, F_SETFL, fcntl(query->sock, F_GETFL) | O_NONBLOCK) == -1) {
+		debug("fcntl: %s", strerror(errno));
+		fwd_query_end(query);
+		return -1;
+	}
 
-	alarm(5);
+	if (connect(query->sock, (struct sockaddr *) &query->addr,
+			(socklen_t) sin_len(&query->addr)) == 0)
+	{
+		query->state = FWD_SEND;
+		return 0;
+	}
 
-	if (connect(fsock, (struct sockaddr *) &addr, (socklen_t) sin_len(&addr)) != 0) {
-		get_ip(&addr, ipbuf, sizeof(ipbuf));
+	if (errno != EINPROGRESS) {
+		get_ip(&query->addr, ipbuf, sizeof(ipbuf));
 		debug("connect to %s:%d: %s",
-			ipbuf, ntohs(sin_port(&addr)), strerror(errno));
-		goto out_fail;
+			ipbuf, ntohs(sin_port(&query->addr)), strerror(errno));
+		fwd_query_end(query);
+		return -1;
 	}
 
-	if (sockprintf(fsock, "%d,%d\r\n", lport, fport) < 1) {
-		debug("write: %s", strerror(errno));
-		goto out_fail;
+	query->state = FWD_CONNECT;
+	return 0;
+}
+
+/*
+** Returns the poll() events a forwarded query is waiting for.
+*/
+
+short fwd_query_events(const struct fwd_query *query) {
+	switch (query->state) {
+		case FWD_CONNECT:
+		case FWD_SEND:
+			return POLLOUT;
+
+		case FWD_READ:
+			return POLLIN;
+
+		default:
+			return 0;
 	}
+}
+
+/*
+** Advance a forwarded query whose socket reported "revents".
+** Returns 1 if the query is still in progress, 0 once its reply has been
+** read, or -1 if it failed.
+*/
+
+int fwd_query_step(struct fwd_query *query, short revents) {
+	char ipbuf[MAX_IPLEN];
+	ssize_t ret;
+
+	if (revents == 0)
+		return 1;
+
+	switch (query->state) {
+		case FWD_CONNECT:
+		{
+			int err = 0;
+			socklen_t errlen = sizeof(err);
+
+			if (getsockopt(query->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1)
+				err = errno;
+
+			if (err != 0) {
+				get_ip(&query->addr, ipbuf, sizeof(ipbuf));
+				debug("connect to %s:%d: %s",
+					ipbuf, ntohs(sin_port(&query->addr)), strerror(err));
+				goto out_fail;
+			}
+
+			query->state = FWD_SEND;
+		}
+			/* FALLTHROUGH */
+
+		case FWD_SEND:
+			ret = send(query->sock, query->buf + query->off,
+					query->len - query->off, MSG_NOSIGNAL);
+
+			if (ret == -1) {
+				if (errno == EAGAIN || errno == EINTR)
+					return 1;
+
+				debug("write: %s", strerror(errno));
+				goto out_fail;
+			}
+
+			query->off += (size_t) ret;
+			if (query->off < query->len)
+				return 1;
+
+			query->state = FWD_READ;
+			query->off = 0;
+			return 1;
+
+		case FWD_READ:
+			ret = recv(query->sock, query->buf + query->off,
+					sizeof(query->buf) - 1 - query->off, 0);
+
+			if (ret == -1) {
+				if (errno == EAGAIN || errno == EINTR)
+					return 1;
+
+				debug("read(%d): %s", query->sock, strerror(errno));
+				goto out_fail;
+			}
+
+			if (ret == 0 && query->off == 0) {
+				debug("read(%d): Connection closed", query->sock);
+				goto out_fail;
+			}
+
+			query->off += (size_t) ret;
+			query->buf[query->off] = '\0';
 
-	if (!sock_read(fsock, buf, sizeof(buf))) {
-		debug("read(%d): %s", fsock, strerror(errno));
-		goto out_fail;
+			/* Replies are a single line. */
+			if (ret != 0 && !memchr(query->buf, '\n', query->off) &&
+				query->off < sizeof(query->buf) - 1)
+			{
+				return 1;
+			}
+
+			query->state = FWD_DONE;
+			return 0;
+
+		case FWD_DONE:
+			return 0;
 	}
 
-	/*
-	** Don't time out once we've finished processing the request.
-	*/
+out_fail:
+	query->state = FWD_FAILED;
+	return -1;
+}
+
+/*
+** Extract the user name from the reply to a forwarded query.
+** Returns 0 on success, or -1 if the reply is not a USERID reply.
+*/
+
+int fwd_query_reply(struct fwd_query *query, char *reply, size_t len) {
+	char ipbuf[MAX_IPLEN];
+	char user[512];
 
-	alarm(0);
-	close(fsock);
+	if (query->state != FWD_DONE)
+		return -1;
 
-	if (sscanf(buf, "%*d , %*d : USERID :%*[^:]:%511s", user) != 1) {
-		char *p = strchr(buf, '\r');
+	if (sscanf(query->buf, "%*d , %*d : USERID :%*[^:]:%511s", user) != 1) {
+		char *p = strpbrk(query->buf, "\r\n");
 
 		if (p)
 			*p = '\0';
 
-		get_ip(&addr, ipbuf, sizeof(ipbuf));
-		debug("[%s] Remote response: \"%s\"", ipbuf, buf);
+		get_ip(&query->addr, ipbuf, sizeof(ipbuf));
+		debug("[%s] Remote response: \"%s\"", ipbuf, query->buf);
 		return -1;
 	}
 
 	xstrncpy(reply, user, len);
 	return 0;
-
-out_fail:
-	alarm(0);
-	close(fsock);
-	return -1;
 }
 
 /*
-** Handle the timeout of a forward request.
+** Close the socket of a forwarded query and release its slot.
 */
 
-static void fwd_alarm(int sig) {
-	o_log(LOG_INFO, "Forward timed out");
-	close(fsock);
-	siglongjmp(timebuf, sig);
+void fwd_query_end(struct fwd_query *query) {
+	if (query->sock != -1) {
+		close(query->sock);
+		query->sock = -1;
+	}
+
+	fwd_slot_put(query->slot);
+	query->slot = -1;
 }
 
+/*
+** Make an Ident request to the "num" machines in "hosts" and return the
+** first successful response.  The request is forwarded to one host after
+** another, to the next one if the previous ones have not answered within
+** FORWARD_STAGGER milliseconds or have failed, and the remaining requests
+** are given up on once one of them is answered.  All requests are given up
+** on after "forward_timeout" milliseconds.  Successful replies are cached
+** under the first host, so that repeated queries for a connection are not
+** forwarded again.
+*/
+
+int forward_request(const struct sockaddr_storage *hosts,
+					size_t num,
+					in_port_t port,
+					in_port_t lport,
+					in_port_t fport,
+					char *reply,
+					size_t len)
+{
+	struct fwd_query query[MAX_FORWARD_HOSTS];
+	struct pollfd pfd[MAX_FORWARD_HOSTS];
+	struct conn_key key;
+	char ipbuf[MAX_IPLEN];
+	u_int64_t deadline = fwd_now() + forward_timeout;
+	u_int64_t next_start = 0;
+	size_t started = 0;
+	size_t active = 0;
+	size_t i;
+	int ret = -1;
+
+	num = MIN(num, MAX_FORWARD_HOSTS);
+
+	fwd_cache_key(&key, &hosts[0], lport, fport);
+
+	if (fwd_cache_lookup(&key, port, reply, len)) {
+		get_ip((struct sockaddr_storage *) &hosts[0], ipbuf, sizeof(ipbuf));
+		debug("[%s] %d , %d : Cached forward reply (%lu hits, %lu misses)",
+			ipbuf, lport, fport, fwd_cache->hits, fwd_cache->misses);
+
+		return 0;
+	}
+
+	for (;;) {
+		u_int64_t now = fwd_now();
+		int timeout;
+
+		while (started < num && (active == 0 || now >= next_start)) {
+			if (fwd_query_start(&query[started], &hosts[started], port,
+					lport, fport) == 0)
+			{
+				next_start = now + FORWARD_STAGGER;
+				++active;
+			}
+
+			++started;
+		}
+
+		if (active == 0)
+			break;
+
+		if (now >= deadline) {
+			for (i = 0; i < started; ++i) {
+				if (query[i].sock == -1)
+					continue;
+
+				get_ip(&query[i].addr, ipbuf, sizeof(ipbuf));
+				o_log(LOG_INFO, "Forward to %s timed out", ipbuf);
+			}
+
+			break;
+		}
+
+		timeout = (int) (deadline - now);
+		if (started < num)
+			timeout = MIN(timeout, (int) (next_start - now));
+
+		for (i = 0; i < started; ++i) {
+			pfd[i].fd = query[i].sock;
+			pfd[i].events = fwd_query_events(&query[i]);
+			pfd[i].revents = 0;
+		}
+
+		if (poll(pfd, started, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			debug("poll: %s", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < started; ++i) {
+			int step;
+
+			if (query[i].sock == -1)
+				continue;
+
+			step = fwd_query_step(&query[i], pfd[i].revents);
+			if (step == 1)
+				continue;
+
+			if (step == 0 && fwd_query_reply(&query[i], reply, len) == 0) {
+				if (num > 1) {
+					get_ip(&query[i].addr, ipbuf, sizeof(ipbuf));
+					debug("[%s] %d , %d : Answered first, forwarded to %zu of %zu hosts",
+						ipbuf, lport, fport, started, num);
+				}
+
+				ret = 0;
+				break;
+			}
+
+			/* The next host need not wait for a host that has failed. */
+			fwd_query_end(&query[i]);
+			next_start = now;
+			--active;
+		}
+
+		if (ret == 0)
+			break;
+	}
+
+	for (i = 0; i < started; ++i)
+		fwd_query_end(&query[i]);
+
+	if (ret == 0)
+		fwd_cache_insert(&key, port, reply);
+
+	return ret;
+}
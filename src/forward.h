@@ -21,7 +21,49 @@
 #ifndef __OIDENTD_FORWARD_H
 #define __OIDENTD_FORWARD_H
 
-int forward_request(const struct sockaddr_storage *host,
+/*
+** The states of a forwarded query.
+*/
+
+enum {
+	FWD_CONNECT,
+	FWD_SEND,
+	FWD_READ,
+	FWD_DONE,
+	FWD_FAILED,
+};
+
+/*
+** A query forwarded to another host.  "buf" holds the query until it has
+** been sent, and then the reply as it is read; "off" is the number of bytes
+** of it sent or read so far.  "slot" is the entry of the query in the table
+** of forwarded queries in flight, or -1.
+*/
+
+struct fwd_query {
+	int sock;
+	int state;
+	int slot;
+	struct sockaddr_storage addr;
+	char buf[1024];
+	size_t len;
+	size_t off;
+};
+
+int forward_init(void);
+
+int fwd_query_start(struct fwd_query *query,
+					const struct sockaddr_storage *host,
+					in_port_t port,
+					in_port_t lport,
+					in_port_t fport);
+short fwd_query_events(const struct fwd_query *query);
+int fwd_query_step(struct fwd_query *query, short revents);
+int fwd_query_reply(struct fwd_query *query, char *reply, size_t len);
+void fwd_query_end(struct fwd_query *query);
+
+int forward_request(const struct sockaddr_storage *hosts,
+					size_t num,
 					in_port_t port,
 					in_port_t lport,
 					in_port_t fport,
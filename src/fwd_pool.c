@@ -0,0 +1,904 @@
+/*
+** fwd_pool.c - oidentd pool of connections to downstream Ident servers.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+/*
+** Forwarded requests are made by the process serving the query, which
+** exits once it has replied, so a connection to a downstream Ident server
+** cannot outlive the query it was opened for.
+**
+** Instead, a pool process keeps connections to the hosts queries are
+** forwarded to open, and sends the queries of every process over them.
+** RFC 1413 lets a client send several queries over one connection, which
+** the server answers in order; oidentd does so for queries from the host
+** given with --proxy.  Up to FWD_POOL_PIPELINE queries are outstanding on a
+** connection, and up to FWD_POOL_CONNS connections are opened to a host.
+** Idle connections are watched for the host closing them or sending
+** anything unasked for, and closed after FWD_POOL_IDLE milliseconds.
+** Hosts that close the connection after their first reply, with queries
+** still outstanding, are remembered, and their queries are sent over a new
+** connection each.
+**
+** A process hands a query to the pool by sending it, along with one end of
+** a socket pair, over a datagram socket shared by all processes.  The pool
+** writes the reply line to the socket pair and closes it, or closes it
+** without writing anything if the query failed, so that the reply is read
+** as if the process had connected to the host itself.
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "fwd_pool.h"
+
+/*
+** Limits on the queries outstanding on a connection, the connections to a
+** host, and the connections and hosts known to the pool.
+*/
+
+#define FWD_POOL_PIPELINE	8
+#define FWD_POOL_CONNS		4
+#define FWD_POOL_MAX		256
+#define FWD_POOL_HOSTS		64
+
+/*
+** Number of milliseconds after which idle connections are closed.  This is
+** shorter than the default --timeout, after which oidentd closes them.
+*/
+
+#define FWD_POOL_IDLE		10000
+
+/*
+** A query, as sent to the pool.  The port of "addr" is that of the Ident
+** server of the host.
+*/
+
+struct fwd_pool_req {
+	struct sockaddr_storage addr;
+	in_port_t lport;
+	in_port_t fport;
+};
+
+struct pool_host {
+	struct tuple_addr addr;
+	in_port_t port;
+	int family;
+	bool one_shot;
+	u_int64_t last_used;
+};
+
+/*
+** A query handed to the pool.  "serial" tells the order in which queries
+** were received.
+*/
+
+struct pool_query {
+	struct pool_query *next;
+	struct pool_host *host;
+	struct sockaddr_storage addr;
+	unsigned long serial;
+	int client;
+	in_port_t lport;
+	in_port_t fport;
+	u_int64_t deadline;
+};
+
+/*
+** A connection to a host.  "pending" lists the queries sent, or queued to
+** be sent from "out", over it in order.
+*/
+
+struct pool_conn {
+	int sock;
+	bool connected;
+	struct pool_host *host;
+	struct pool_query *pending;
+	size_t npending;
+	u_int32_t answered;
+	u_int64_t idle_since;
+	size_t outlen;
+	size_t inlen;
+	char out[256];
+	char in[1024];
+};
+
+extern u_int32_t forward_timeout;
+
+static int fwd_pool_sock = -1;
+
+static struct pool_conn pool_conns[FWD_POOL_MAX];
+static struct pool_host pool_hosts[FWD_POOL_HOSTS];
+static struct pool_query *pool_waiting;
+static unsigned long pool_serial;
+
+static void pool_main(int life_fd, int ctl_sock) __noreturn;
+static u_int64_t pool_now(void);
+static void pool_receive(int ctl_sock);
+static struct pool_host *pool_host(const struct sockaddr_storage *addr);
+static void pool_dispatch(void);
+static struct pool_conn *pool_conn_open(struct pool_host *host,
+			const struct sockaddr_storage *addr);
+static bool pool_conn_send(struct pool_conn *conn, struct pool_query *query);
+static void pool_conn_io(struct pool_conn *conn, short revents);
+static void pool_conn_read(struct pool_conn *conn);
+static void pool_conn_close(struct pool_conn *conn, bool requeue);
+static void pool_requeue(struct pool_query *list);
+static void pool_reply(struct pool_query *query, const char *line, size_t len);
+static void pool_expire(u_int64_t now);
+static int pool_poll_timeout(u_int64_t now);
+
+/*
+** Start the pool process.
+** Returns 0 on success, or -1 with errno set.
+*/
+
+int fwd_pool_open(void) {
+	int life[2];
+	int ctl[2];
+	pid_t child;
+	size_t i;
+
+	if (pipe(life) == -1) {
+		debug("pipe: %s", strerror(errno));
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ctl) == -1) {
+		debug("socketpair: %s", strerror(errno));
+		close(life[0]);
+		close(life[1]);
+		return -1;
+	}
+
+	for (i = 0; i < FWD_POOL_MAX; ++i)
+		pool_conns[i].sock = -1;
+
+	/*
+	** As with the index processes, the pool is detached by forking twice,
+	** and exits once every copy of the write end of the pipe has been
+	** closed.
+	*/
+
+	child = fork();
+	if (child == -1) {
+		debug("fork: %s", strerror(errno));
+		close(life[0]);
+		close(life[1]);
+		close(ctl[0]);
+		close(ctl[1]);
+		return -1;
+	}
+
+	if (child == 0) {
+		close(life[1]);
+		close(ctl[0]);
+
+		if (fork() == 0)
+			pool_main(life[0], ctl[1]);
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(life[0]);
+	close(ctl[1]);
+	waitpid(child, NULL, 0);
+
+	fcntl(life[1], F_SETFD, FD_CLOEXEC);
+	fcntl(ctl[0], F_SETFD, FD_CLOEXEC);
+	fwd_pool_sock = ctl[0];
+
+	return 0;
+}
+
+/*
+** Hand a query for the connection from "lport" to "fport" to the pool, to
+** be forwarded to the Ident server at "addr".
+** Returns a nonblocking socket the reply is read from, or -1 if the pool
+** is not in use or unavailable.
+*/
+
+int fwd_pool_submit(const struct sockaddr_storage *addr,
+					in_port_t lport,
+					in_port_t fport)
+{
+	struct fwd_pool_req req;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int pair[2];
+
+	if (fwd_pool_sock == -1)
+		return -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+		debug("socketpair: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	sin_copy(&req.addr, addr);
+	req.lport = lport;
+	req.fport = fport;
+
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &pair[1], sizeof(int));
+
+	/* A pool that cannot keep up is bypassed. */
+	if (sendmsg(fwd_pool_sock, &msg, MSG_DONTWAIT) == -1) {
+		debug("sendmsg: %s", strerror(errno));
+		close(pair[0]);
+		close(pair[1]);
+		return -1;
+	}
+
+	close(pair[1]);
+	fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+
+	return pair[0];
+}
+
+/*
+** Returns the value of a monotonic clock in milliseconds.
+*/
+
+static u_int64_t pool_now(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+
+	return (u_int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+** Receive the queries handed to the pool, and queue them.
+*/
+
+static void pool_receive(int ctl_sock) {
+	for (;;) {
+		struct fwd_pool_req req;
+		struct pool_query *query;
+		struct msghdr msg;
+		struct iovec iov;
+		struct cmsghdr *cmsg;
+		char cbuf[CMSG_SPACE(sizeof(int))];
+		int client = -1;
+		ssize_t ret;
+
+		iov.iov_base = &req;
+		iov.iov_len = sizeof(req);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		ret = recvmsg(ctl_sock, &msg, MSG_DONTWAIT);
+		if (ret == -1)
+			return;
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			memcpy(&client, CMSG_DATA(cmsg), sizeof(int));
+		}
+
+		if (client == -1)
+			continue;
+
+		if ((size_t) ret != sizeof(req)) {
+			close(client);
+			continue;
+		}
+
+		fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+
+		query = xcalloc(1, sizeof(*query));
+		sin_copy(&query->addr, &req.addr);
+		query->client = client;
+		query->lport = req.lport;
+		query->fport = req.fport;
+		query->deadline = pool_now() + forward_timeout;
+		query->serial = pool_serial++;
+
+		/* Queries are dispatched in the order they were received. */
+		if (!pool_waiting)
+			pool_waiting = query;
+		else {
+			struct pool_query *last = pool_waiting;
+
+			while (last->next)
+				last = last->next;
+
+			last->next = query;
+		}
+	}
+}
+
+/*
+** Returns the host with the address and port of "addr", adding it if it is
+** not known.  If the table of hosts is full, the least recently used host
+** without connections is replaced.  Returns NULL if no host can be
+** replaced.
+*/
+
+static struct pool_host *pool_host(const struct sockaddr_storage *addr) {
+	struct pool_host *victim = NULL;
+	struct tuple_addr taddr;
+	in_port_t port = sin_port(addr);
+	size_t i;
+
+	tuple_addr_from_sin(&taddr, (struct sockaddr_storage *) addr);
+
+	for (i = 0; i < FWD_POOL_HOSTS; ++i) {
+		struct pool_host *host = &pool_hosts[i];
+		size_t j;
+
+		if (host->family != 0 && host->port == port &&
+			tuple_addr_equal(&host->addr, &taddr))
+		{
+			host->last_used = pool_now();
+			return host;
+		}
+
+		if (host->family != 0) {
+			for (j = 0; j < FWD_POOL_MAX; ++j) {
+				if (pool_conns[j].sock != -1 && pool_conns[j].host == host)
+					break;
+			}
+
+			if (j < FWD_POOL_MAX)
+				continue;
+		}
+
+		if (!victim || host->last_used < victim->last_used)
+			victim = host;
+	}
+
+	if (!victim)
+		return NULL;
+
+	memset(victim, 0, sizeof(*victim));
+	victim->addr = taddr;
+	victim->port = port;
+	victim->family = addr->ss_family;
+	victim->last_used = pool_now();
+
+	return victim;
+}
+
+/*
+** Open a connection to a host.  Returns NULL with errno set to EAGAIN if
+** every connection of the pool is in use, or to the error of the attempt to
+** connect.
+*/
+
+static struct pool_conn *pool_conn_open(struct pool_host *host,
+			const struct sockaddr_storage *addr)
+{
+	struct pool_conn *conn = NULL;
+	size_t i;
+	int sock;
+
+	for (i = 0; i < FWD_POOL_MAX; ++i) {
+		if (pool_conns[i].sock == -1) {
+			conn = &pool_conns[i];
+			break;
+		}
+	}
+
+	if (!conn) {
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	sock = socket(addr->ss_family, SOCK_STREAM, 0);
+	if (sock == -1)
+		return NULL;
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	if (connect(sock, (struct sockaddr *) addr, (socklen_t) sin_len(addr)) == -1 &&
+		errno != EINPROGRESS)
+	{
+		int err = errno;
+
+		close(sock);
+		errno = err;
+		return NULL;
+	}
+
+	memset(conn, 0, sizeof(*conn));
+	conn->sock = sock;
+	conn->host = host;
+	conn->idle_since = pool_now();
+
+	return conn;
+}
+
+/*
+** Queue a query to be sent over a connection.  Returns false if the
+** connection has no room for it.
+*/
+
+static bool pool_conn_send(struct pool_conn *conn, struct pool_query *query) {
+	struct pool_query **tail = &conn->pending;
+	int ret;
+
+	ret = snprintf(conn->out + conn->outlen, sizeof(conn->out) - conn->outlen,
+			"%d,%d\r\n", query->lport, query->fport);
+
+	if (ret < 0 || (size_t) ret >= sizeof(conn->out) - conn->outlen)
+		return false;
+
+	conn->outlen += (size_t) ret;
+
+	while (*tail)
+		tail = &(*tail)->next;
+
+	query->next = NULL;
+	query->host = conn->host;
+	*tail = query;
+	++conn->npending;
+
+	return true;
+}
+
+/*
+** Send the waiting queries over the connections of their hosts.  Queries
+** go to the connection of their host with the fewest outstanding queries,
+** and a new connection is opened if none is idle.  Queries that cannot be
+** sent yet keep waiting.
+*/
+
+static void pool_dispatch(void) {
+	struct pool_query **pp = &pool_waiting;
+
+	while (*pp) {
+		struct pool_query *query = *pp;
+		struct pool_query *next = query->next;
+		struct pool_conn *best = NULL;
+		struct pool_host *host;
+		size_t nconns = 0;
+		size_t i;
+
+		host = pool_host(&query->addr);
+		if (!host) {
+			pp = &query->next;
+			continue;
+		}
+
+		for (i = 0; i < FWD_POOL_MAX && !host->one_shot; ++i) {
+			struct pool_conn *conn = &pool_conns[i];
+
+			if (conn->sock == -1 || conn->host != host)
+				continue;
+
+			++nconns;
+
+			if (conn->npending < FWD_POOL_PIPELINE &&
+				(!best || conn->npending < best->npending))
+			{
+				best = conn;
+			}
+		}
+
+		if (host->one_shot || !best ||
+			(best->npending > 0 && nconns < FWD_POOL_CONNS))
+		{
+			struct pool_conn *conn = pool_conn_open(host, &query->addr);
+
+			if (conn)
+				best = conn;
+			else if (errno != EAGAIN) {
+				debug("connect: %s", strerror(errno));
+				*pp = next;
+				pool_reply(query, NULL, 0);
+				continue;
+			}
+		}
+
+		if (!best || !pool_conn_send(best, query)) {
+			pp = &query->next;
+			continue;
+		}
+
+		/* The query is now on the pending list of the connection. */
+		*pp = next;
+	}
+}
+
+/*
+** Write the reply to a query to the process that made it, or nothing if
+** "line" is NULL, and free the query.
+*/
+
+static void pool_reply(struct pool_query *query, const char *line, size_t len) {
+	if (line && send(query->client, line, len, MSG_DONTWAIT) == -1)
+		debug("send: %s", strerror(errno));
+
+	close(query->client);
+	free(query);
+}
+
+/*
+** Put the queries of "list", which is in the order they were received,
+** back among the waiting queries, so that they are still dispatched in the
+** order they were received.
+*/
+
+static void pool_requeue(struct pool_query *list) {
+	struct pool_query **pp = &pool_waiting;
+
+	while (list) {
+		struct pool_query *query = list;
+
+		while (*pp && (*pp)->serial < query->serial)
+			pp = &(*pp)->next;
+
+		list = query->next;
+		query->next = *pp;
+		*pp = query;
+		pp = &query->next;
+	}
+}
+
+/*
+** Close a connection.  Its outstanding queries are sent again over other
+** connections if "requeue" is set, and fail otherwise.
+*/
+
+static void pool_conn_close(struct pool_conn *conn, bool requeue) {
+	struct pool_query *query = conn->pending;
+
+	if (requeue)
+		pool_requeue(query);
+	else {
+		while (query) {
+			struct pool_query *next = query->next;
+
+			pool_reply(query, NULL, 0);
+			query = next;
+		}
+	}
+
+	close(conn->sock);
+	conn->sock = -1;
+	conn->pending = NULL;
+	conn->npending = 0;
+}
+
+/*
+** Read the replies received over a connection, and pass them on.
+*/
+
+static void pool_conn_read(struct pool_conn *conn) {
+	for (;;) {
+		char *nl;
+		ssize_t ret;
+
+		ret = recv(conn->sock, conn->in + conn->inlen,
+				sizeof(conn->in) - conn->inlen, 0);
+
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+
+			debug("recv: %s", strerror(errno));
+			pool_conn_close(conn, false);
+			return;
+		}
+
+		if (ret == 0) {
+			/*
+			** A host that closed the connection after one reply,
+			** leaving queries unanswered, does not take more than
+			** one query per connection; one that only closed an
+			** idle connection may just have timed it out.  Queries
+			** sent to a host that did not reply to any fail, so
+			** that dead hosts are not retried.
+			*/
+
+			if (conn->answered == 1 && conn->npending > 0 &&
+				!conn->host->one_shot)
+			{
+				debug("Forward target closed pooled connection; "
+					"not pooling connections to it");
+				conn->host->one_shot = true;
+			}
+
+			pool_conn_close(conn, conn->answered > 0);
+			return;
+		}
+
+		conn->inlen += (size_t) ret;
+
+		while ((nl = memchr(conn->in, '\n', conn->inlen))) {
+			struct pool_query **pp = &conn->pending;
+			struct pool_query *query;
+			size_t len = (size_t) (nl - conn->in) + 1;
+			int lport;
+			int fport;
+
+			if (sscanf(conn->in, "%d , %d", &lport, &fport) != 2)
+				pp = NULL;
+
+			while (pp && *pp && ((*pp)->lport != lport || (*pp)->fport != fport))
+				pp = &(*pp)->next;
+
+			/*
+			** A line that does not answer an outstanding query means
+			** that the replies can no longer be matched to the queries.
+			*/
+
+			if (!pp || !*pp) {
+				debug("Forward target sent an unexpected reply; "
+					"closing pooled connection");
+				pool_conn_close(conn, conn->answered > 0);
+				return;
+			}
+
+			query = *pp;
+			*pp = query->next;
+			--conn->npending;
+			++conn->answered;
+			pool_reply(query, conn->in, len);
+
+			conn->inlen -= len;
+			memmove(conn->in, conn->in + len, conn->inlen);
+
+			if (conn->npending == 0)
+				conn->idle_since = pool_now();
+		}
+
+		if (conn->inlen == sizeof(conn->in)) {
+			debug("Forward target sent an overlong reply");
+			pool_conn_close(conn, false);
+			return;
+		}
+
+		/* Connections of hosts that take one query are not reused. */
+		if (conn->host->one_shot && conn->npending == 0) {
+			pool_conn_close(conn, false);
+			return;
+		}
+	}
+}
+
+/*
+** Advance a connection whose socket reported "revents".
+*/
+
+static void pool_conn_io(struct pool_conn *conn, short revents) {
+	if (!conn->connected) {
+		int err = 0;
+		socklen_t errlen = sizeof(err);
+
+		if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+			return;
+
+		if (getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1)
+			err = errno;
+
+		if (err != 0) {
+			debug("connect: %s", strerror(err));
+			pool_conn_close(conn, false);
+			return;
+		}
+
+		conn->connected = true;
+	}
+
+	if (conn->outlen > 0 && (revents & POLLOUT)) {
+		ssize_t ret = send(conn->sock, conn->out, conn->outlen, MSG_NOSIGNAL);
+
+		if (ret == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				debug("send: %s", strerror(errno));
+				pool_conn_close(conn, conn->answered > 0);
+				return;
+			}
+		} else {
+			conn->outlen -= (size_t) ret;
+			memmove(conn->out, conn->out + ret, conn->outlen);
+		}
+	}
+
+	if (revents & (POLLIN | POLLERR | POLLHUP))
+		pool_conn_read(conn);
+}
+
+/*
+** Fail the queries whose deadline has passed, and close idle connections.
+** A connection is closed once a query sent over it expires, as the host it
+** leads to is not answering.
+*/
+
+static void pool_expire(u_int64_t now) {
+	struct pool_query **pp = &pool_waiting;
+	size_t i;
+
+	while (*pp) {
+		struct pool_query *query = *pp;
+
+		if (query->deadline > now) {
+			pp = &query->next;
+			continue;
+		}
+
+		*pp = query->next;
+		pool_reply(query, NULL, 0);
+	}
+
+	for (i = 0; i < FWD_POOL_MAX; ++i) {
+		struct pool_conn *conn = &pool_conns[i];
+		const struct pool_query *query;
+
+		if (conn->sock == -1)
+			continue;
+
+		if (conn->npending == 0) {
+			if (now - conn->idle_since >= FWD_POOL_IDLE)
+				pool_conn_close(conn, false);
+
+			continue;
+		}
+
+		for (query = conn->pending; query; query = query->next) {
+			if (query->deadline <= now) {
+				debug("Forward target not answering; closing pooled connection");
+				pool_conn_close(conn, false);
+				break;
+			}
+		}
+	}
+}
+
+/*
+** Returns the number of milliseconds until the next query or idle
+** connection expires, or -1 if there is none.
+*/
+
+static int pool_poll_timeout(u_int64_t now) {
+	const struct pool_query *query;
+	u_int64_t next = 0;
+	size_t i;
+
+	for (query = pool_waiting; query; query = query->next) {
+		if (next == 0 || query->deadline < next)
+			next = query->deadline;
+	}
+
+	for (i = 0; i < FWD_POOL_MAX; ++i) {
+		const struct pool_conn *conn = &pool_conns[i];
+		u_int64_t expires;
+
+		if (conn->sock == -1)
+			continue;
+
+		if (conn->npending == 0)
+			expires = conn->idle_since + FWD_POOL_IDLE;
+		else
+			expires = conn->pending->deadline;
+
+		if (next == 0 || expires < next)
+			next = expires;
+	}
+
+	if (next == 0)
+		return -1;
+
+	return next > now ? (int) (next - now) : 0;
+}
+
+/*
+** Main loop of the pool process.
+*/
+
+static void pool_main(int life_fd, int ctl_sock) {
+	struct pollfd pfd[FWD_POOL_MAX + 2];
+	struct pool_conn *polled[FWD_POOL_MAX];
+
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGALRM, SIG_IGN);
+	signal(SIGCHLD, SIG_DFL);
+
+	for (;;) {
+		size_t npfd = 2;
+		size_t i;
+
+		pfd[0].fd = life_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = ctl_sock;
+		pfd[1].events = POLLIN;
+
+		for (i = 0; i < FWD_POOL_MAX; ++i) {
+			struct pool_conn *conn = &pool_conns[i];
+
+			if (conn->sock == -1)
+				continue;
+
+			pfd[npfd].fd = conn->sock;
+			pfd[npfd].events = POLLIN;
+
+			if (!conn->connected || conn->outlen > 0)
+				pfd[npfd].events |= POLLOUT;
+
+			polled[npfd - 2] = conn;
+			++npfd;
+		}
+
+		if (poll(pfd, npfd, pool_poll_timeout(pool_now())) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			_exit(EXIT_FAILURE);
+		}
+
+		if (pfd[0].revents != 0)
+			_exit(EXIT_SUCCESS);
+
+		for (i = 2; i < npfd; ++i) {
+			if (pfd[i].revents != 0 && polled[i - 2]->sock == pfd[i].fd)
+				pool_conn_io(polled[i - 2], pfd[i].revents);
+		}
+
+		if (pfd[1].revents != 0)
+			pool_receive(ctl_sock);
+
+		pool_expire(pool_now());
+		pool_dispatch();
+	}
+}
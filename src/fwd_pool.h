@@ -0,0 +1,27 @@
+/*
+** fwd_pool.h - oidentd pool of connections to downstream Ident servers.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_FWD_POOL_H
+#define __OIDENTD_FWD_POOL_H
+
+int fwd_pool_open(void);
+int fwd_pool_submit(const struct sockaddr_storage *addr,
+					in_port_t lport,
+					in_port_t fport);
+
+#endif
@@ -525,3 +525,147 @@ inline void sin_mapv4to6(void *in4, struct in6_addr *in6) {
 	memset(in6_ptr + 10, 0xFF, 2);
 	memcpy(in6_ptr + 12, in4, sizeof(struct in_addr));
 }
+
+/*
+** Set a tuple address from the raw IPv4 or IPv6 address "raw".
+*/
+
+void tuple_addr_set(struct tuple_addr *addr, int family, const void *raw) {
+	if (family == AF_INET) {
+		addr->s32[0] = 0;
+		addr->s32[1] = 0;
+		addr->s32[2] = htonl(0x0000FFFF);
+		memcpy(&addr->s32[3], raw, sizeof(addr->s32[3]));
+	} else
+		memcpy(addr->s32, raw, sizeof(addr->s32));
+}
+
+/*
+** Set a tuple address from the address of a sockaddr struct.
+*/
+
+void tuple_addr_from_sin(struct tuple_addr *addr, struct sockaddr_storage *ss) {
+	tuple_addr_set(addr, ss->ss_family, sin_addr(ss));
+}
+
+/*
+** Setup "ss" as a sockaddr struct of the family "family" holding a tuple
+** address.  An IPv4 address is converted to an IPv4-mapped IPv6 address
+** if "family" is AF_INET6.
+*/
+
+void tuple_addr_to_sin(	const struct tuple_addr *addr,
+						int family,
+						struct sockaddr_storage *ss)
+{
+#if WANT_IPV6
+	if (family == AF_INET6) {
+		sin_setv6((struct in6_addr *) addr->s32, ss);
+		return;
+	}
+#endif
+
+	sin_setv4(addr->s32[3], ss);
+}
+
+/*
+** Returns the raw address of the family "family" stored in a tuple
+** address, which is tuple_addr_len(family) bytes long.  For AF_INET, the
+** address must be an IPv4 address.
+*/
+
+inline const void *tuple_addr_raw(const struct tuple_addr *addr, int family) {
+	if (family == AF_INET)
+		return &addr->s32[3];
+
+	return addr->s32;
+}
+
+/*
+** Returns the length of raw addresses of the family "family".
+*/
+
+inline size_t tuple_addr_len(int family) {
+	return family == AF_INET ? sizeof(struct in_addr) : sizeof(struct tuple_addr);
+}
+
+/*
+** Checks whether a tuple address is an IPv4 address.
+*/
+
+inline bool tuple_addr_is_v4(const struct tuple_addr *addr) {
+	return addr->s32[0] == 0 && addr->s32[1] == 0 &&
+		addr->s32[2] == htonl(0x0000FFFF);
+}
+
+/*
+** Checks whether two tuple addresses are equal.
+*/
+
+inline bool tuple_addr_equal(	const struct tuple_addr *a,
+								const struct tuple_addr *b)
+{
+	return !memcmp(a, b, sizeof(*a));
+}
+
+/*
+** Fill in the tuple of the connection between "laddr" and "faddr".
+** The ports are in network byte order.
+*/
+
+void tuple_set(	struct conn_tuple *tuple,
+				struct sockaddr_storage *laddr,
+				struct sockaddr_storage *faddr,
+				in_port_t lport,
+				in_port_t fport)
+{
+	tuple_addr_from_sin(&tuple->laddr, laddr);
+	tuple_addr_from_sin(&tuple->faddr, faddr);
+	tuple->lport = lport;
+	tuple->fport = fport;
+}
+
+/*
+** Checks whether a tuple describes an IPv4 connection.
+*/
+
+inline bool tuple_is_v4(const struct conn_tuple *tuple) {
+	return tuple_addr_is_v4(&tuple->laddr);
+}
+
+/*
+** Checks whether two tuples describe the same connection.
+*/
+
+inline bool tuple_equal(const struct conn_tuple *a, const struct conn_tuple *b) {
+	return !memcmp(a, b, sizeof(*a));
+}
+
+/*
+** Returns the hash of a tuple.  The tuple is mixed in a word at a time.
+*/
+
+u_int32_t tuple_hash(const struct conn_tuple *tuple) {
+	const char *p = (const char *) tuple;
+	u_int32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < sizeof(*tuple); i += sizeof(u_int32_t)) {
+		u_int32_t word;
+
+		memcpy(&word, p + i, sizeof(word));
+		hash = (hash ^ word) * 0x9E3779B1U;
+		hash ^= hash >> 15;
+	}
+
+	return hash;
+}
+
+/*
+** Fill in the cache key of a tuple.
+*/
+
+void tuple_key(struct conn_key *key, const struct conn_tuple *tuple) {
+	key->tuple = *tuple;
+	key->hash = tuple_hash(tuple);
+}
@@ -23,6 +23,38 @@
 #define SIN4(x) ((struct sockaddr_in *) (x))
 #define SIN6(x) ((struct sockaddr_in6 *) (x))
 
+/*
+** An address of a connection tuple.  IPv4 addresses are stored as
+** IPv4-mapped IPv6 addresses, so that addresses of either family are
+** compared and hashed as 16 bytes.
+*/
+
+struct tuple_addr {
+	u_int32_t s32[4];
+};
+
+/*
+** A TCP connection, as seen from this host.  Ports are in network byte
+** order.  The 36 bytes have no padding, so tuples are compared with
+** memcmp() and used as cache keys as they are.
+*/
+
+struct conn_tuple {
+	struct tuple_addr laddr;
+	struct tuple_addr faddr;
+	in_port_t lport;
+	in_port_t fport;
+};
+
+/*
+** A connection tuple and its hash, computed once per query.
+*/
+
+struct conn_key {
+	struct conn_tuple tuple;
+	u_int32_t hash;
+};
+
 int *setup_listen(struct sockaddr_storage **listen_addr, in_port_t listen_port);
 
 int get_port(const char *name, in_port_t *port);
@@ -59,4 +91,23 @@ bool sin4_equal(struct sockaddr_storage *ss1, struct sockaddr_storage *ss2);
 bool sin6_equal(struct sockaddr_storage *ss1, struct sockaddr_storage *ss2);
 bool sin_equal(struct sockaddr_storage *ss1, struct sockaddr_storage *ss2);
 
+void tuple_addr_set(struct tuple_addr *addr, int family, const void *raw);
+void tuple_addr_from_sin(struct tuple_addr *addr, struct sockaddr_storage *ss);
+void tuple_addr_to_sin(	const struct tuple_addr *addr,
+						int family,
+						struct sockaddr_storage *ss);
+const void *tuple_addr_raw(const struct tuple_addr *addr, int family);
+size_t tuple_addr_len(int family);
+bool tuple_addr_is_v4(const struct tuple_addr *addr);
+bool tuple_addr_equal(const struct tuple_addr *a, const struct tuple_addr *b);
+void tuple_set(	struct conn_tuple *tuple,
+				struct sockaddr_storage *laddr,
+				struct sockaddr_storage *faddr,
+				in_port_t lport,
+				in_port_t fport);
+bool tuple_is_v4(const struct conn_tuple *tuple);
+bool tuple_equal(const struct conn_tuple *a, const struct conn_tuple *b);
+u_int32_t tuple_hash(const struct conn_tuple *tuple);
+void tuple_key(struct conn_key *key, const struct conn_tuple *tuple);
+
 #endif
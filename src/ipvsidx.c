@@ -0,0 +1,759 @@
+/*
+** ipvsidx.c - oidentd Linux IPVS connection index.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+/*
+** On an IPVS director, a connection to a virtual service is handled by a
+** real server behind the director.  Neither the socket tables nor conntrack
+** name the real server of a connection, so queries for it are answered by
+** forwarding them to the real server found in the IPVS connection table.
+**
+** The kernel does not send events for IPVS connections, and its generic
+** netlink interface only lists services and their destinations, so the
+** connection table is read from /proc/net/ip_vs_conn.  A privileged indexer
+** process, started before privileges are dropped, rereads the table every
+** IPVSIDX_INTERVAL seconds, and whenever a lookup misses: queries usually
+** arrive right after the connection they are for was accepted.  Lookups
+** that miss ask for a new scan through a pipe and wait for it; requests made
+** while a scan is in progress are served by the next one.  The index is
+** keyed on the client and virtual service of a connection, which are the
+** foreign and local ends of the query for it.
+**
+** As with the conntrack index, the index consists of two open-addressed
+** hash tables: scans fill the inactive one and then swap them.  Readers
+** retry if the sequence counter of the table they read changed while they
+** read it.  The tables are sized from the number of connections found by
+** the previous scan.
+**
+** Queries for connections that do not exist, such as those of scanners,
+** miss too.  Each client may ask for a scan for connections to a virtual
+** port once every IPVSIDX_KICK_INTERVAL milliseconds; other lookups that
+** miss are answered from the last scan.
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "inet_util.h"
+#include "missing.h"
+#include "ipvsidx.h"
+
+#if IPVSIDX_SUPPORT
+
+#define IPVS_CONN		"/proc/net/ip_vs_conn"
+
+/*
+** Smallest and largest number of slots of each table; must be powers of
+** two.  Each table is given twice as many slots as there were connections
+** in the previous scan.  If three quarters of its slots are in use, the scan
+** is started over with a larger table, and once the table has the largest
+** size, further connections are not indexed.  Memory is reserved for the
+** largest tables, but only the part in use is ever touched.
+*/
+
+#define IPVSIDX_MIN_SLOTS	1024
+#define IPVSIDX_MAX_SLOTS	4194304
+
+/*
+** Number of entries of the table of recent requests for scans, and the
+** number of milliseconds for which a client may not ask for another scan
+** for connections to the same virtual port.
+*/
+
+#define IPVSIDX_KICKS			1024
+#define IPVSIDX_KICK_INTERVAL	1000
+
+/*
+** Number of seconds between scans of the connection table.
+*/
+
+#define IPVSIDX_INTERVAL	1
+
+/*
+** Number of milliseconds a lookup that missed waits for a new scan.
+*/
+
+#define IPVSIDX_WAIT		500
+
+/*
+** Number of times a lookup is retried while the indexer modifies the table.
+*/
+
+#define IPVSIDX_RETRIES		16
+
+/*
+** A connection to a virtual service.  "virt" is the connection as seen by
+** the director: its local end is the virtual service, and its foreign end
+** the client.  "daddr" and "dport" are the real server it is forwarded to,
+** whose address family, "dfamily", may differ from that of the service.
+*/
+
+struct ipvsidx_entry {
+	struct conn_tuple virt;
+	struct tuple_addr daddr;
+	u_int32_t hash;
+	in_port_t dport;
+	u_int16_t family;
+	u_int16_t dfamily;
+};
+
+/*
+** A table of the index.  Its "mask + 1" slots are stored in the entries
+** array of the same index in "ipvsidx_entries".
+*/
+
+struct ipvsidx_table {
+	volatile u_int32_t seq;
+	u_int32_t mask;
+	u_int32_t used;
+	u_int32_t full;
+};
+
+/*
+** A request for a scan made by the client and for the virtual port whose
+** hash is "key", at "time" milliseconds.
+*/
+
+struct ipvsidx_kick {
+	u_int32_t key;
+	u_int64_t time;
+};
+
+struct ipvsidx_shared {
+	volatile u_int32_t active;
+	volatile u_int32_t ready;
+	volatile u_int32_t requested;
+	volatile u_int32_t served;
+	unsigned long scans;
+	unsigned long limited;
+	struct ipvsidx_table tables[2];
+	struct ipvsidx_kick kicks[IPVSIDX_KICKS];
+};
+
+static struct ipvsidx_shared *ipvsidx_shm;
+static struct ipvsidx_entry *ipvsidx_entries[2];
+static int ipvsidx_kick_fd = -1;
+
+static void ipvsidx_indexer(int life_fd, int kick_fd, FILE *fp) __noreturn;
+static void ipvsidx_rebuild(FILE *fp);
+static bool ipvsidx_scan(struct ipvsidx_table *table,
+			struct ipvsidx_entry *entries, FILE *fp);
+static bool ipvsidx_parse(const char *line, struct ipvsidx_entry *entry);
+static int ipvsidx_addr_parse(const char *s, struct tuple_addr *addr);
+static bool ipvsidx_put(struct ipvsidx_table *table,
+			struct ipvsidx_entry *entries,
+			const struct ipvsidx_entry *entry);
+static bool ipvsidx_kick_allowed(const struct conn_tuple *tuple);
+static void ipvsidx_unmap(void);
+static u_int64_t ipvsidx_now(void);
+static int ipvsidx_find(const struct conn_tuple *tuple, u_int32_t hash,
+			struct tuple_addr *daddr, in_port_t *dport, int *family);
+static int ipvsidx_get(const struct conn_tuple *tuple, u_int32_t hash,
+			struct tuple_addr *daddr, in_port_t *dport, int *family);
+static bool ipvsidx_wait(void);
+
+/*
+** Set up the index, open the IPVS connection table, and start the indexer
+** process.
+** Called before privileges are dropped.
+** Returns 0 on success, or -1 with errno set.
+*/
+
+int ipvsidx_open(void) {
+	int life[2];
+	int kick[2];
+	pid_t child;
+	void *mem;
+	FILE *fp;
+	size_t i;
+
+	fp = fopen(IPVS_CONN, "r");
+	if (!fp) {
+		debug("fopen: %s: %s", IPVS_CONN, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		mem = mmap(NULL, sizeof(struct ipvsidx_entry) * IPVSIDX_MAX_SLOTS,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+		if (mem == MAP_FAILED) {
+			debug("mmap: %s", strerror(errno));
+			ipvsidx_unmap();
+			fclose(fp);
+			return -1;
+		}
+
+		ipvsidx_entries[i] = mem;
+	}
+
+	mem = mmap(NULL, sizeof(*ipvsidx_shm), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		debug("mmap: %s", strerror(errno));
+		ipvsidx_unmap();
+		fclose(fp);
+		return -1;
+	}
+
+	if (pipe(life) == -1) {
+		debug("pipe: %s", strerror(errno));
+		munmap(mem, sizeof(*ipvsidx_shm));
+		ipvsidx_unmap();
+		fclose(fp);
+		return -1;
+	}
+
+	if (pipe(kick) == -1) {
+		debug("pipe: %s", strerror(errno));
+		close(life[0]);
+		close(life[1]);
+		munmap(mem, sizeof(*ipvsidx_shm));
+		ipvsidx_unmap();
+		fclose(fp);
+		return -1;
+	}
+
+	ipvsidx_shm = mem;
+
+	/*
+	** As with the conntrack indexer, the indexer is detached by forking
+	** twice, and exits once every copy of the write end of the life pipe
+	** has been closed.
+	*/
+
+	child = fork();
+	if (child == -1) {
+		debug("fork: %s", strerror(errno));
+		close(life[0]);
+		close(life[1]);
+		close(kick[0]);
+		close(kick[1]);
+		munmap(mem, sizeof(*ipvsidx_shm));
+		ipvsidx_shm = NULL;
+		ipvsidx_unmap();
+		fclose(fp);
+		return -1;
+	}
+
+	if (child == 0) {
+		close(life[1]);
+		close(kick[1]);
+
+		if (fork() == 0)
+			ipvsidx_indexer(life[0], kick[0], fp);
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(life[0]);
+	close(kick[0]);
+	fclose(fp);
+	waitpid(child, NULL, 0);
+
+	fcntl(life[1], F_SETFD, FD_CLOEXEC);
+	fcntl(kick[1], F_SETFD, FD_CLOEXEC);
+
+	/* A full pipe means that a scan has been asked for already. */
+	fcntl(kick[1], F_SETFL, fcntl(kick[1], F_GETFL) | O_NONBLOCK);
+	ipvsidx_kick_fd = kick[1];
+
+	return 0;
+}
+
+/*
+** Unmap the entries of the tables after a failure to set up the index.
+*/
+
+static void ipvsidx_unmap(void) {
+	size_t i;
+
+	for (i = 0; i < 2; ++i) {
+		if (ipvsidx_entries[i])
+			munmap(ipvsidx_entries[i], sizeof(struct ipvsidx_entry) * IPVSIDX_MAX_SLOTS);
+
+		ipvsidx_entries[i] = NULL;
+	}
+}
+
+/*
+** Returns the value of a monotonic clock in milliseconds.
+*/
+
+static u_int64_t ipvsidx_now(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+
+	return (u_int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+** Look up a connection in the active table.  Returns 1 if it was found,
+** 0 if it was not, or -1 if the table was modified during the lookup.
+*/
+
+static int ipvsidx_find(const struct conn_tuple *tuple, u_int32_t hash,
+			struct tuple_addr *daddr, in_port_t *dport, int *family)
+{
+	struct ipvsidx_table *table;
+	const struct ipvsidx_entry *entries;
+	u_int32_t active;
+	u_int32_t seq;
+	u_int32_t mask;
+	size_t i;
+	size_t n;
+	int ret = 0;
+
+	active = ipvsidx_shm->active;
+	table = &ipvsidx_shm->tables[active & 1];
+	entries = ipvsidx_entries[active & 1];
+
+	seq = table->seq;
+	__sync_synchronize();
+
+	if (seq & 1)
+		return -1;
+
+	mask = table->mask;
+
+	for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+		const struct ipvsidx_entry *entry = &entries[i];
+
+		if (entry->family == 0)
+			break;
+
+		if (entry->hash == hash && tuple_equal(&entry->virt, tuple)) {
+			*daddr = entry->daddr;
+			*dport = entry->dport;
+			*family = entry->dfamily;
+			ret = 1;
+			break;
+		}
+	}
+
+	__sync_synchronize();
+	if (table->seq != seq || ipvsidx_shm->active != active)
+		return -1;
+
+	return ret;
+}
+
+/*
+** Look up a connection, retrying while the indexer modifies the table.
+** Returns 1 if it was found, 0 if it was not, or -1 if the index cannot tell.
+*/
+
+static int ipvsidx_get(const struct conn_tuple *tuple, u_int32_t hash,
+			struct tuple_addr *daddr, in_port_t *dport, int *family)
+{
+	size_t i;
+
+	for (i = 0; i < IPVSIDX_RETRIES; ++i) {
+		int ret = ipvsidx_find(tuple, hash, daddr, dport, family);
+
+		/* A full table does not hold every connection. */
+		if (ret == 0 && ipvsidx_shm->tables[ipvsidx_shm->active & 1].full)
+			return -1;
+
+		if (ret != -1)
+			return ret;
+
+		sched_yield();
+	}
+
+	debug("IPVS index unavailable");
+	return -1;
+}
+
+/*
+** Ask the indexer for a new scan of the connection table, and wait for it.
+** Returns false if the scan did not complete in time.
+*/
+
+static bool ipvsidx_wait(void) {
+	const struct timespec tick = { 0, 1000000 };
+	u_int32_t ticket;
+	size_t i;
+
+	ticket = __sync_add_and_fetch(&ipvsidx_shm->requested, 1);
+
+	if (write(ipvsidx_kick_fd, "", 1) == -1 && errno != EAGAIN) {
+		debug("write: %s", strerror(errno));
+		return false;
+	}
+
+	for (i = 0; i < IPVSIDX_WAIT; ++i) {
+		if ((int32_t) (ipvsidx_shm->served - ticket) >= 0)
+			return true;
+
+		nanosleep(&tick, NULL);
+	}
+
+	debug("IPVS index scan timed out");
+	return false;
+}
+
+/*
+** Returns true if the client of the connection "tuple" may ask for a scan
+** for connections to its virtual port, and records that it did.  Queries
+** from the same client for the same virtual port, which may come from a
+** scanner or be for connections to other services, do not cause more than
+** one scan every IPVSIDX_KICK_INTERVAL milliseconds.
+*/
+
+static bool ipvsidx_kick_allowed(const struct conn_tuple *tuple) {
+	struct ipvsidx_kick *kick;
+	struct conn_tuple client;
+	u_int64_t now = ipvsidx_now();
+	u_int32_t key;
+
+	memset(&client, 0, sizeof(client));
+	client.faddr = tuple->faddr;
+	client.lport = tuple->lport;
+	key = tuple_hash(&client);
+
+	/* Races between processes at worst allow another scan. */
+	kick = &ipvsidx_shm->kicks[key & (IPVSIDX_KICKS - 1)];
+	if (kick->key == key && now - kick->time < IPVSIDX_KICK_INTERVAL) {
+		__sync_fetch_and_add(&ipvsidx_shm->limited, 1);
+		return false;
+	}
+
+	kick->key = key;
+	kick->time = now;
+	return true;
+}
+
+/*
+** Find the real server of the connection to a virtual service whose local
+** end is the service and whose foreign end is the client, and store its
+** address, port and address family in "daddr", "dport" and "family".
+** Returns 1 if it was found, 0 if no such connection exists, or -1 if the
+** index cannot tell.
+*/
+
+int ipvsidx_lookup(	const struct conn_tuple *tuple,
+					struct tuple_addr *daddr,
+					in_port_t *dport,
+					int *family)
+{
+	u_int32_t hash;
+	int ret;
+
+	if (!ipvsidx_shm || !ipvsidx_shm->ready)
+		return -1;
+
+	hash = tuple_hash(tuple);
+
+	ret = ipvsidx_get(tuple, hash, daddr, dport, family);
+	if (ret != 0)
+		return ret;
+
+	/* The connection may be newer than the last scan. */
+	if (!ipvsidx_kick_allowed(tuple))
+		return 0;
+
+	if (!ipvsidx_wait())
+		return -1;
+
+	return ipvsidx_get(tuple, hash, daddr, dport, family);
+}
+
+/*
+** Log the size of the index and the number of scans made.
+*/
+
+void ipvsidx_report(void) {
+	const struct ipvsidx_table *table;
+
+	if (!ipvsidx_shm)
+		return;
+
+	table = &ipvsidx_shm->tables[ipvsidx_shm->active & 1];
+
+	o_log(LOG_INFO, "IPVS index: %lu connections in %lu slots%s, %lu scans, "
+		"%lu requested, %lu not requested by clients that asked recently",
+		(unsigned long) table->used, (unsigned long) table->mask + 1,
+		table->full ? " (full)" : "", ipvsidx_shm->scans,
+		(unsigned long) ipvsidx_shm->requested, ipvsidx_shm->limited);
+}
+
+/*
+** Add a connection to a table being filled, whose entries are "entries".
+** Returns false if the table is full.
+*/
+
+static bool ipvsidx_put(struct ipvsidx_table *table,
+			struct ipvsidx_entry *entries,
+			const struct ipvsidx_entry *entry)
+{
+	size_t i = entry->hash & table->mask;
+
+	while (entries[i].family != 0) {
+		/* A connection listed twice is indexed once. */
+		if (entries[i].hash == entry->hash &&
+			tuple_equal(&entries[i].virt, &entry->virt))
+		{
+			entries[i] = *entry;
+			return true;
+		}
+
+		i = (i + 1) & table->mask;
+	}
+
+	if (table->used >= (table->mask + 1) / 4 * 3) {
+		table->full = 1;
+		return false;
+	}
+
+	entries[i] = *entry;
+	++table->used;
+
+	return true;
+}
+
+/*
+** Parse an address of the IPVS connection table: eight hexadecimal digits,
+** in host byte order, for IPv4, and the full form of IPv6 addresses.
+** Returns the address family, or -1 on failure.
+*/
+
+static int ipvsidx_addr_parse(const char *s, struct tuple_addr *addr) {
+	struct in6_addr in6;
+
+	if (strlen(s) == 8 && strspn(s, "0123456789abcdefABCDEF") == 8) {
+		struct in_addr in;
+
+		in.s_addr = htonl((u_int32_t) strtoul(s, NULL, 16));
+		tuple_addr_set(addr, AF_INET, &in);
+		return AF_INET;
+	}
+
+	if (inet_pton(AF_INET6, s, &in6) != 1)
+		return -1;
+
+	tuple_addr_set(addr, AF_INET6, &in6);
+	return AF_INET6;
+}
+
+/*
+** Parse a line of the IPVS connection table:
+**
+**   Pro FromIP   FPrt ToIP     TPrt DestIP   DPrt State       Expires ...
+**   TCP C0A80001 D431 C0A8000A 0050 0A000002 0050 ESTABLISHED     899
+**
+** Returns false if the line does not describe a TCP connection of a client.
+*/
+
+static bool ipvsidx_parse(const char *line, struct ipvsidx_entry *entry) {
+	char proto[8];
+	char caddr[48];
+	char vaddr[48];
+	char daddr[48];
+	unsigned int cport;
+	unsigned int vport;
+	unsigned int dport;
+	int family;
+	int dfamily;
+
+	if (sscanf(line, "%7s %47s %x %47s %x %47s %x",
+			proto, caddr, &cport, vaddr, &vport, daddr, &dport) != 7)
+	{
+		return false;
+	}
+
+	if (strcmp(proto, "TCP") != 0)
+		return false;
+
+	/* Persistence templates have no client port. */
+	if (cport == 0 || cport > 0xffff || vport > 0xffff || dport > 0xffff)
+		return false;
+
+	family = ipvsidx_addr_parse(caddr, &entry->virt.faddr);
+	if (family == -1 || ipvsidx_addr_parse(vaddr, &entry->virt.laddr) != family)
+		return false;
+
+	dfamily = ipvsidx_addr_parse(daddr, &entry->daddr);
+	if (dfamily == -1)
+		return false;
+
+	entry->virt.lport = htons((in_port_t) vport);
+	entry->virt.fport = htons((in_port_t) cport);
+	entry->dport = htons((in_port_t) dport);
+	entry->hash = tuple_hash(&entry->virt);
+	entry->family = (u_int16_t) family;
+	entry->dfamily = (u_int16_t) dfamily;
+
+	return true;
+}
+
+/*
+** Fill a table, whose entries are "entries", from the IPVS connection
+** table.  Stops as soon as the table is full, unless it has the largest
+** size.
+** Returns false if the connection table could not be read.
+*/
+
+static bool ipvsidx_scan(struct ipvsidx_table *table,
+			struct ipvsidx_entry *entries, FILE *fp)
+{
+	char line[256];
+	bool full = false;
+
+	rewind(fp);
+
+	while (fgets(line, sizeof(line), fp)) {
+		struct ipvsidx_entry entry;
+
+		if (!ipvsidx_parse(line, &entry))
+			continue;
+
+		if (!ipvsidx_put(table, entries, &entry) && !full) {
+			if (table->mask + 1 < IPVSIDX_MAX_SLOTS)
+				return true;
+
+			o_log(LOG_INFO, "IPVS index full; not all connections are indexed");
+			full = true;
+		}
+	}
+
+	if (ferror(fp)) {
+		debug("read: %s: %s", IPVS_CONN, strerror(errno));
+		clearerr(fp);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+** Rebuild the index from a scan of the connection table into the inactive
+** table, and make it the active one.  Lookups that asked for a scan before
+** this one started are served by it.
+*/
+
+static void ipvsidx_rebuild(FILE *fp) {
+	u_int32_t active = ipvsidx_shm->active;
+	struct ipvsidx_table *table = &ipvsidx_shm->tables[!(active & 1)];
+	struct ipvsidx_entry *entries = ipvsidx_entries[!(active & 1)];
+	u_int32_t used = ipvsidx_shm->tables[active & 1].used;
+	u_int32_t requested = ipvsidx_shm->requested;
+	size_t slots = IPVSIDX_MIN_SLOTS;
+
+	while (slots < IPVSIDX_MAX_SLOTS && slots < (size_t) used * 2)
+		slots <<= 1;
+
+	__sync_synchronize();
+
+	++table->seq;
+	__sync_synchronize();
+
+	for (;;) {
+		memset(entries, 0, sizeof(*entries) * slots);
+		table->mask = (u_int32_t) slots - 1;
+		table->used = 0;
+		table->full = 0;
+
+		if (!ipvsidx_scan(table, entries, fp)) {
+			table->full = 1;
+			break;
+		}
+
+		/* Connections are only left out of a table of the largest size. */
+		if (!table->full || slots >= IPVSIDX_MAX_SLOTS)
+			break;
+
+		slots = MIN(slots * 4, IPVSIDX_MAX_SLOTS);
+	}
+
+	__sync_synchronize();
+	++table->seq;
+
+	__sync_synchronize();
+	ipvsidx_shm->active = !(active & 1);
+	ipvsidx_shm->served = requested;
+	++ipvsidx_shm->scans;
+}
+
+/*
+** Main loop of the indexer process.
+*/
+
+static void ipvsidx_indexer(int life_fd, int kick_fd, FILE *fp) {
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	fcntl(kick_fd, F_SETFL, fcntl(kick_fd, F_GETFL) | O_NONBLOCK);
+
+	ipvsidx_rebuild(fp);
+	ipvsidx_shm->ready = 1;
+
+	for (;;) {
+		struct pollfd pfd[2];
+		char buf[512];
+		int ret;
+
+		pfd[0].fd = life_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = kick_fd;
+		pfd[1].events = POLLIN;
+
+		ret = poll(pfd, 2, IPVSIDX_INTERVAL * 1000);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			_exit(EXIT_FAILURE);
+		}
+
+		if (pfd[0].revents != 0)
+			_exit(EXIT_SUCCESS);
+
+		/* Every request made so far is served by the next scan. */
+		while (read(kick_fd, buf, sizeof(buf)) > 0)
+			;
+
+		ipvsidx_rebuild(fp);
+	}
+}
+
+#endif
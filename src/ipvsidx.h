@@ -0,0 +1,36 @@
+/*
+** ipvsidx.h - oidentd Linux IPVS connection index.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_IPVSIDX_H
+#define __OIDENTD_IPVSIDX_H
+
+#if IPVSIDX_SUPPORT
+
+struct conn_tuple;
+struct tuple_addr;
+
+int ipvsidx_open(void);
+int ipvsidx_lookup(	const struct conn_tuple *tuple,
+					struct tuple_addr *daddr,
+					in_port_t *dport,
+					int *family);
+void ipvsidx_report(void);
+
+#endif
+
+#endif
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <syslog.h>
 #include <pwd.h>
 #include <sys/types.h>
@@ -33,6 +34,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include "oidentd.h"
 #include "util.h"
@@ -42,6 +44,13 @@
 #include "masq.h"
 #include "options.h"
 #include "netlink.h"
+#include "bpf_lookup.h"
+#include "netns.h"
+#include "userns.h"
+#include "lookup.h"
+#include "ctidx.h"
+#include "ipvsidx.h"
+#include "masq_map.h"
 
 #if !MASQ_SUPPORT
 #	undef LIBNFCT_SUPPORT
@@ -55,98 +64,298 @@
 #define CFILE6		"/proc/net/tcp6"
 #define NFCONNTRACK	"/proc/net/nf_conntrack"
 
-static int netlink_sock;
+/*
+** Size of the chunks the connection tracking file is read in.  Longer lines
+** are skipped.
+*/
+
+#define CT_CHUNK	65536
+
+static int netlink_sock = -1;
+static u_int32_t netlink_seq;
 extern struct sockaddr_storage proxy;
 extern char *ret_os;
+extern char *bpf_cgroup;
+extern char *netns_dir;
+
+#if MASQ_SUPPORT
+/*
+** A connection tracking entry.  Each tuple holds the source address and
+** port of its direction in "laddr" and "lport", and the destination
+** address and port in "faddr" and "fport".  "zone" and "mark" are the
+** conntrack zone and mark of the entry.
+*/
+
+struct ct_entry {
+	int family;
+	u_int32_t zone;
+	u_int32_t mark;
+	struct conn_tuple orig;
+	struct conn_tuple reply;
+};
+#endif
 
 #if LIBNFCT_SUPPORT
 struct ct_masq_query {
 	int sock;
-	in_port_t lport;
-	in_port_t fport;
-	struct sockaddr_storage *laddr;
-	struct sockaddr_storage *faddr;
+	const struct conn_tuple *tuple;
+	const struct masq_scope *scope;
 	int status;
 };
 #endif
 
 #if MASQ_SUPPORT
-static int masq_ct_line(char *line,
+static int masq_local_reply(	int sock,
+							in_port_t lport,
+							in_port_t fport,
+							in_port_t masq_lport,
+							in_port_t masq_fport,
+							struct sockaddr_storage *laddr,
+							struct sockaddr_storage *remotem,
+							struct sockaddr_storage *faddr);
+
+static int masq_ct_entry(	const struct ct_entry *entry,
+							int sock,
+							const struct conn_tuple *tuple,
+							const struct masq_scope *scope);
+
+static int masq_ct_scan(	int sock,
+						const struct conn_tuple *tuple,
+						const struct masq_scope *scope);
+
+static int masq_ct_line(const char *line,
+			const char *end,
 			int sock,
-			int ct_type,
-			in_port_t lport,
-			in_port_t fport,
-			struct sockaddr_storage *laddr,
-			struct sockaddr_storage *faddr);
+			const struct conn_tuple *tuple,
+			const struct masq_scope *scope);
+
+static const char *ct_token(const char **p, const char *end, size_t *len);
+static int ct_num_parse(const char *s, size_t len, u_int32_t *num);
+static int ct_port_parse(const char *s, size_t len, in_port_t *port);
+static int ct_addr_parse(	const char *s,
+							size_t len,
+							int family,
+							struct tuple_addr *addr);
+
+#if CTIDX_SUPPORT || LIBNFCT_SUPPORT
+static bool masq_proxied(const struct conn_tuple *tuple);
+#endif
+#if IPVSIDX_SUPPORT
+static int masq_ipvs(	int sock,
+						const struct conn_tuple *tuple,
+						const struct masq_scope *scope);
+#endif
 #endif
 
 #if LIBNFCT_SUPPORT
-static bool dispatch_libnfct_query(struct ct_masq_query *queryp);
+static int dispatch_libnfct_query(	struct ct_masq_query *queryp,
+								enum nf_conntrack_query qtype);
 static int callback_nfct(enum nf_conntrack_msg_type type,
 			struct nf_conntrack *ct,
 			void *data);
+static void nfct_get_tuple(	const struct nf_conntrack *ct,
+							int family,
+							enum nf_conntrack_attr src,
+							enum nf_conntrack_attr dst,
+							enum nf_conntrack_attr sport,
+							enum nf_conntrack_attr dport,
+							struct conn_tuple *tuple);
+#endif
+
+static uid_t lookup_tcp_diag(int sock, const struct conn_tuple *tuple);
+
+static uid_t lookup_tcp_diag_proxy(	int sock,
+									const struct tuple_addr *proxy_addr,
+									int family,
+									in_port_t src_port,
+									in_port_t dst_port);
+
+static int diag_sock_for(const struct tuple_addr *laddr, bool *foreign_ns);
+static void diag_parse_sock(struct nlmsghdr *h, struct lookup_sock *sock);
+
+#if BPF_SUPPORT
+static int bpf_backend_open(const char *arg);
+static uid_t bpf_backend_lookup(const struct conn_tuple *tuple);
 #endif
 
-static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
-							struct sockaddr_storage *dst_addr,
-							in_port_t src_port,
-							in_port_t dst_port);
+static int diag_backend_open(const char *arg);
+static uid_t diag_backend_lookup(const struct conn_tuple *tuple);
+static void diag_backend_reopen(void);
+
+static uid_t proc_backend_lookup(const struct conn_tuple *tuple);
+
+static uid_t lookup_proc4(const struct conn_tuple *tuple);
+
+#if WANT_IPV6
+static uid_t lookup_proc6(const struct conn_tuple *tuple);
+#endif
 
 #if MASQ_SUPPORT
 enum {
 	CT_UNKNOWN,
 	CT_NFCONNTRACK,
 };
-FILE *masq_fp;
+static int masq_fd = -1;
 static int conntrack = CT_UNKNOWN;
 #endif
 
 #if LIBNFCT_SUPPORT
-static bool dispatch_libnfct_query(struct ct_masq_query *queryp) {
-	struct nfct_handle *nfcthp = nfct_open(CONNTRACK, 0);
 
+/*
+** Look up the conntrack entry of a masqueraded connection.  With NFCT_Q_GET,
+** the entry is looked up by its reply-direction tuple: replies to the
+** connection are sent from the foreign host of the query to the local
+** address and port of the query.  The kernel finds conntrack entries by the
+** tuple of either direction, so this is a single hash table lookup.  With
+** NFCT_Q_DUMP, every entry of the address family is examined, or only those
+** with the mark of the scope of the query if it has one.  Entries are looked
+** up in the zone of the scope, or in the default zone.
+**
+** Returns -1 if the query could not be made.  Otherwise, returns 0 and sets
+** the status of "queryp" to the result of the entry that matched, or leaves
+** it at 1 if none did.
+*/
+
+static int dispatch_libnfct_query(	struct ct_masq_query *queryp,
+								enum nf_conntrack_query qtype)
+{
+	struct nfct_handle *nfcthp;
+	struct nf_conntrack *ct = NULL;
+	struct nfct_filter_dump *filter = NULL;
+	const struct conn_tuple *tuple = queryp->tuple;
+	const struct masq_scope *scope = queryp->scope;
+	u_int32_t family = tuple_is_v4(tuple) ? AF_INET : AF_INET6;
+	const void *data = &family;
+	int ret = 0;
+
+	if (qtype == NFCT_Q_GET) {
+		ct = nfct_new();
+		if (!ct) {
+			debug("nfct_new: %s", strerror(errno));
+			return -1;
+		}
+
+		nfct_set_attr_u8(ct, ATTR_ORIG_L3PROTO, family);
+
+		if (family == AF_INET) {
+			nfct_set_attr(ct, ATTR_ORIG_IPV4_SRC,
+				tuple_addr_raw(&tuple->faddr, AF_INET));
+			nfct_set_attr(ct, ATTR_ORIG_IPV4_DST,
+				tuple_addr_raw(&tuple->laddr, AF_INET));
+		} else {
+			nfct_set_attr(ct, ATTR_ORIG_IPV6_SRC,
+				tuple_addr_raw(&tuple->faddr, AF_INET6));
+			nfct_set_attr(ct, ATTR_ORIG_IPV6_DST,
+				tuple_addr_raw(&tuple->laddr, AF_INET6));
+		}
+
+		nfct_set_attr_u8(ct, ATTR_ORIG_L4PROTO, IPPROTO_TCP);
+		nfct_set_attr_u16(ct, ATTR_ORIG_PORT_SRC, tuple->fport);
+		nfct_set_attr_u16(ct, ATTR_ORIG_PORT_DST, tuple->lport);
+
+		if (scope->flags & MASQ_SCOPE_ZONE)
+			nfct_set_attr_u16(ct, ATTR_ZONE, scope->zone);
+
+		data = ct;
+	} else if (scope->flags & MASQ_SCOPE_MARK) {
+		struct nfct_filter_dump_mark mark = {
+			.val = scope->mark,
+			.mask = scope->mark_mask,
+		};
+
+		/* Have the kernel skip the entries of other tenants. */
+		filter = nfct_filter_dump_create();
+		if (!filter) {
+			debug("nfct_filter_dump_create: %s", strerror(errno));
+			return -1;
+		}
+
+		nfct_filter_dump_set_attr(filter, NFCT_FILTER_DUMP_MARK, &mark);
+		nfct_filter_dump_set_attr_u8(filter, NFCT_FILTER_DUMP_L3NUM, family);
+
+		qtype = NFCT_Q_DUMP_FILTER;
+		data = filter;
+	}
+
+	nfcthp = nfct_open(CONNTRACK, 0);
 	if (!nfcthp) {
 		debug("nfct_open: %s", strerror(errno));
-		return false;
+		ret = -1;
+		goto out;
 	}
 
 	if (nfct_callback_register(nfcthp, NFCT_T_ALL,
 			callback_nfct, (void *) queryp)) {
 		debug("nfct_callback_register: %s", strerror(errno));
-		return false;
+		ret = -1;
+		goto out_close;
 	}
 
-	if (nfct_query(nfcthp, NFCT_Q_DUMP, &queryp->faddr->ss_family)) {
+	/* A failed GET with ENOENT means there is no such entry. */
+	if (nfct_query(nfcthp, qtype, data) && errno != ENOENT) {
 		debug("nfct_query: %s", strerror(errno));
-		return false;
+		ret = -1;
 	}
 
-	if (nfct_close(nfcthp)) {
+out_close:
+	if (nfct_close(nfcthp))
 		debug("nfct_close: %s", strerror(errno));
-		return false;
-	}
 
-	return !queryp->status;
+out:
+	if (ct)
+		nfct_destroy(ct);
+
+	if (filter)
+		nfct_filter_dump_destroy(filter);
+
+	return ret;
 }
 
 /*
-** Callback for libnetfilter_conntrack queries
+** Callback for libnetfilter_conntrack queries.  The tuples of the entry
+** are read from its attributes, which are already in binary form.
 */
 
 static int callback_nfct(enum nf_conntrack_msg_type type __notused,
 			struct nf_conntrack *ct,
 			void *data) {
-	char buf[1024];
 	struct ct_masq_query *query;
+	struct ct_entry entry;
 	int ret;
 
-	nfct_snprintf(buf, sizeof(buf), ct, NFCT_T_UNKNOWN,
-			NFCT_O_DEFAULT, NFCT_OF_SHOW_LAYER3);
+	if (nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO) != IPPROTO_TCP)
+		return NFCT_CB_CONTINUE;
+
+	if (nfct_get_attr_u8(ct, ATTR_TCP_STATE) != TCP_CONNTRACK_ESTABLISHED)
+		return NFCT_CB_CONTINUE;
+
+	entry.family = nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO);
+	entry.zone = nfct_get_attr_u16(ct, ATTR_ZONE);
+	entry.mark = nfct_get_attr_u32(ct, ATTR_MARK);
+
+	switch (entry.family) {
+	case AF_INET:
+		nfct_get_tuple(ct, AF_INET, ATTR_ORIG_IPV4_SRC, ATTR_ORIG_IPV4_DST,
+			ATTR_ORIG_PORT_SRC, ATTR_ORIG_PORT_DST, &entry.orig);
+		nfct_get_tuple(ct, AF_INET, ATTR_REPL_IPV4_SRC, ATTR_REPL_IPV4_DST,
+			ATTR_REPL_PORT_SRC, ATTR_REPL_PORT_DST, &entry.reply);
+		break;
+
+#if WANT_IPV6
+	case AF_INET6:
+		nfct_get_tuple(ct, AF_INET6, ATTR_ORIG_IPV6_SRC, ATTR_ORIG_IPV6_DST,
+			ATTR_ORIG_PORT_SRC, ATTR_ORIG_PORT_DST, &entry.orig);
+		nfct_get_tuple(ct, AF_INET6, ATTR_REPL_IPV6_SRC, ATTR_REPL_IPV6_DST,
+			ATTR_REPL_PORT_SRC, ATTR_REPL_PORT_DST, &entry.reply);
+		break;
+#endif
+
+	default:
+		return NFCT_CB_CONTINUE;
+	}
 
 	query = (struct ct_masq_query *) data;
-	ret = masq_ct_line(buf, query->sock, CT_NFCONNTRACK,
-			query->lport, query->fport,
-			query->laddr, query->faddr);
+	ret = masq_ct_entry(&entry, query->sock, query->tuple, query->scope);
 
 	if (ret == 1)
 		return NFCT_CB_CONTINUE;
@@ -154,6 +363,24 @@ static int callback_nfct(enum nf_conntrack_msg_type type __notused,
 	query->status = ret;
 	return NFCT_CB_STOP;
 }
+
+/*
+** Read one direction of a conntrack object into "tuple".
+*/
+
+static void nfct_get_tuple(	const struct nf_conntrack *ct,
+							int family,
+							enum nf_conntrack_attr src,
+							enum nf_conntrack_attr dst,
+							enum nf_conntrack_attr sport,
+							enum nf_conntrack_attr dport,
+							struct conn_tuple *tuple)
+{
+	tuple_addr_set(&tuple->laddr, family, nfct_get_attr(ct, src));
+	tuple_addr_set(&tuple->faddr, family, nfct_get_attr(ct, dst));
+	tuple->lport = nfct_get_attr_u16(ct, sport);
+	tuple->fport = nfct_get_attr_u16(ct, dport);
+}
 #endif
 
 /*
@@ -164,15 +391,13 @@ static int callback_nfct(enum nf_conntrack_msg_type type __notused,
 
 int core_init(void) {
 #if MASQ_SUPPORT
-	if (!opt_enabled(MASQ)) {
-		masq_fp = NULL;
+	if (!opt_enabled(MASQ))
 		return 0;
-	}
 
-	masq_fp = fopen(NFCONNTRACK, "r");
-	if (!masq_fp) {
+	masq_fd = open(NFCONNTRACK, O_RDONLY | O_CLOEXEC);
+	if (masq_fd == -1) {
 		if (errno != ENOENT) {
-			o_log(LOG_CRIT, "fopen: %s: %s", NFCONNTRACK, strerror(errno));
+			o_log(LOG_CRIT, "open: %s: %s", NFCONNTRACK, strerror(errno));
 			return -1;
 		}
 
@@ -193,30 +418,254 @@ int core_init(void) {
 }
 
 
-#if WANT_IPV6
+/*
+** Fill in the properties of the socket described by the tcpdiag reply "h".
+** The kernel attaches the cgroup of the socket to every reply, and its
+** mark to replies to privileged requesters, so they come at no extra cost.
+*/
+
+static void diag_parse_sock(struct nlmsghdr *h, struct lookup_sock *sock) {
+	struct tcpdiagmsg *r = NLMSG_DATA(h);
+	struct rtattr *rta;
+	int rtalen;
+
+	memset(sock, 0, sizeof(*sock));
+	sock->inode = r->tcpdiag_inode;
+
+	rtalen = (int) h->nlmsg_len - NLMSG_LENGTH(sizeof(*r));
+	rta = (struct rtattr *) ((char *) r + NLMSG_ALIGN(sizeof(*r)));
+
+	for (; RTA_OK(rta, rtalen); rta = RTA_NEXT(rta, rtalen)) {
+		switch (rta->rta_type) {
+			case TCPDIAG_MARK:
+				if (RTA_PAYLOAD(rta) >= sizeof(u_int32_t)) {
+					memcpy(&sock->mark, RTA_DATA(rta), sizeof(u_int32_t));
+					sock->have_mark = true;
+				}
+				break;
+
+			case TCPDIAG_CGROUP_ID:
+				if (RTA_PAYLOAD(rta) >= sizeof(u_int64_t)) {
+					memcpy(&sock->cgroup_id, RTA_DATA(rta), sizeof(u_int64_t));
+					sock->have_cgroup = true;
+				}
+				break;
+		}
+	}
+}
 
 /*
-** Returns the UID of the owner of an IPv6 connection,
-** or MISSING_UID on failure.
+** Returns the sock_diag socket to use for connections whose local address
+** is "laddr": that of the network namespace owning the address, or our own.
+** Sets *foreign_ns if the address belongs to another namespace.
 */
 
-uid_t get_user6(	in_port_t lport,
-				in_port_t fport,
-				struct sockaddr_storage *laddr,
-				struct sockaddr_storage *faddr)
+#if NETNS_SUPPORT
+
+static int diag_sock_for(const struct tuple_addr *laddr, bool *foreign_ns) {
+	*foreign_ns = false;
+
+	if (opt_enabled(NETNS)) {
+		int ns_sock = netns_diag_sock(laddr);
+
+		if (ns_sock != -1) {
+			*foreign_ns = true;
+			return ns_sock;
+		}
+	}
+
+	return netlink_sock;
+}
+
+#else
+
+static int diag_sock_for(	const struct tuple_addr *laddr __notused,
+						bool *foreign_ns)
 {
-	FILE *fp;
-	char buf[1024];
+	*foreign_ns = false;
+	return netlink_sock;
+}
+
+#endif
+
+#if BPF_SUPPORT
+
+/*
+** Attach the eBPF program to the cgroup "arg", or to the cgroup given with
+** --bpf if "arg" is NULL.
+*/
+
+static int bpf_backend_open(const char *arg) {
+	if (!arg)
+		arg = bpf_cgroup ? bpf_cgroup : DEFAULT_BPF_CGROUP;
+
+	return bpf_lookup_open(arg);
+}
+
+/*
+** Look up a connection in the eBPF socket ownership map.
+*/
+
+static uid_t bpf_backend_lookup(const struct conn_tuple *tuple) {
+	int families[MAX_LOOKUP_FAMILIES];
+	size_t nfamilies;
+	size_t i;
+
+	nfamilies = lookup_families(tuple, families);
+
+	for (i = 0; i < nfamilies; ++i) {
+		uid_t uid = bpf_lookup(tuple, families[i]);
+
+		if (uid != MISSING_UID)
+			return uid;
+	}
+
+	return MISSING_UID;
+}
+
+#endif
+
+/*
+** Open the netlink socket used for sock_diag lookups.
+*/
+
+static int diag_backend_open(const char *arg __notused) {
+	if (netlink_sock == -1)
+		netlink_sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_TCPDIAG);
+
+	return netlink_sock == -1 ? -1 : 0;
+}
+
+/*
+** Replace the sock_diag socket, so that replies to the requests of this
+** process are not read by its parent.  Sockets of other network namespaces
+** cannot be opened again without privileges, so lookups are not raced when
+** they are used.
+*/
+
+static void diag_backend_reopen(void) {
+	if (netlink_sock != -1)
+		close(netlink_sock);
+
+	netlink_sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_TCPDIAG);
+}
+
+/*
+** Look up a connection using sock_diag.  All address families are queried
+** in a single netlink exchange.  Connections whose local address belongs to
+** another network namespace are looked up in that namespace.
+*/
+
+static uid_t diag_backend_lookup(const struct conn_tuple *tuple) {
+	bool foreign_ns;
+	int diag_sock = diag_sock_for(&tuple->laddr, &foreign_ns);
+	uid_t uid;
 
-	if (netlink_sock != -1) {
-		uid_t uid = lookup_tcp_diag(laddr, faddr, lport, fport);
+	if (diag_sock == -1)
+		return MISSING_UID;
+
+	uid = lookup_tcp_diag(diag_sock, tuple);
+	if (uid != MISSING_UID)
+		return uid;
+
+	/*
+	** Queries forwarded by the proxy name the proxy as the foreign
+	** host, so the connection can only be found by its ports.
+	*/
+
+	if (opt_enabled(PROXY)) {
+		int families[MAX_LOOKUP_FAMILIES];
+		struct tuple_addr proxy_addr;
+		size_t nfamilies;
+		size_t i;
+
+		tuple_addr_from_sin(&proxy_addr, &proxy);
+		if (!tuple_addr_equal(&tuple->faddr, &proxy_addr))
+			return MISSING_UID;
+
+		nfamilies = lookup_families(tuple, families);
+
+		for (i = 0; i < nfamilies; ++i) {
+			uid = lookup_tcp_diag_proxy(diag_sock, &proxy_addr, families[i],
+					tuple->lport, tuple->fport);
+
+			if (uid != MISSING_UID)
+				return uid;
+		}
+	}
+
+	return MISSING_UID;
+}
+
+/*
+** Look up a connection in the /proc tables.  Each table is scanned at most
+** once.  The tables only list the sockets of our own network namespace.
+*/
+
+static uid_t proc_backend_lookup(const struct conn_tuple *tuple) {
+	int families[MAX_LOOKUP_FAMILIES];
+	bool foreign_ns;
+	size_t nfamilies;
+	size_t i;
+
+	diag_sock_for(&tuple->laddr, &foreign_ns);
+	if (foreign_ns)
+		return MISSING_UID;
+
+	nfamilies = lookup_families(tuple, families);
+
+	for (i = 0; i < nfamilies; ++i) {
+		uid_t uid = MISSING_UID;
+
+		if (families[i] == AF_INET)
+			uid = lookup_proc4(tuple);
+#if WANT_IPV6
+		else
+			uid = lookup_proc6(tuple);
+#endif
 
 		if (uid != MISSING_UID)
 			return uid;
 	}
 
-	lport = ntohs(lport);
-	fport = ntohs(fport);
+	return MISSING_UID;
+}
+
+#if BPF_SUPPORT
+static const struct lookup_backend bpf_backend = {
+	"bpf", BPF, bpf_backend_open, bpf_backend_lookup, NULL
+};
+#endif
+
+static const struct lookup_backend diag_backend = {
+	"netlink", 0, diag_backend_open, diag_backend_lookup, diag_backend_reopen
+};
+
+static const struct lookup_backend proc_backend = {
+	"proc", 0, NULL, proc_backend_lookup, NULL
+};
+
+const struct lookup_backend *const kernel_backends[] = {
+#if BPF_SUPPORT
+	&bpf_backend,
+#endif
+	&diag_backend,
+	&proc_backend,
+	NULL
+};
+
+#if WANT_IPV6
+
+/*
+** Look up the owner of an IPv6 connection in the /proc tcp6 table.
+** Returns the UID of the owner, or MISSING_UID on failure.
+*/
+
+static uid_t lookup_proc6(const struct conn_tuple *tuple) {
+	in_port_t lport = ntohs(tuple->lport);
+	in_port_t fport = ntohs(tuple->fport);
+	FILE *fp;
+	char buf[1024];
 
 	fp = fopen(CFILE6, "r");
 	if (!fp) {
@@ -256,8 +705,8 @@ uid_t get_user6(	in_port_t lport,
 		portl = (in_port_t) portl_temp;
 		portf = (in_port_t) portf_temp;
 
-		if (!memcmp(&local6, sin_addr(laddr), sizeof(local6)) &&
-			!memcmp(&remote6, sin_addr(faddr), sizeof(remote6)) &&
+		if (!memcmp(&local6, &tuple->laddr, sizeof(local6)) &&
+			!memcmp(&remote6, &tuple->faddr, sizeof(remote6)) &&
 			portl == lport &&
 			portf == fport)
 		{
@@ -266,6 +715,7 @@ uid_t get_user6(	in_port_t lport,
 			if (inode == 0 && uid == 0)
 				return MISSING_UID;
 
+			lookup_set_inode(inode);
 			return (uid_t) uid;
 		}
 	}
@@ -277,34 +727,19 @@ uid_t get_user6(	in_port_t lport,
 #endif
 
 /*
-** Returns the UID of the owner of an IPv4 connection,
-** or MISSING_UID on failure.
+** Look up the owner of an IPv4 connection in the /proc tcp table.
+** Returns the UID of the owner, or MISSING_UID on failure.
 */
 
-uid_t get_user4(	in_port_t lport,
-				in_port_t fport,
-				struct sockaddr_storage *laddr,
-				struct sockaddr_storage *faddr)
-{
+static uid_t lookup_proc4(const struct conn_tuple *tuple) {
+	in_port_t lport = ntohs(tuple->lport);
+	in_port_t fport = ntohs(tuple->fport);
+	in_addr_t laddr4 = tuple->laddr.s32[3];
+	in_addr_t faddr4 = tuple->faddr.s32[3];
 	unsigned long uid;
 	unsigned long inode;
 	FILE *fp;
 	char buf[1024];
-	in_addr_t laddr4;
-	in_addr_t faddr4;
-
-	if (netlink_sock != -1) {
-		uid_t nluid = lookup_tcp_diag(laddr, faddr, lport, fport);
-
-		if (nluid != MISSING_UID)
-			return nluid;
-	}
-
-	laddr4 = SIN4(laddr)->sin_addr.s_addr;
-	faddr4 = SIN4(faddr)->sin_addr.s_addr;
-
-	lport = ntohs(lport);
-	fport = ntohs(fport);
 
 	fp = fopen(CFILE, "r");
 	if (!fp) {
@@ -376,6 +811,7 @@ out_success:
 	if (inode == 0 && uid == 0)
 		return MISSING_UID;
 
+	lookup_set_inode(inode);
 	return (uid_t) uid;
 }
 
@@ -386,236 +822,341 @@ out_success:
 ** Returns non-zero on failure.
 */
 
-int masq(	int sock,
-			in_port_t lport,
-			in_port_t fport,
-			struct sockaddr_storage *laddr,
-			struct sockaddr_storage *faddr)
-{
-	char buf[1024];
+int masq(int sock, const struct conn_tuple *tuple) {
+	struct masq_scope scope;
+	bool exact_only = false;
 #if LIBNFCT_SUPPORT
 	struct ct_masq_query query;
 #endif
 
-	lport = ntohs(lport);
-	fport = ntohs(fport);
+	/* The section of the masquerading map is chosen by the local address. */
+	masq_map_scope(&tuple->laddr, &scope);
 
-#if LIBNFCT_SUPPORT
-	query = (struct ct_masq_query) { sock, lport, fport, laddr, faddr, 1 };
+#if IPVSIDX_SUPPORT
+	if (opt_enabled(IPVS_INDEX)) {
+		int ret = masq_ipvs(sock, tuple, &scope);
 
-	if (dispatch_libnfct_query(&query))
-		return 0;
+		if (ret != 1)
+			return ret;
+	}
 #endif
 
-	if (masq_fp) {
-		/* rewind fp to read new contents */
-		rewind(masq_fp);
+#if CTIDX_SUPPORT
+	if (opt_enabled(CT_INDEX)) {
+		struct ct_entry entry;
+		int ret;
+
+		entry.reply.laddr = tuple->faddr;
+		entry.reply.faddr = tuple->laddr;
+		entry.reply.lport = tuple->fport;
+		entry.reply.fport = tuple->lport;
+		entry.zone = scope.zone;
+
+		/* Unscoped queries match connections of any zone. */
+		ret = ctidx_lookup(&entry.reply,
+			(scope.flags & MASQ_SCOPE_ZONE) ? (int) scope.zone : -1,
+			&entry.orig, &entry.family, &entry.mark);
+		if (ret == 1) {
+			ret = masq_ct_entry(&entry, sock, tuple, &scope);
+			if (ret != 1)
+				return ret;
+		}
+
+		/*
+		** The index holds every translated connection, except those of
+		** queries forwarded by the proxy, whose reply tuple is unknown.
+		** Connections are only added once the helper has processed their
+		** events, so connections the index does not know may have just
+		** been created, and are looked up by their reply tuple, but the
+		** whole table is not searched for them.
+		*/
 
-		while (fgets(buf, sizeof(buf), masq_fp)) {
-			int ret = masq_ct_line(buf, sock, conntrack,
-				lport, fport, laddr, faddr);
+		if (!masq_proxied(tuple)) {
 			if (ret == 1)
-				continue;
-			return ret;
+				return -1;
+
+			exact_only = ret == 0;
+		}
+	}
+#endif
+
+#if LIBNFCT_SUPPORT
+	query = (struct ct_masq_query) { sock, tuple, &scope, 1 };
+
+	if (dispatch_libnfct_query(&query, NFCT_Q_GET) == 0) {
+		if (query.status == 0)
+			return 0;
+
+		/*
+		** Queries forwarded by the proxy name the proxy instead of the
+		** foreign host of the connection, so the reply tuple is unknown.
+		** Without a zone, the kernel only looks in zone 0, but connections
+		** of any zone match.  Other connections are only searched for in
+		** the whole table if this was asked for, and never if they are
+		** only looked up because the index may lag behind.
+		*/
+
+		if (exact_only || (!opt_enabled(CT_DUMP) && !masq_proxied(tuple) &&
+			(scope.flags & MASQ_SCOPE_ZONE)))
+		{
+			return -1;
 		}
+
+		query.status = 1;
+	}
+
+	if (!exact_only && dispatch_libnfct_query(&query, NFCT_Q_DUMP) == 0 &&
+		query.status == 0)
+	{
+		return 0;
+	}
+#endif
+
+	if (exact_only)
+		return -1;
+
+	if (masq_fd != -1) {
+		if (masq_ct_scan(sock, tuple, &scope) == 0)
+			return 0;
 	} else if (conntrack != CT_UNKNOWN)
 		debug("Connection tracking file is in use but not open");
 
 	return -1;
 }
 
+#if IPVSIDX_SUPPORT
 /*
-** Process a connection tracking file entry.
-** The lport and fport arguments are in host byte order.
+** Handle a query for a connection to an IPVS virtual service by forwarding
+** it to the real server of the connection.  Real servers see the client's
+** address and port unchanged, so only the local port of the query differs.
+** If the real server does not answer, the reply given for it in the
+** masquerading map is sent.
 ** Returns -1 if an error occurred.
-** Returns  0 if the entry matched and the request has been handled.
-** Returns  1 if the entry did not match the query.
-**/
+** Returns  0 if the request has been handled.
+** Returns  1 if the query is not for an IPVS connection.
+*/
 
-static int masq_ct_line(char *line,
-			int sock,
-			int ct_type,
-			in_port_t lport,
-			in_port_t fport,
-			struct sockaddr_storage *laddr,
-			struct sockaddr_storage *faddr) {
+static int masq_ipvs(	int sock,
+						const struct conn_tuple *tuple,
+						const struct masq_scope *scope)
+{
+	in_port_t lport = ntohs(tuple->lport);
+	in_port_t fport = ntohs(tuple->fport);
+	in_port_t dport;
+	struct tuple_addr daddr;
+	struct sockaddr_storage real_ss;
+	char ipbuf[MAX_IPLEN];
 	char os[24];
-	char family[16];
-	char proto[16];
-	in_port_t mport;
-	in_port_t nport;
-	in_port_t masq_lport;
-	in_port_t masq_fport;
 	char user[MAX_ULEN];
-	struct sockaddr_storage localm_ss;
-	struct sockaddr_storage remotem_ss;
-	struct sockaddr_storage localn_ss;
-	struct sockaddr_storage remoten_ss;
-	int ret;
+	int family;
 
-	if (ct_type == CT_NFCONNTRACK) {
-		char ml[MAX_IPLEN];
-		char mr[MAX_IPLEN];
-		char nl[MAX_IPLEN];
-		char nr[MAX_IPLEN];
-		in_addr_t localm4;
-		in_addr_t remotem4;
-		in_addr_t localn4;
-		in_addr_t remoten4;
-#if WANT_IPV6
-		struct in6_addr localm6;
-		struct in6_addr remotem6;
-		struct in6_addr localn6;
-		struct in6_addr remoten6;
-#endif
-		u_int32_t nport_temp;
-		u_int32_t mport_temp;
-		u_int32_t masq_lport_temp;
-		u_int32_t masq_fport_temp;
-
-		ret = sscanf(line,
-			"%15s %*d %15s %*d %*d ESTABLISHED"
-			" src=" IP_SCAN_SPEC " dst=" IP_SCAN_SPEC " sport=%d dport=%d"
-			" packets=%*d bytes=%*d"
-			" src=" IP_SCAN_SPEC " dst=" IP_SCAN_SPEC " sport=%d dport=%d",
-			family, proto,
-			ml, mr, &masq_lport_temp, &masq_fport_temp,
-			nl, nr, &nport_temp, &mport_temp);
-
-		/* Added to handle /proc/sys/net/netfilter/nf_conntrack_acct = 0 */
-		if (ret != 10) {
-			ret = sscanf(line,
-				"%15s %*d %15s %*d %*d ESTABLISHED"
-				" src=" IP_SCAN_SPEC " dst=" IP_SCAN_SPEC " sport=%d dport=%d"
-				" src=" IP_SCAN_SPEC " dst=" IP_SCAN_SPEC " sport=%d dport=%d",
-				family, proto,
-				ml, mr, &masq_lport_temp, &masq_fport_temp,
-				nl, nr, &nport_temp, &mport_temp);
-		}
-
-		if (ret != 10)
-			return 1;
+	if (ipvsidx_lookup(tuple, &daddr, &dport, &family) != 1)
+		return 1;
 
-		switch (faddr->ss_family) {
-		case AF_INET:
-			if (strcasecmp(family, "ipv4"))
-				return 1;
+	/* The local lookup of a raced query answered it first. */
+	if (!masq_claim())
+		return 0;
 
-			if (inet_pton(AF_INET, ml, &localm4)  < 0 ||
-			    inet_pton(AF_INET, mr, &remotem4) < 0 ||
-			    inet_pton(AF_INET, nl, &localn4)  < 0 ||
-			    inet_pton(AF_INET, nr, &remoten4) < 0)
-				return 1;
+	dport = ntohs(dport);
+	tuple_addr_to_sin(&daddr, family, &real_ss);
+	get_ip(&real_ss, ipbuf, sizeof(ipbuf));
 
-			sin_setv4(localm4, &localm_ss);
-			sin_setv4(remotem4, &remotem_ss);
-			sin_setv4(localn4, &localn_ss);
-			sin_setv4(remoten4, &remoten_ss);
+	if (fwd_request(sock, lport, dport, fport, fport, &real_ss) == 0)
+		return 0;
 
-			break;
+	debug("Forward to real server %s (%d %d) failed", ipbuf, dport, fport);
 
-#if WANT_IPV6
-		case AF_INET6:
-			if (strcasecmp(family, "ipv6"))
-				return 1;
+	if (find_masq_entry(scope, &daddr, user, sizeof(user), os, sizeof(os)) != 0)
+		return -1;
 
-			if (inet_pton(AF_INET6, ml, &localm6)  < 0 ||
-			    inet_pton(AF_INET6, mr, &remotem6) < 0 ||
-			    inet_pton(AF_INET6, nl, &localn6)  < 0 ||
-			    inet_pton(AF_INET6, nr, &remoten6) < 0)
-				return 1;
+	sockprintf(sock, "%d,%d:USERID:%s:%s\r\n", lport, fport, os, user);
 
-			sin_setv6(&localm6, &localm_ss);
-			sin_setv6(&remotem6, &remotem_ss);
-			sin_setv6(&localn6, &localn_ss);
-			sin_setv6(&remoten6, &remoten_ss);
+	o_log(LOG_INFO, "[%s] (IPVS) Successful lookup: %d (%d) , %d : %s",
+		ipbuf, lport, dport, fport, user);
 
-			break;
+	return 0;
+}
 #endif
 
-		default:
-			debug("masq_ct_line: bad address family %d", faddr->ss_family);
-			return 1;
-		}
-
-		masq_lport = (in_port_t) masq_lport_temp;
-		masq_fport = (in_port_t) masq_fport_temp;
+#if CTIDX_SUPPORT || LIBNFCT_SUPPORT
 
-		nport = (in_port_t) nport_temp;
-		mport = (in_port_t) mport_temp;
-	} else
-		return -1;
+/*
+** Returns true if a query was forwarded by the host given with --proxy.
+*/
 
-	if (strcasecmp(proto, "tcp"))
-		return 1;
+static bool masq_proxied(const struct conn_tuple *tuple) {
+	struct tuple_addr proxy_addr;
 
-	if (mport != lport)
-		return 1;
+	if (!opt_enabled(PROXY))
+		return false;
 
-	if (nport != fport)
-		return 1;
+	tuple_addr_from_sin(&proxy_addr, &proxy);
+	return tuple_addr_equal(&tuple->faddr, &proxy_addr);
+}
 
-	/* Local NAT, don't forward or do masquerade entry lookup. */
-	if (sin_equal(&localm_ss, &remoten_ss)) {
-		uid_t con_uid = MISSING_UID;
-		struct passwd *pw;
-		char suser[MAX_ULEN];
-		char ipbuf[MAX_IPLEN];
+#endif
 
-		get_ip(faddr, ipbuf, sizeof(ipbuf));
+/*
+** Reply to a query for a NAT connection made by a local process.
+** "laddr" and "remotem" are the local and remote addresses of the
+** connection before translation; "masq_lport" and "masq_fport" are its
+** ports before translation, in host byte order.
+** Returns -1 if the owner of the connection could not be found.
+** Returns  0 if the request has been handled.
+*/
+
+static int masq_local_reply(	int sock,
+							in_port_t lport,
+							in_port_t fport,
+							in_port_t masq_lport,
+							in_port_t masq_fport,
+							struct sockaddr_storage *laddr,
+							struct sockaddr_storage *remotem,
+							struct sockaddr_storage *faddr)
+{
+	struct conn_tuple tuple;
+	uid_t con_uid;
+	struct passwd *pw;
+	char suser[MAX_ULEN];
+	char ipbuf[MAX_IPLEN];
+	int ret;
 
-		if (con_uid == MISSING_UID && faddr->ss_family == AF_INET)
-			con_uid = get_user4(htons(masq_lport), htons(masq_fport), laddr, &remotem_ss);
+	get_ip(faddr, ipbuf, sizeof(ipbuf));
 
-#if WANT_IPV6
-		if (con_uid == MISSING_UID && faddr->ss_family == AF_INET6)
-			con_uid = get_user6(htons(masq_lport), htons(masq_fport), laddr, &remotem_ss);
+	tuple_set(&tuple, laddr, remotem, htons(masq_lport), htons(masq_fport));
+
+	con_uid = get_user(&tuple);
+	if (con_uid == MISSING_UID)
+		return -1;
+
+#if USERNS_SUPPORT
+	if (opt_enabled(USERNS))
+		con_uid = userns_owner(con_uid);
 #endif
 
-		if (con_uid == MISSING_UID)
-			return -1;
+	pw = getpwuid(con_uid);
+	if (!pw) {
+		sockprintf(sock, "%d,%d:ERROR:%s\r\n",
+			lport, fport, ERROR("NO-USER"));
+
+		debug("getpwuid(%lu): %s", (unsigned long) con_uid, strerror(errno));
+		return 0;
+	}
 
-		pw = getpwuid(con_uid);
-		if (!pw) {
-			sockprintf(sock, "%d,%d:ERROR:%s\r\n",
-				lport, fport, ERROR("NO-USER"));
+	ret = get_ident(pw, &tuple, NULL, suser, sizeof(suser));
+	if (ret == -1) {
+		sockprintf(sock, "%d,%d:ERROR:%s\r\n",
+			lport, fport, ERROR("HIDDEN-USER"));
 
-			debug("getpwuid(%lu): %s", (unsigned long) con_uid, strerror(errno));
-			return 0;
-		}
+		o_log(LOG_INFO, "[%s] %d (%d) , %d (%d) : HIDDEN-USER (%s)",
+			ipbuf, lport, masq_lport, fport, masq_fport, pw->pw_name);
 
-		ret = get_ident(pw, masq_lport, masq_fport, laddr, &remotem_ss, suser, sizeof(suser));
-		if (ret == -1) {
-			sockprintf(sock, "%d,%d:ERROR:%s\r\n",
-				lport, fport, ERROR("HIDDEN-USER"));
+		return 0;
+	}
 
-			o_log(LOG_INFO, "[%s] %d (%d) , %d (%d) : HIDDEN-USER (%s)",
-				ipbuf, lport, masq_lport, fport, masq_fport, pw->pw_name);
+	sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
+		lport, fport, ret_os, suser);
 
-			return 0;
-		}
+	o_log(LOG_INFO, "[%s] Successful lookup: %d (%d) , %d (%d) : %s (%s)",
+		ipbuf, lport, masq_lport, fport, masq_fport, pw->pw_name, suser);
 
-		sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
-			lport, fport, ret_os, suser);
+	return 0;
+}
 
-		o_log(LOG_INFO, "[%s] Successful lookup: %d (%d) , %d (%d) : %s (%s)",
-			ipbuf, lport, masq_lport, fport, masq_fport, pw->pw_name, suser);
+/*
+** Process a connection tracking entry.  Entries outside of the conntrack
+** zone and mark of "scope" do not match.
+** Returns -1 if an error occurred.
+** Returns  0 if the entry matched and the request has been handled.
+** Returns  1 if the entry did not match the query.
+*/
 
-		return 0;
+static int masq_ct_entry(	const struct ct_entry *entry,
+							int sock,
+							const struct conn_tuple *tuple,
+							const struct masq_scope *scope)
+{
+	in_port_t lport = ntohs(tuple->lport);
+	in_port_t fport = ntohs(tuple->fport);
+	in_port_t masq_lport;
+	in_port_t masq_fport;
+	char os[24];
+	char user[MAX_ULEN];
+	struct sockaddr_storage laddr;
+	struct sockaddr_storage faddr;
+	struct sockaddr_storage localm_ss;
+	struct sockaddr_storage remotem_ss;
+	int ret;
+
+	/* Replies are sent from the foreign port of the query to its local port. */
+	if (entry->reply.fport != tuple->lport)
+		return 1;
+
+	if (entry->reply.lport != tuple->fport)
+		return 1;
+
+	if (entry->family != (tuple_is_v4(tuple) ? AF_INET : AF_INET6))
+		return 1;
+
+	if ((scope->flags & MASQ_SCOPE_ZONE) && entry->zone != scope->zone)
+		return 1;
+
+	if ((scope->flags & MASQ_SCOPE_MARK) &&
+		(entry->mark & scope->mark_mask) != scope->mark)
+	{
+		return 1;
 	}
 
-	if (!sin_equal(&localn_ss, faddr)) {
+	masq_lport = ntohs(entry->orig.lport);
+	masq_fport = ntohs(entry->orig.fport);
+
+	tuple_addr_to_sin(&tuple->laddr, entry->family, &laddr);
+	tuple_addr_to_sin(&tuple->faddr, entry->family, &faddr);
+	tuple_addr_to_sin(&entry->orig.laddr, entry->family, &localm_ss);
+	tuple_addr_to_sin(&entry->orig.faddr, entry->family, &remotem_ss);
+
+	/* Local NAT, don't forward or do masquerade entry lookup. */
+	if (tuple_addr_equal(&entry->orig.laddr, &entry->reply.faddr)) {
+		/* The local lookup of a raced query answered it first. */
+		if (!masq_claim())
+			return 0;
+
+		return masq_local_reply(sock, lport, fport, masq_lport, masq_fport,
+			&laddr, &remotem_ss, &faddr);
+	}
+
+	if (!tuple_addr_equal(&entry->reply.laddr, &tuple->faddr)) {
+		struct tuple_addr proxy_addr;
+
 		if (!opt_enabled(PROXY))
 			return 1;
 
-		if (!sin_equal(faddr, &proxy))
+		tuple_addr_from_sin(&proxy_addr, &proxy);
+
+		if (!tuple_addr_equal(&tuple->faddr, &proxy_addr))
 			return 1;
 
-		if (sin_equal(&localn_ss, &proxy))
+		if (tuple_addr_equal(&entry->reply.laddr, &proxy_addr))
 			return 1;
 	}
 
-	ret = find_masq_entry(&localm_ss, user, sizeof(user), os, sizeof(os));
+	if (!masq_claim())
+		return 0;
+
+#if NETNS_SUPPORT
+	/* NAT from another local network namespace, e.g. a container. */
+	if (opt_enabled(NETNS)) {
+		if (netns_diag_sock(&entry->orig.laddr) != -1 &&
+			masq_local_reply(sock, lport, fport, masq_lport, masq_fport,
+				&localm_ss, &remotem_ss, &faddr) == 0)
+		{
+			return 0;
+		}
+	}
+#endif
+
+	ret = find_masq_entry(scope, &entry->orig.laddr,
+		user, sizeof(user), os, sizeof(os));
 
 	if (opt_enabled(FORWARD) && (ret != 0 || !opt_enabled(MASQ_OVERRIDE))) {
 		char ipbuf[MAX_IPLEN];
@@ -634,7 +1175,7 @@ static int masq_ct_line(char *line,
 		sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
 			lport, fport, os, user);
 
-		get_ip(faddr, ipbuf, sizeof(ipbuf));
+		get_ip(&faddr, ipbuf, sizeof(ipbuf));
 
 		o_log(LOG_INFO,
 			"[%s] (Masqueraded) Successful lookup: %d , %d : %s",
@@ -646,6 +1187,398 @@ static int masq_ct_line(char *line,
 	return -1;
 }
 
+/*
+** Search the connection tracking file for the entry of a masqueraded
+** connection.  The file is read in large chunks, and each line is parsed
+** where it was read to.
+** Returns the result of masq_ct_entry() for the matching entry, or 1 if no
+** entry matched.
+*/
+
+static int masq_ct_scan(	int sock,
+						const struct conn_tuple *tuple,
+						const struct masq_scope *scope)
+{
+	char buf[CT_CHUNK];
+	size_t len = 0;
+	bool skip = false;
+
+	if (lseek(masq_fd, 0, SEEK_SET) == -1) {
+		debug("lseek: %s: %s", NFCONNTRACK, strerror(errno));
+		return -1;
+	}
+
+	for (;;) {
+		const char *line = buf;
+		const char *nl;
+		ssize_t ret;
+
+		ret = read(masq_fd, buf + len, sizeof(buf) - len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			debug("read: %s: %s", NFCONNTRACK, strerror(errno));
+			return -1;
+		}
+
+		if (ret == 0) {
+			if (len == 0 || skip)
+				return 1;
+
+			/* The last line is not terminated. */
+			return masq_ct_line(buf, buf + len, sock, tuple, scope);
+		}
+
+		len += (size_t) ret;
+
+		while ((nl = memchr(line, '\n', buf + len - line))) {
+			if (!skip) {
+				int match = masq_ct_line(line, nl, sock, tuple, scope);
+				if (match != 1)
+					return match;
+			}
+
+			skip = false;
+			line = nl + 1;
+		}
+
+		len = buf + len - line;
+
+		if (len == sizeof(buf)) {
+			skip = true;
+			len = 0;
+		} else
+			memmove(buf, line, len);
+	}
+}
+
+/*
+** Process a connection tracking file entry, which spans from "line" to
+** "end".  The ports of the reply direction, and the zone and mark if the
+** query is scoped, are compared before any address is decoded, so that most
+** entries are rejected early.
+** Returns the result of masq_ct_entry(), or 1 if the line does not
+** describe an established TCP connection matching the ports of the query.
+*/
+
+static int masq_ct_line(const char *line,
+			const char *end,
+			int sock,
+			const struct conn_tuple *tuple,
+			const struct masq_scope *scope) {
+	static const struct {
+		const char *name;
+		size_t len;
+	} keys[] = {
+		{ "src=",   4 },
+		{ "dst=",   4 },
+		{ "sport=", 6 },
+		{ "dport=", 6 },
+	};
+	const char *val[2][4];
+	size_t vlen[2][4];
+	const char *p = line;
+	const char *tok;
+	size_t len;
+	in_port_t ports[2][2];
+	struct ct_entry entry;
+	unsigned int have = 0;
+	int dir = -1;
+	size_t i;
+
+	tok = ct_token(&p, end, &len);
+	if (!tok)
+		return 1;
+
+	if (len == 4 && !memcmp(tok, "ipv4", 4))
+		entry.family = AF_INET;
+#if WANT_IPV6
+	else if (len == 4 && !memcmp(tok, "ipv6", 4))
+		entry.family = AF_INET6;
+#endif
+	else
+		return 1;
+
+	/* Layer 3 protocol number */
+	if (!ct_token(&p, end, &len))
+		return 1;
+
+	tok = ct_token(&p, end, &len);
+	if (!tok || len != 3 || memcmp(tok, "tcp", 3))
+		return 1;
+
+	/* Layer 4 protocol number and timeout */
+	if (!ct_token(&p, end, &len) || !ct_token(&p, end, &len))
+		return 1;
+
+	tok = ct_token(&p, end, &len);
+	if (!tok || len != 11 || memcmp(tok, "ESTABLISHED", 11))
+		return 1;
+
+	/*
+	** The original tuple is followed by optional counters and flags, such
+	** as "[UNREPLIED]", and the reply tuple, which starts with "src=".
+	*/
+
+	while (have != 0xff && (tok = ct_token(&p, end, &len))) {
+		for (i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+			if (len > keys[i].len && !memcmp(tok, keys[i].name, keys[i].len))
+				break;
+		}
+
+		if (i == sizeof(keys) / sizeof(keys[0]))
+			continue;
+
+		if (i == 0 && ++dir > 1)
+			break;
+
+		if (dir < 0)
+			return 1;
+
+		val[dir][i] = tok + keys[i].len;
+		vlen[dir][i] = len - keys[i].len;
+		have |= 1 << (dir * 4 + i);
+	}
+
+	if (have != 0xff)
+		return 1;
+
+	if (ct_port_parse(val[1][3], vlen[1][3], &ports[1][1]) == -1 ||
+		ports[1][1] != tuple->lport)
+	{
+		return 1;
+	}
+
+	if (ct_port_parse(val[1][2], vlen[1][2], &ports[1][0]) == -1 ||
+		ports[1][0] != tuple->fport)
+	{
+		return 1;
+	}
+
+	if (ct_port_parse(val[0][2], vlen[0][2], &ports[0][0]) == -1 ||
+		ct_port_parse(val[0][3], vlen[0][3], &ports[0][1]) == -1)
+	{
+		return 1;
+	}
+
+	/*
+	** The reply tuple is followed by flags, the mark and, unless it is
+	** the default zone, the zone of the entry.
+	*/
+
+	entry.zone = 0;
+	entry.mark = 0;
+
+	while (scope->flags && (tok = ct_token(&p, end, &len))) {
+		if (len > 5 && !memcmp(tok, "mark=", 5)) {
+			if (ct_num_parse(tok + 5, len - 5, &entry.mark) == -1)
+				return 1;
+		} else if (len > 5 && !memcmp(tok, "zone=", 5)) {
+			if (ct_num_parse(tok + 5, len - 5, &entry.zone) == -1)
+				return 1;
+		}
+	}
+
+	if ((scope->flags & MASQ_SCOPE_ZONE) && entry.zone != scope->zone)
+		return 1;
+
+	if ((scope->flags & MASQ_SCOPE_MARK) &&
+		(entry.mark & scope->mark_mask) != scope->mark)
+	{
+		return 1;
+	}
+
+	if (ct_addr_parse(val[0][0], vlen[0][0], entry.family, &entry.orig.laddr)  == -1 ||
+	    ct_addr_parse(val[0][1], vlen[0][1], entry.family, &entry.orig.faddr)  == -1 ||
+	    ct_addr_parse(val[1][0], vlen[1][0], entry.family, &entry.reply.laddr) == -1 ||
+	    ct_addr_parse(val[1][1], vlen[1][1], entry.family, &entry.reply.faddr) == -1)
+		return 1;
+
+	entry.orig.lport = ports[0][0];
+	entry.orig.fport = ports[0][1];
+	entry.reply.lport = ports[1][0];
+	entry.reply.fport = ports[1][1];
+
+	return masq_ct_entry(&entry, sock, tuple, scope);
+}
+
+/*
+** Return the next token of a line, delimited by spaces, and store its
+** length in "len".  Returns NULL at the end of the line.
+*/
+
+static const char *ct_token(const char **p, const char *end, size_t *len) {
+	const char *tok = *p;
+	const char *q;
+
+	while (tok < end && (*tok == ' ' || *tok == '\t'))
+		++tok;
+
+	if (tok == end)
+		return NULL;
+
+	for (q = tok; q < end && *q != ' ' && *q != '\t'; ++q)
+		;
+
+	*len = q - tok;
+	*p = q;
+
+	return tok;
+}
+
+/*
+** Parse a decimal number of "len" characters into "num".
+** Returns -1 if the number is invalid or does not fit in 32 bits.
+*/
+
+static int ct_num_parse(const char *s, size_t len, u_int32_t *num) {
+	u_int64_t val = 0;
+	size_t i;
+
+	if (len == 0 || len > 10)
+		return -1;
+
+	for (i = 0; i < len; ++i) {
+		if (s[i] < '0' || s[i] > '9')
+			return -1;
+
+		val = val * 10 + (s[i] - '0');
+	}
+
+	if (val > 0xffffffff)
+		return -1;
+
+	*num = (u_int32_t) val;
+	return 0;
+}
+
+/*
+** Parse a decimal port number of "len" characters into "port", in network
+** byte order.
+** Returns -1 if the port is invalid.
+*/
+
+static int ct_port_parse(const char *s, size_t len, in_port_t *port) {
+	u_int32_t val;
+
+	if (ct_num_parse(s, len, &val) == -1 || val > 0xffff)
+		return -1;
+
+	*port = htons((in_port_t) val);
+	return 0;
+}
+
+/*
+** Parse the textual address of "len" characters of the given family into
+** "addr".  IPv4 addresses are given in dotted decimal notation, and IPv6
+** addresses as up to eight groups of hexadecimal digits, which may be
+** abbreviated with "::".
+** Returns -1 if the address is invalid.
+*/
+
+static int ct_addr_parse(	const char *s,
+							size_t len,
+							int family,
+							struct tuple_addr *addr)
+{
+	u_int8_t raw[16];
+	size_t i = 0;
+
+	if (family == AF_INET) {
+		size_t octet;
+
+		for (octet = 0; octet < 4; ++octet) {
+			u_int32_t val = 0;
+			size_t digits = 0;
+
+			if (octet > 0) {
+				if (i == len || s[i] != '.')
+					return -1;
+
+				++i;
+			}
+
+			for (; i < len && s[i] >= '0' && s[i] <= '9' && digits < 3; ++i, ++digits)
+				val = val * 10 + (s[i] - '0');
+
+			if (digits == 0 || val > 255)
+				return -1;
+
+			raw[octet] = (u_int8_t) val;
+		}
+	} else {
+		u_int16_t groups[8];
+		size_t ngroups = 0;
+		size_t gap = 0;
+		bool compressed = false;
+		size_t g;
+
+		if (len >= 2 && s[0] == ':' && s[1] == ':') {
+			compressed = true;
+			i = 2;
+		}
+
+		while (i < len) {
+			u_int32_t val = 0;
+			size_t digits = 0;
+
+			for (; i < len && digits < 5; ++i, ++digits) {
+				char c = s[i];
+
+				if (c >= '0' && c <= '9')
+					val = val * 16 + (c - '0');
+				else if (c >= 'a' && c <= 'f')
+					val = val * 16 + (c - 'a' + 10);
+				else if (c >= 'A' && c <= 'F')
+					val = val * 16 + (c - 'A' + 10);
+				else
+					break;
+			}
+
+			if (digits == 0 || digits > 4 || ngroups == 8)
+				return -1;
+
+			groups[ngroups++] = (u_int16_t) val;
+
+			if (i == len)
+				break;
+
+			if (s[i] != ':' || ++i == len)
+				return -1;
+
+			if (s[i] == ':') {
+				if (compressed)
+					return -1;
+
+				compressed = true;
+				gap = ngroups;
+
+				if (++i == len)
+					break;
+			}
+		}
+
+		if (compressed ? ngroups > 7 : ngroups != 8)
+			return -1;
+
+		memset(raw, 0, sizeof(raw));
+
+		for (g = 0; g < ngroups; ++g) {
+			size_t pos = !compressed || g < gap ? g : 8 - ngroups + g;
+
+			raw[pos * 2] = groups[g] >> 8;
+			raw[pos * 2 + 1] = groups[g] & 0xff;
+		}
+	}
+
+	if (i != len)
+		return -1;
+
+	tuple_addr_set(addr, family, raw);
+	return 0;
+}
+
 #endif
 
 /*
@@ -657,41 +1590,228 @@ static int masq_ct_line(char *line,
 ** routine to support both IPv4 and IPv6 queries.
 */
 
-static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
-							struct sockaddr_storage *dst_addr,
-							in_port_t src_port,
-							in_port_t dst_port)
+static uid_t lookup_tcp_diag(int sock, const struct conn_tuple *tuple) {
+	struct sockaddr_nl nladdr;
+	struct {
+		struct nlmsghdr nlh;
+		struct tcpdiagreq r;
+	} req[MAX_LOOKUP_FAMILIES];
+	int families[MAX_LOOKUP_FAMILIES];
+	uid_t uids[MAX_LOOKUP_FAMILIES];
+	struct lookup_sock socks[MAX_LOOKUP_FAMILIES];
+	bool answered[MAX_LOOKUP_FAMILIES];
+	size_t nfamilies;
+	size_t pending;
+	u_int32_t first_seq;
+	struct iovec iov[1];
+	struct msghdr msghdr;
+	char buf[8192];
+	size_t i;
+
+	nfamilies = lookup_families(tuple, families);
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	/*
+	** Send one request per candidate address family in a single datagram,
+	** so that the kernel can answer them all in one round trip.
+	*/
+
+	first_seq = netlink_seq + 1;
+
+	for (i = 0; i < nfamilies; ++i) {
+		size_t addr_len = tuple_addr_len(families[i]);
+
+		req[i].nlh.nlmsg_len = sizeof(req[i]);
+		req[i].nlh.nlmsg_type = TCPDIAG_GETSOCK;
+		req[i].nlh.nlmsg_flags = NLM_F_REQUEST;
+		req[i].nlh.nlmsg_pid = 0;
+		req[i].nlh.nlmsg_seq = ++netlink_seq;
+
+		memset(&req[i].r, 0, sizeof(req[i].r));
+
+		req[i].r.tcpdiag_states = ~0U;
+		req[i].r.tcpdiag_family = (u_int8_t) families[i];
+		memcpy(&req[i].r.id.tcpdiag_dst,
+			tuple_addr_raw(&tuple->faddr, families[i]), addr_len);
+		memcpy(&req[i].r.id.tcpdiag_src,
+			tuple_addr_raw(&tuple->laddr, families[i]), addr_len);
+		req[i].r.id.tcpdiag_dport = tuple->fport;
+		req[i].r.id.tcpdiag_sport = tuple->lport;
+		req[i].r.id.tcpdiag_cookie[0] = TCPDIAG_NOCOOKIE;
+		req[i].r.id.tcpdiag_cookie[1] = TCPDIAG_NOCOOKIE;
+
+		uids[i] = MISSING_UID;
+		answered[i] = false;
+	}
+
+	iov[0].iov_base = req;
+	iov[0].iov_len = sizeof(req[0]) * nfamilies;
+
+	msghdr.msg_name = &nladdr;
+	msghdr.msg_namelen = sizeof(nladdr);
+	msghdr.msg_iov = iov;
+	msghdr.msg_iovlen = 1;
+	msghdr.msg_control = NULL;
+	msghdr.msg_controllen = 0;
+	msghdr.msg_flags = 0;
+
+	if (sendmsg(sock, &msghdr, 0) < 0) {
+		if (errno == ECONNREFUSED && sock == netlink_sock) {
+			close(netlink_sock);
+			netlink_sock = -1;
+		}
+
+		return MISSING_UID;
+	}
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof(buf);
+
+	pending = nfamilies;
+
+	while (pending > 0) {
+		ssize_t ret;
+		size_t uret;
+		struct nlmsghdr *h;
+
+		msghdr.msg_name = &nladdr;
+		msghdr.msg_namelen = sizeof(nladdr);
+		msghdr.msg_iov = iov;
+		msghdr.msg_iovlen = 1;
+		msghdr.msg_control = NULL;
+		msghdr.msg_controllen = 0;
+		msghdr.msg_flags = 0;
+
+		ret = recvmsg(sock, &msghdr, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+
+			break;
+		}
+
+		if (ret == 0)
+			break;
+
+		h = (struct nlmsghdr *) buf;
+
+		uret = (size_t) ret;
+		for (; NLMSG_OK(h, uret); h = NLMSG_NEXT(h, uret)) {
+			struct tcpdiagmsg *r;
+			size_t addr_len;
+
+			i = h->nlmsg_seq - first_seq;
+			if (i >= nfamilies || answered[i])
+				continue;
+
+			answered[i] = true;
+			--pending;
+
+			if (h->nlmsg_type == NLMSG_DONE || h->nlmsg_type == NLMSG_ERROR)
+				continue;
+
+			r = NLMSG_DATA(h);
+			addr_len = tuple_addr_len(families[i]);
+
+			if (r->id.tcpdiag_dport == tuple->fport &&
+				r->id.tcpdiag_sport == tuple->lport &&
+				!memcmp(r->id.tcpdiag_dst,
+					tuple_addr_raw(&tuple->faddr, families[i]), addr_len) &&
+				!memcmp(r->id.tcpdiag_src,
+					tuple_addr_raw(&tuple->laddr, families[i]), addr_len))
+			{
+				if (r->tcpdiag_inode != 0 || r->tcpdiag_uid != 0) {
+					uids[i] = r->tcpdiag_uid;
+					diag_parse_sock(h, &socks[i]);
+				}
+			}
+		}
+
+		if ((msghdr.msg_flags & MSG_TRUNC) || uret != 0)
+			break;
+	}
+
+	/* Earlier address families take precedence. */
+	for (i = 0; i < nfamilies; ++i) {
+		if (uids[i] != MISSING_UID) {
+			lookup_set_sock(&socks[i]);
+			return uids[i];
+		}
+	}
+
+	return MISSING_UID;
+}
+
+/*
+** Look up a connection forwarded by the proxy at "proxy_addr" by its ports,
+** among the sockets of the address family "family".
+** The kernel filters its socket tables on the port pair, so only the few
+** matching sockets are returned instead of the whole table.  The result
+** reflects the current socket tables; nothing is cached.
+** Returns the UID of the owner of the first matching socket whose foreign
+** address is not the proxy itself, or MISSING_UID on failure.
+*/
+
+static uid_t lookup_tcp_diag_proxy(	int sock,
+									const struct tuple_addr *proxy_addr,
+									int family,
+									in_port_t src_port,
+									in_port_t dst_port)
 {
+	static const u_int8_t bc_codes[4] = {
+		TCPDIAG_BC_S_GE, TCPDIAG_BC_S_LE,
+		TCPDIAG_BC_D_GE, TCPDIAG_BC_D_LE,
+	};
 	struct sockaddr_nl nladdr;
 	struct {
 		struct nlmsghdr nlh;
 		struct tcpdiagreq r;
+		struct nlattr nla;
+		struct tcpdiag_bc_op bc[8];
 	} req;
-	size_t addr_len = sin_addr_len(dst_addr);
+	size_t addr_len = tuple_addr_len(family);
+	uid_t con_uid = MISSING_UID;
 	struct iovec iov[1];
 	struct msghdr msghdr;
 	char buf[8192];
+	size_t i;
 
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
 
+	memset(&req, 0, sizeof(req));
+
 	req.nlh.nlmsg_len = sizeof(req);
 	req.nlh.nlmsg_type = TCPDIAG_GETSOCK;
-	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
 	req.nlh.nlmsg_pid = 0;
-	req.nlh.nlmsg_seq = 1;
-
-	memset(&req.r, 0, sizeof(req.r));
+	req.nlh.nlmsg_seq = ++netlink_seq;
 
 	req.r.tcpdiag_states = ~0U;
-	req.r.tcpdiag_family = dst_addr->ss_family;
-	memcpy(&req.r.id.tcpdiag_dst, sin_addr(dst_addr), addr_len);
-	memcpy(&req.r.id.tcpdiag_src, sin_addr(src_addr), addr_len);
-	req.r.id.tcpdiag_dport = dst_port;
-	req.r.id.tcpdiag_sport = src_port;
+	req.r.tcpdiag_family = (u_int8_t) family;
 	req.r.id.tcpdiag_cookie[0] = TCPDIAG_NOCOOKIE;
 	req.r.id.tcpdiag_cookie[1] = TCPDIAG_NOCOOKIE;
 
+	req.nla.nla_len = sizeof(req.nla) + sizeof(req.bc);
+	req.nla.nla_type = TCPDIAG_REQ_BYTECODE;
+
+	/*
+	** sport >= lport && sport <= lport && dport >= fport && dport <= fport.
+	** Each comparison continues with the next one on success and jumps
+	** past the end of the program, rejecting the socket, on failure.
+	*/
+
+	for (i = 0; i < 4; ++i) {
+		size_t remaining = sizeof(req.bc) - i * 2 * sizeof(req.bc[0]);
+
+		req.bc[i * 2].code = bc_codes[i];
+		req.bc[i * 2].yes = 2 * sizeof(req.bc[0]);
+		req.bc[i * 2].no = remaining + sizeof(req.bc[0]);
+		req.bc[i * 2 + 1].no = ntohs(i < 2 ? src_port : dst_port);
+	}
+
 	iov[0].iov_base = &req;
 	iov[0].iov_len = sizeof(req);
 
@@ -703,8 +1823,8 @@ static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
 	msghdr.msg_controllen = 0;
 	msghdr.msg_flags = 0;
 
-	if (sendmsg(netlink_sock, &msghdr, 0) < 0) {
-		if (errno == ECONNREFUSED) {
+	if (sendmsg(sock, &msghdr, 0) < 0) {
+		if (errno == ECONNREFUSED && sock == netlink_sock) {
 			close(netlink_sock);
 			netlink_sock = -1;
 		}
@@ -715,6 +1835,7 @@ static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
 	iov[0].iov_base = buf;
 	iov[0].iov_len = sizeof(buf);
 
+	/* Read the whole dump so that no replies are left on the socket. */
 	while (1) {
 		ssize_t ret;
 		size_t uret;
@@ -728,72 +1849,73 @@ static uid_t lookup_tcp_diag(	struct sockaddr_storage *src_addr,
 		msghdr.msg_controllen = 0;
 		msghdr.msg_flags = 0;
 
-		ret = recvmsg(netlink_sock, &msghdr, 0);
+		ret = recvmsg(sock, &msghdr, 0);
 		if (ret < 0) {
 			if (errno == EINTR || errno == EAGAIN)
 				continue;
 
-			return MISSING_UID;
+			return con_uid;
 		}
 
 		if (ret == 0)
-			return MISSING_UID;
+			return con_uid;
 
 		h = (struct nlmsghdr *) buf;
 
 		uret = (size_t) ret;
-		while (NLMSG_OK(h, uret)) {
+		for (; NLMSG_OK(h, uret); h = NLMSG_NEXT(h, uret)) {
 			struct tcpdiagmsg *r;
 
-			if (h->nlmsg_seq != 1) {
-				h = NLMSG_NEXT(h, uret);
+			if (h->nlmsg_seq != req.nlh.nlmsg_seq)
 				continue;
-			}
 
 			if (h->nlmsg_type == NLMSG_DONE || h->nlmsg_type == NLMSG_ERROR)
-				return MISSING_UID;
+				return con_uid;
 
 			r = NLMSG_DATA(h);
 
-			if (r->id.tcpdiag_dport == dst_port &&
-				r->id.tcpdiag_sport == src_port &&
-				!memcmp(r->id.tcpdiag_dst, sin_addr(dst_addr), addr_len) &&
-				!memcmp(r->id.tcpdiag_src, sin_addr(src_addr), addr_len))
+			if (con_uid != MISSING_UID ||
+				r->tcpdiag_family != family ||
+				r->id.tcpdiag_sport != src_port ||
+				r->id.tcpdiag_dport != dst_port ||
+				!memcmp(r->id.tcpdiag_dst,
+					tuple_addr_raw(proxy_addr, family), addr_len))
 			{
-				if (r->tcpdiag_inode == 0 && r->tcpdiag_uid == 0)
-					return MISSING_UID;
-
-				return r->tcpdiag_uid;
+				continue;
 			}
 
-			return MISSING_UID;
+			if (r->tcpdiag_inode != 0 || r->tcpdiag_uid != 0) {
+				struct lookup_sock sock;
+
+				con_uid = r->tcpdiag_uid;
+				diag_parse_sock(h, &sock);
+				lookup_set_sock(&sock);
+			}
 		}
 
 		if ((msghdr.msg_flags & MSG_TRUNC) || uret != 0)
-			return MISSING_UID;
+			return con_uid;
 	}
 
-	return MISSING_UID;
+	return con_uid;
 }
 
-/*
-** Just open a netlink socket here.
-*/
-
 /*
 ** Open the kernel memory device.
 ** Return 0 on success, or -1 with errno set.
 **
-** No kmem access required; open a Netlink socket instead.
+** No kmem access required; the netlink socket is opened by the sock_diag
+** lookup backend instead.
 */
 
 int k_open(void) {
-	netlink_sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_TCPDIAG);
-
-	if (netlink_sock == -1) {
-		/* Not a fatal error, just log a debug message */
-		debug("Failed to open netlink socket: %s", strerror(errno));
+#if NETNS_SUPPORT
+	if (opt_enabled(NETNS) && netns_open(netns_dir) == -1) {
+		/* Not a fatal error, look up connections in our namespace only */
+		o_log(LOG_INFO, "Network namespaces unavailable: %s", strerror(errno));
+		disable_opt(NETNS);
 	}
+#endif
 
 	return 0;
 }
@@ -54,6 +54,7 @@
 #include "inet_util.h"
 #include "missing.h"
 #include "masq.h"
+#include "masq_map.h"
 #include "options.h"
 
 #define PF_DEVICE "/dev/pf"
@@ -122,18 +123,17 @@ uid_t get_user4(	in_port_t lport,
 ** Returns non-zero on failure.
 */
 
-int masq(	int sock,
-			in_port_t lport,
-			in_port_t fport,
-			struct sockaddr_storage *laddr,
-			struct sockaddr_storage *faddr)
-{
+int masq(int sock, const struct conn_tuple *tuple) {
+	in_port_t lport = tuple->lport;
+	in_port_t fport = tuple->fport;
 	struct pfioc_natlook natlook;
 	int pfdev;
 	int retm;
 	char os[24];
 	char user[MAX_ULEN];
 	struct sockaddr_storage ss;
+	struct tuple_addr masq_addr;
+	struct masq_scope scope;
 	in_port_t masq_lport;
 	in_port_t masq_fport;
 
@@ -141,7 +141,7 @@ int masq(	int sock,
 	** Only IPv4 is supported right now..
 	*/
 
-	if (faddr->ss_family != AF_INET || laddr->ss_family != AF_INET)
+	if (!tuple_is_v4(tuple))
 		return -1;
 
 	pfdev = open(PF_DEVICE, O_RDWR);
@@ -152,11 +152,11 @@ int masq(	int sock,
 
 	memset(&natlook, 0, sizeof(struct pfioc_natlook));
 
-	memcpy(&natlook.saddr.v4.s_addr, &SIN4(laddr)->sin_addr.s_addr,
+	memcpy(&natlook.saddr.v4.s_addr, tuple_addr_raw(&tuple->laddr, AF_INET),
 		sizeof(struct in_addr));
 	natlook.sport = lport;
 
-	memcpy(&natlook.daddr.v4.s_addr, &SIN4(faddr)->sin_addr.s_addr,
+	memcpy(&natlook.daddr.v4.s_addr, tuple_addr_raw(&tuple->faddr, AF_INET),
 		sizeof(struct in_addr));
 	natlook.dport = fport;
 
@@ -169,6 +169,10 @@ int masq(	int sock,
 		return -1;
 	}
 
+	/* The local lookup of a raced query answered it first. */
+	if (!masq_claim())
+		return 0;
+
 	fport = ntohs(fport);
 	lport = ntohs(lport);
 	masq_lport = ntohs(natlook.rsport);
@@ -176,7 +180,13 @@ int masq(	int sock,
 
 	sin_setv4(natlook.rsaddr.v4.s_addr, &ss);
 
-	retm = find_masq_entry(&ss, user, sizeof(user), os, sizeof(os));
+	/* pf has no conntrack zones or marks; only the section applies. */
+	masq_map_scope(&tuple->laddr, &scope);
+	scope.flags = 0;
+
+	tuple_addr_from_sin(&masq_addr, &ss);
+	retm = find_masq_entry(&scope, &masq_addr,
+		user, sizeof(user), os, sizeof(os));
 
 	if (opt_enabled(FORWARD) && (retm != 0 || !opt_enabled(MASQ_OVERRIDE))) {
 		int retf;
@@ -201,7 +211,8 @@ int masq(	int sock,
 		sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
 				lport, fport, os, user);
 
-		get_ip(faddr, ipbuf, sizeof(ipbuf));
+		tuple_addr_to_sin(&tuple->faddr, AF_INET, &ss);
+		get_ip(&ss, ipbuf, sizeof(ipbuf));
 
 		o_log(LOG_INFO,
 				"[%s] (NAT) Successful lookup: %d , %d : %s",
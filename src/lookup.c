@@ -0,0 +1,551 @@
+/*
+** lookup.c - oidentd connection lookup.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "options.h"
+#include "lookup.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+** Number of lookups a backend must perform before its statistics are used
+** to decide whether it is skipped.
+*/
+
+#define LOOKUP_TUNE_MIN			64
+
+/*
+** Every LOOKUP_PROBE_INTERVAL-th query uses the full chain, so that the
+** statistics of skipped backends stay current.
+*/
+
+#define LOOKUP_PROBE_INTERVAL	16
+
+/*
+** Lookup statistics of a backend, shared by all processes.  "rescued"
+** counts the connections the backend did not find that a later backend of
+** the chain found.  Bucket "i" of the latency histogram counts lookups that
+** took less than 2^i microseconds; the last bucket counts all slower
+** lookups.
+*/
+
+struct lookup_stats {
+	volatile unsigned long calls;
+	volatile unsigned long hits;
+	volatile unsigned long rescued;
+	volatile unsigned long usecs;
+	volatile unsigned long hist[LOOKUP_HIST_BUCKETS];
+};
+
+struct lookup_shared {
+	volatile unsigned long queries;
+	struct lookup_stats stats[MAX_LOOKUP_BACKENDS];
+};
+
+/*
+** The statistics of a backend at the end of the last window in which it
+** performed at least LOOKUP_TUNE_MIN lookups, and the number of hits and
+** rescued misses in that window.  Only used by the parent process.
+*/
+
+struct lookup_window {
+	unsigned long calls;
+	unsigned long hits;
+	unsigned long rescued;
+	unsigned long last_hits;
+	unsigned long last_rescued;
+};
+
+static const struct lookup_backend *lookup_chain_list[MAX_LOOKUP_BACKENDS];
+static bool lookup_skipped[MAX_LOOKUP_BACKENDS];
+static struct lookup_window lookup_windows[MAX_LOOKUP_BACKENDS];
+static size_t lookup_nbackends;
+static struct lookup_sock lookup_sock;
+static bool lookup_adaptive;
+static struct lookup_shared *lookup_shared;
+
+static const struct lookup_backend *lookup_find(const char *name, size_t len);
+static void lookup_open_default(void);
+static void lookup_open_stats(void);
+static u_int64_t lookup_now(void);
+static void lookup_record(size_t idx, u_int64_t start, bool hit);
+static void lookup_rescued(size_t idx, bool probe);
+
+#if !KERNEL_BACKENDS
+static uid_t kernel_lookup(const struct conn_tuple *tuple);
+#endif
+
+/*
+** Store the address families the connection "tuple" may be listed under
+** in "families", which must have room for MAX_LOOKUP_FAMILIES entries, in
+** the order in which they should be tried.  IPv4 connections may belong
+** to IPv4 sockets or to dual-stack IPv6 sockets, which list them using
+** IPv4-mapped IPv6 addresses.  Returns the number of families.
+*/
+
+size_t lookup_families(const struct conn_tuple *tuple, int *families) {
+	size_t n = 0;
+
+	if (tuple_is_v4(tuple))
+		families[n++] = AF_INET;
+
+#if WANT_IPV6
+	families[n++] = AF_INET6;
+#endif
+
+	return n;
+}
+
+#if !KERNEL_BACKENDS
+
+/*
+** Look up a connection using the get_user4() and get_user6() functions of
+** the kernel driver, trying each address family in turn.
+*/
+
+static uid_t kernel_lookup(const struct conn_tuple *tuple) {
+	int families[MAX_LOOKUP_FAMILIES];
+	size_t nfamilies;
+	size_t i;
+
+	nfamilies = lookup_families(tuple, families);
+
+	for (i = 0; i < nfamilies; ++i) {
+		struct sockaddr_storage laddr;
+		struct sockaddr_storage faddr;
+		uid_t uid = MISSING_UID;
+
+		tuple_addr_to_sin(&tuple->laddr, families[i], &laddr);
+		tuple_addr_to_sin(&tuple->faddr, families[i], &faddr);
+
+		if (families[i] == AF_INET)
+			uid = get_user4(tuple->lport, tuple->fport, &laddr, &faddr);
+#if WANT_IPV6
+		else
+			uid = get_user6(tuple->lport, tuple->fport, &laddr, &faddr);
+#endif
+
+		if (uid != MISSING_UID)
+			return uid;
+	}
+
+	return MISSING_UID;
+}
+
+static const struct lookup_backend kernel_backend = {
+	"kernel", 0, NULL, kernel_lookup, NULL
+};
+
+const struct lookup_backend *const kernel_backends[] = {
+	&kernel_backend,
+	NULL
+};
+
+#endif
+
+/*
+** Returns the backend called "name", which is "len" characters long,
+** or NULL if there is no such backend.
+*/
+
+static const struct lookup_backend *lookup_find(const char *name, size_t len) {
+	size_t i;
+
+	for (i = 0; kernel_backends[i]; ++i) {
+		if (strlen(kernel_backends[i]->name) == len &&
+			!strncmp(kernel_backends[i]->name, name, len))
+		{
+			return kernel_backends[i];
+		}
+	}
+
+	if (strlen(mock_backend.name) == len && !strncmp(mock_backend.name, name, len))
+		return &mock_backend;
+
+	return NULL;
+}
+
+/*
+** Set up the default lookup chain: every backend of the kernel driver
+** whose option, if any, is enabled.  Backends that fail to open are left
+** out of the chain.
+*/
+
+static void lookup_open_default(void) {
+	size_t i;
+
+	for (i = 0; kernel_backends[i]; ++i) {
+		const struct lookup_backend *backend = kernel_backends[i];
+
+		if (backend->option != 0 && !opt_enabled(backend->option))
+			continue;
+
+		if (backend->open && backend->open(NULL) != 0) {
+			/* Not a fatal error, fall back to the remaining backends */
+			if (backend->option != 0) {
+				o_log(LOG_INFO, "Lookup backend \"%s\" unavailable: %s",
+					backend->name, strerror(errno));
+				disable_opt(backend->option);
+			} else {
+				debug("Lookup backend \"%s\" unavailable: %s",
+					backend->name, strerror(errno));
+			}
+
+			continue;
+		}
+
+		if (lookup_nbackends < MAX_LOOKUP_BACKENDS)
+			lookup_chain_list[lookup_nbackends++] = backend;
+	}
+}
+
+/*
+** Set up the lookup chain.  "list" is a comma-separated list of backend
+** names, each optionally followed by a colon and an argument that is
+** passed to the backend, or NULL for the default chain.
+** Called before privileges are dropped.
+** Returns 0 on success, or -1 on failure.
+*/
+
+int lookup_open(const char *list) {
+	char *copy;
+	char *tok;
+	char *saveptr;
+
+	lookup_nbackends = 0;
+	lookup_open_stats();
+
+	if (!list) {
+		lookup_adaptive = true;
+		lookup_open_default();
+		return 0;
+	}
+
+	lookup_adaptive = false;
+
+	copy = xstrdup(list);
+
+	for (tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		const struct lookup_backend *backend;
+		char *arg = strchr(tok, ':');
+
+		backend = lookup_find(tok, arg ? (size_t) (arg - tok) : strlen(tok));
+		if (!backend) {
+			o_log(LOG_CRIT, "Fatal: Unknown lookup backend: \"%s\"", tok);
+			goto out_fail;
+		}
+
+		if (lookup_nbackends == MAX_LOOKUP_BACKENDS) {
+			o_log(LOG_CRIT, "Fatal: Too many lookup backends");
+			goto out_fail;
+		}
+
+		if (backend->open && backend->open(arg ? arg + 1 : NULL) != 0) {
+			o_log(LOG_CRIT, "Fatal: Lookup backend \"%s\": %s",
+				backend->name, strerror(errno));
+			goto out_fail;
+		}
+
+		lookup_chain_list[lookup_nbackends++] = backend;
+	}
+
+	free(copy);
+	return 0;
+
+out_fail:
+	free(copy);
+	return -1;
+}
+
+/*
+** Prepare the backends of the lookup chain for use in a child process that
+** looks up connections while its parent does.
+*/
+
+void lookup_reopen(void) {
+	size_t i;
+
+	for (i = 0; i < lookup_nbackends; ++i) {
+		if (lookup_chain_list[i]->reopen)
+			lookup_chain_list[i]->reopen();
+	}
+}
+
+/*
+** Map the shared lookup statistics.  They are kept in shared memory so that
+** the lookups performed by forked children are counted.  Without them, the
+** chain is used as configured.
+*/
+
+static void lookup_open_stats(void) {
+	void *mem;
+
+	if (lookup_shared)
+		return;
+
+	mem = mmap(NULL, sizeof(*lookup_shared), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		debug("mmap: %s", strerror(errno));
+		return;
+	}
+
+	lookup_shared = mem;
+}
+
+/*
+** Returns the value of a monotonic clock in microseconds.
+*/
+
+static u_int64_t lookup_now(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+
+	return (u_int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+** Record a lookup by the backend at position "idx" of the chain that
+** started at "start".
+*/
+
+static void lookup_record(size_t idx, u_int64_t start, bool hit) {
+	struct lookup_stats *stats = &lookup_shared->stats[idx];
+	u_int64_t usecs = lookup_now() - start;
+	size_t bucket = 0;
+
+	while (bucket < LOOKUP_HIST_BUCKETS - 1 && usecs >= (1ULL << bucket))
+		++bucket;
+
+	__sync_fetch_and_add(&stats->calls, 1);
+	__sync_fetch_and_add(&stats->usecs, (unsigned long) usecs);
+	__sync_fetch_and_add(&stats->hist[bucket], 1);
+
+	if (hit)
+		__sync_fetch_and_add(&stats->hits, 1);
+}
+
+/*
+** Record that the backend at position "idx" of the chain found a
+** connection that the backends before it, which were used unless skipped
+** and not "probe", did not find.
+*/
+
+static void lookup_rescued(size_t idx, bool probe) {
+	size_t i;
+
+	for (i = 0; i < idx; ++i) {
+		if (!lookup_skipped[i] || probe)
+			__sync_fetch_and_add(&lookup_shared->stats[i].rescued, 1);
+	}
+}
+
+/*
+** Decide which backends of the default chain to skip.  A backend that
+** found none of the connections it was asked about in its last
+** LOOKUP_TUNE_MIN or more lookups, while a later backend found some of
+** them, is skipped.  Having no hits alone is no reason to skip a backend,
+** since queries for connections that do not exist, such as those of
+** scanners, miss in every backend.  On Linux, this drops an eBPF map that
+** is not being populated, but never the last backend of the chain, which
+** has no other backend to fall back on.  The chain is never reordered: it
+** is ordered from the cheapest to the most expensive backend.
+**
+** Called by the parent process before each fork, so that the decision is
+** inherited by the child.
+*/
+
+void lookup_tune(void) {
+	size_t i;
+
+	if (!lookup_adaptive || !lookup_shared)
+		return;
+
+	for (i = 0; i < lookup_nbackends; ++i) {
+		struct lookup_window *win = &lookup_windows[i];
+		unsigned long calls = lookup_shared->stats[i].calls;
+		unsigned long hits = lookup_shared->stats[i].hits;
+		unsigned long rescued = lookup_shared->stats[i].rescued;
+
+		if (calls - win->calls < LOOKUP_TUNE_MIN)
+			continue;
+
+		win->last_hits = hits - win->hits;
+		win->last_rescued = rescued - win->rescued;
+		win->calls = calls;
+		win->hits = hits;
+		win->rescued = rescued;
+	}
+
+	for (i = 0; i < lookup_nbackends; ++i) {
+		const struct lookup_window *win = &lookup_windows[i];
+		bool skip = win->calls != 0 && win->last_hits == 0 &&
+					win->last_rescued > 0;
+
+		if (skip != lookup_skipped[i]) {
+			o_log(LOG_INFO, "Lookup backend \"%s\" %s",
+				lookup_chain_list[i]->name,
+				skip ? "skipped: later backends find its connections"
+					: "no longer skipped");
+		}
+
+		lookup_skipped[i] = skip;
+	}
+}
+
+/*
+** Log the lookup statistics of every backend of the chain.
+*/
+
+void lookup_report(void) {
+	size_t i;
+
+	if (!lookup_shared)
+		return;
+
+	o_log(LOG_INFO, "Lookup statistics (%lu queries, %s chain):",
+		lookup_shared->queries, lookup_adaptive ? "adaptive" : "fixed");
+
+	for (i = 0; i < lookup_nbackends; ++i) {
+		const struct lookup_stats *stats = &lookup_shared->stats[i];
+		char hist[LOOKUP_HIST_BUCKETS * 12];
+		size_t len = 0;
+		size_t b;
+
+		for (b = 0; b < LOOKUP_HIST_BUCKETS; ++b) {
+			int ret = snprintf(hist + len, sizeof(hist) - len, "%s%lu",
+						b ? " " : "", stats->hist[b]);
+
+			if (ret < 0 || (size_t) ret >= sizeof(hist) - len)
+				break;
+
+			len += ret;
+		}
+
+		o_log(LOG_INFO, "  %s: %s, %lu lookups, %lu hits, %lu found later, "
+			"%lu us mean, latency histogram (log2 us): %s",
+			lookup_chain_list[i]->name,
+			lookup_skipped[i] ? "skipped" : "active",
+			stats->calls, stats->hits, stats->rescued,
+			stats->calls ? stats->usecs / stats->calls : 0, hist);
+	}
+}
+
+/*
+** Look up a connection using each backend of the lookup chain in turn.
+** Backends skipped by lookup_tune() are only used for probe queries.
+** Returns the UID of the owner of the connection, or MISSING_UID on failure.
+*/
+
+uid_t lookup_chain(const struct conn_tuple *tuple) {
+	bool probe = true;
+	size_t i;
+
+	memset(&lookup_sock, 0, sizeof(lookup_sock));
+
+	if (lookup_shared) {
+		unsigned long n = __sync_fetch_and_add(&lookup_shared->queries, 1);
+		probe = n % LOOKUP_PROBE_INTERVAL == 0;
+	}
+
+	for (i = 0; i < lookup_nbackends; ++i) {
+		u_int64_t start = 0;
+		uid_t uid;
+
+		if (lookup_skipped[i] && !probe)
+			continue;
+
+		if (lookup_shared)
+			start = lookup_now();
+
+		uid = lookup_chain_list[i]->lookup(tuple);
+
+		if (lookup_shared)
+			lookup_record(i, start, uid != MISSING_UID);
+
+		if (uid != MISSING_UID) {
+			if (lookup_shared)
+				lookup_rescued(i, probe);
+
+			return uid;
+		}
+	}
+
+	return MISSING_UID;
+}
+
+/*
+** Record the properties of the socket found by a backend.  Backends that
+** know any of them call this before returning the UID of the owner.
+*/
+
+void lookup_set_sock(const struct lookup_sock *sock) {
+	lookup_sock = *sock;
+}
+
+/*
+** Record the inode of the socket found by a backend that knows nothing else
+** about it.
+*/
+
+void lookup_set_inode(unsigned long inode) {
+	memset(&lookup_sock, 0, sizeof(lookup_sock));
+	lookup_sock.inode = inode;
+}
+
+/*
+** Returns the properties of the socket found by the last lookup.
+*/
+
+const struct lookup_sock *lookup_last_sock(void) {
+	return &lookup_sock;
+}
+
+/*
+** Returns the UID of the owner of a connection, or MISSING_UID on failure.
+** The connection is looked up under every address family it may be listed
+** under.
+*/
+
+uid_t get_user(const struct conn_tuple *tuple) {
+	return lookup_chain(tuple);
+}
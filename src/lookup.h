@@ -0,0 +1,103 @@
+/*
+** lookup.h - oidentd connection lookup.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_LOOKUP_H
+#define __OIDENTD_LOOKUP_H
+
+/*
+** Maximum number of address families a single connection may be listed
+** under.
+*/
+
+#define MAX_LOOKUP_FAMILIES	2
+
+/*
+** Maximum number of backends in the lookup chain.
+*/
+
+#define MAX_LOOKUP_BACKENDS	8
+
+/*
+** Number of buckets of the per-backend latency histograms.
+*/
+
+#define LOOKUP_HIST_BUCKETS	16
+
+/*
+** A source of socket ownership information.
+**
+** open() is called once, before privileges are dropped, with the argument
+** given after the backend name in the --lookup list, or NULL.  It returns
+** 0 on success, or -1 with errno set.  It may be NULL.
+**
+** lookup() returns the UID of the owner of the connection "tuple", or
+** MISSING_UID.  The connection is looked for under every address family
+** returned by lookup_families(), and earlier families take precedence.
+**
+** reopen() is called in child processes that look up connections while
+** their parent does, to replace state that cannot be used by both, such
+** as netlink sockets.  It may be NULL.
+**
+** Backends with a non-zero "option" are only part of the default chain if
+** that option is enabled.
+*/
+
+struct lookup_backend {
+	const char *name;
+	u_int32_t option;
+	int (*open)(const char *arg);
+	uid_t (*lookup)(const struct conn_tuple *tuple);
+	void (*reopen)(void);
+};
+
+/*
+** Properties of the socket found by a lookup, as far as the backend that
+** found it knows them.  "inode" is 0 if it is not known.
+*/
+
+struct lookup_sock {
+	unsigned long inode;
+	u_int64_t cgroup_id;
+	u_int32_t mark;
+	bool have_cgroup;
+	bool have_mark;
+};
+
+/*
+** NULL-terminated list of the backends provided by the kernel driver,
+** in the order of the default chain.
+*/
+
+extern const struct lookup_backend *const kernel_backends[];
+
+extern const struct lookup_backend mock_backend;
+
+size_t lookup_families(const struct conn_tuple *tuple, int *families);
+
+int lookup_open(const char *list);
+void lookup_reopen(void);
+void lookup_tune(void);
+void lookup_report(void);
+
+void lookup_set_sock(const struct lookup_sock *sock);
+void lookup_set_inode(unsigned long inode);
+const struct lookup_sock *lookup_last_sock(void);
+
+uid_t lookup_chain(const struct conn_tuple *tuple);
+
+#endif
@@ -26,8 +26,10 @@
 #include <string.h>
 #include <errno.h>
 #include <pwd.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -37,203 +39,329 @@
 #include "missing.h"
 #include "inet_util.h"
 #include "masq.h"
+#include "masq_map.h"
 #include "options.h"
 #include "forward.h"
+#include "lookup.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
 
 struct sockaddr_storage proxy;
 
 #if MASQ_SUPPORT
 
-in_port_t fwdport;
-
-extern char *ret_os;
+/*
+** Values of the word claimed by the lookup that replies to a raced query.
+*/
 
-static bool blank_line(const char *buf);
+enum {
+	MASQ_CLAIM_NONE,
+	MASQ_CLAIM_LOCAL,
+	MASQ_CLAIM_NAT,
+};
 
 /*
-** Returns true if the buffer contains only
-** blank characters (spaces and/or tabs).  Returns
-** false otherwise.
+** The lookup order of queries received at a local address, as given with
+** --masquerade-order.
 */
 
-static bool blank_line(const char *buf) {
-	const char *p;
+struct masq_order_addr {
+	struct tuple_addr addr;
+	int order;
+};
 
-	for (p = buf; *p; ++p) {
-		if (*p != ' ' && *p != '\t')
-			return false;
-	}
+in_port_t fwdport;
 
-	return true;
-}
+extern char *ret_os;
+extern u_int32_t timeout;
+
+static struct masq_order_addr *masq_orders;
+static size_t masq_norders;
+static int masq_default_order = MASQ_ORDER_LOCAL;
+
+static volatile u_int32_t *masq_claim_word;
+static u_int32_t masq_claimant;
+
+static int masq_order_name(const char *name, size_t len);
 
 /*
-** Parse the masquerading map file.
+** Find the reply for a host in the section of the masquerading map selected
+** by "scope".
 ** Returns 0 on success, -1 on failure.
 */
 
-int find_masq_entry(struct sockaddr_storage *host,
+int find_masq_entry(	const struct masq_scope *scope,
+					const struct tuple_addr *host,
 					char *user,
 					size_t user_len,
 					char *os,
 					size_t os_len)
 {
-	FILE *fp;
-	struct sockaddr_storage addr;
-	u_int32_t line_num;
-	char buf[4096];
-
-	fp = fopen(MASQ_MAP, "r");
-	if (!fp) {
-		if (errno != EEXIST)
-			debug("fopen: %s: %s", MASQ_MAP, strerror(errno));
+	const char *map_user;
+	const char *map_os;
+
+	if (masq_map_find(scope, host, &map_user, &map_os) == -1)
 		return -1;
-	}
 
-	line_num = 0;
+	if (strlen(map_user) >= user_len) {
+		debug("[%s] Username too long (limit is %zu)", MASQ_MAP, user_len);
+		return -1;
+	}
 
-	while (fgets(buf, sizeof(buf), fp)) {
-		struct sockaddr_storage stemp;
-		char *p, *temp;
+	if (strlen(map_os) >= os_len) {
+		debug("[%s] OS name too long (limit is %zu)", MASQ_MAP, os_len);
+		return -1;
+	}
 
-		++line_num;
-		p = strchr(buf, '\n');
-		if (!p) {
-			debug("[%s:%d] Line too long", MASQ_MAP, line_num);
-			goto failure;
-		}
-		*p = '\0';
+	xstrncpy(user, map_user, user_len);
+	xstrncpy(os, map_os, os_len);
 
-		if (buf[0] == '#')
-			continue;
+	return 0;
+}
 
-		if (blank_line(buf))
-			continue;
+/*
+** Forward an Ident request to another machine, return the response to the
+** client that has connected to us and requested it.
+*/
 
-		p = strchr(buf, '\r');
-		if (p)
-			*p = '\0';
+int fwd_request(	int sock,
+					in_port_t real_lport,
+					in_port_t masq_lport,
+					in_port_t real_fport,
+					in_port_t masq_fport,
+					struct sockaddr_storage *mrelay)
+{
+	char ipbuf[MAX_IPLEN];
+	char user[512];
+	int ret;
 
-		p = strtok(buf, " \t");
-		if (!p) {
-			debug("[%s:%d] Missing address parameter", MASQ_MAP, line_num);
-			goto failure;
-		}
+	ret = forward_request(mrelay, 1, fwdport, masq_lport, masq_fport,
+		user, sizeof user);
+	if (ret == -1)
+		return -1;
 
-		temp = strchr(p, '/');
-		if (temp)
-			*temp++ = '\0';
+	sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
+		real_lport, real_fport, ret_os, user);
 
-		if (get_addr(p, &stemp) == -1) {
-			debug("[%s:%d] Invalid address: %s", MASQ_MAP, line_num, p);
-			goto failure;
-		}
+	get_ip(mrelay, ipbuf, sizeof(ipbuf));
+	o_log(LOG_INFO,
+		"[%s] Successful lookup (by forward): %d (%d) , %d (%d) : %s",
+		ipbuf, real_lport, masq_lport, real_fport, masq_fport, user);
 
-		sin_copy(&addr, &stemp);
+	return 0;
+}
 
-		if (stemp.ss_family == AF_INET && temp) {
-			in_addr_t mask, mask2;
-			char *end;
+/*
+** Returns the lookup order called "name", of "len" characters, or -1.
+*/
 
-			mask = strtoul(temp, &end, 10);
+static int masq_order_name(const char *name, size_t len) {
+	static const char *const names[] = {
+		[MASQ_ORDER_LOCAL] = "local",
+		[MASQ_ORDER_NAT] = "nat",
+		[MASQ_ORDER_RACE] = "race",
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strlen(names[i]) == len && !strncmp(names[i], name, len))
+			return (int) i;
+	}
 
-			if (*end != '\0') {
-				if (get_addr(temp, &stemp) == -1) {
-					debug("[%s:%d] Invalid address: %s",
-						MASQ_MAP, line_num, temp);
+	return -1;
+}
 
-					goto failure;
-				}
+/*
+** Parse the argument of --masquerade-order, a comma-separated list of
+** lookup orders, each optionally followed by a colon and the local address
+** of the queries it applies to.  An order without an address applies to
+** queries received at other addresses.
+** Returns 0 on success, or -1 on failure.
+*/
 
-				mask2 = SIN4(&stemp)->sin_addr.s_addr;
-			} else {
-				if (mask < 1 || mask > 31) {
-					debug("[%s:%d] Invalid mask: %s",
-						MASQ_MAP, line_num, temp);
+int masq_order_parse(const char *list) {
+	char *copy = xstrdup(list);
+	char *saveptr;
+	char *tok;
+
+	free(masq_orders);
+	masq_orders = NULL;
+	masq_norders = 0;
+	masq_default_order = MASQ_ORDER_LOCAL;
+
+	for (tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+		char *host = strchr(tok, ':');
+		struct sockaddr_storage ss;
+		int order;
+
+		order = masq_order_name(tok, host ? (size_t) (host - tok) : strlen(tok));
+		if (order == -1) {
+			o_log(LOG_CRIT, "Fatal: Unknown lookup order: \"%s\"", tok);
+			goto out_fail;
+		}
 
-					goto failure;
-				}
+		if (!host) {
+			masq_default_order = order;
+			continue;
+		}
 
-				mask2 = htonl(~(((uint32_t) 1 << (32 - mask)) - 1));
-			}
+		if (get_addr(host + 1, &ss) == -1) {
+			o_log(LOG_CRIT, "Fatal: Unknown host: \"%s\"", host + 1);
+			goto out_fail;
+		}
 
-			SIN4(&addr)->sin_addr.s_addr &= mask2;
-			SIN4(host)->sin_addr.s_addr &= mask2;
+		if (masq_norders % 16 == 0) {
+			masq_orders = xrealloc(masq_orders,
+				sizeof(*masq_orders) * (masq_norders + 16));
 		}
 
-		if (!sin_equal(&addr, host))
-			continue;
+		tuple_addr_from_sin(&masq_orders[masq_norders].addr, &ss);
+		masq_orders[masq_norders++].order = order;
+	}
 
-		p = strtok(NULL, " \t");
-		if (!p) {
-			debug("[%s:%d] Missing user parameter", MASQ_MAP, line_num);
-			goto failure;
-		}
+	free(copy);
+	return 0;
 
-		if (strlen(p) >= user_len) {
-			debug("[%s:%d] Username too long (limit is %ld)",
-				MASQ_MAP, line_num, user_len);
+out_fail:
+	free(copy);
+	return -1;
+}
 
-			goto failure;
-		}
+/*
+** Returns the lookup order of queries received at the local address
+** "laddr".
+*/
 
-		xstrncpy(user, p, user_len);
+int masq_order(const struct tuple_addr *laddr) {
+	size_t i;
 
-		p = strtok(NULL, " \t");
-		if (!p) {
-			debug("[%s:%d] Missing OS parameter", MASQ_MAP, line_num);
+	for (i = 0; i < masq_norders; ++i) {
+		if (tuple_addr_equal(&masq_orders[i].addr, laddr))
+			return masq_orders[i].order;
+	}
 
-			goto failure;
-		}
+	return masq_default_order;
+}
 
-		if (strlen(p) >= os_len) {
-			debug("[%s:%d] OS name too long (limit is %ld)",
-				MASQ_MAP, line_num, os_len);
+/*
+** Returns true if the lookup order "order" applies to queries received at
+** any local address.
+*/
 
-			goto failure;
-		}
+bool masq_order_used(int order) {
+	size_t i;
 
-		xstrncpy(os, p, os_len);
+	if (masq_default_order == order)
+		return true;
 
-		fclose(fp);
-		return 0;
+	for (i = 0; i < masq_norders; ++i) {
+		if (masq_orders[i].order == order)
+			return true;
 	}
 
-failure:
-	fclose(fp);
-	return -1;
+	return false;
 }
 
 /*
-** Forward an Ident request to another machine, return the response to the
-** client that has connected to us and requested it.
+** Claim the reply to the current query.  Outside of raced queries, this
+** always succeeds.  Otherwise, only the first of the local and the NAT
+** lookup to find the connection may reply.
+** Returns true if the caller may reply.
 */
 
-int fwd_request(	int sock,
-					in_port_t real_lport,
-					in_port_t masq_lport,
-					in_port_t real_fport,
-					in_port_t masq_fport,
-					struct sockaddr_storage *mrelay)
-{
-	char ipbuf[MAX_IPLEN];
-	char user[512];
-	int ret;
+bool masq_claim(void) {
+	if (!masq_claim_word)
+		return true;
+
+	return __sync_bool_compare_and_swap(masq_claim_word,
+			MASQ_CLAIM_NONE, masq_claimant) ||
+		*masq_claim_word == masq_claimant;
+}
+
+/*
+** Look up a connection locally and as a NAT connection at the same time.
+** The NAT lookup is performed by a child process, which replies to the
+** query itself if it finds the connection first.  Connections found by the
+** local lookup first are replied to by the caller, and the child process
+** is killed.
+** Returns 0 if the NAT lookup replied to the query.  Otherwise, returns -1
+** and stores the owner of the connection, or MISSING_UID, in "uid".
+*/
+
+int masq_race(int sock, const struct conn_tuple *tuple, uid_t *uid) {
+	void (*old_handler)(int);
+	void *mem;
+	pid_t child;
+	int status;
+	int ret = -1;
+
+	mem = mmap(NULL, sizeof(*masq_claim_word), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		debug("mmap: %s", strerror(errno));
+
+		*uid = get_user(tuple);
+		if (*uid == MISSING_UID && masq(sock, tuple) == 0)
+			return 0;
 
-	ret = forward_request(mrelay, fwdport, masq_lport, masq_fport,
-		user, sizeof user);
-	if (ret == -1)
 		return -1;
+	}
 
-	sockprintf(sock, "%d,%d:USERID:%s:%s\r\n",
-		real_lport, real_fport, ret_os, user);
+	masq_claim_word = mem;
+	*masq_claim_word = MASQ_CLAIM_NONE;
 
-	get_ip(mrelay, ipbuf, sizeof(ipbuf));
-	o_log(LOG_INFO,
-		"[%s] Successful lookup (by forward): %d (%d) , %d (%d) : %s",
-		ipbuf, real_lport, masq_lport, real_fport, masq_fport, user);
+	/* The child is waited for here, not by the SIGCHLD handler. */
+	old_handler = signal(SIGCHLD, SIG_DFL);
 
-	return 0;
+	child = fork();
+	if (child == 0) {
+		alarm(timeout);
+		masq_claimant = MASQ_CLAIM_NAT;
+
+		/* The parent keeps using its lookup sockets. */
+		lookup_reopen();
+
+		_exit(masq(sock, tuple) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	if (child == -1)
+		debug("fork: %s", strerror(errno));
+
+	masq_claimant = MASQ_CLAIM_LOCAL;
+	*uid = get_user(tuple);
+
+	if (child == -1) {
+		if (*uid == MISSING_UID && masq(sock, tuple) == 0)
+			ret = 0;
+	} else if (*uid != MISSING_UID && masq_claim()) {
+		kill(child, SIGKILL);
+		waitpid(child, &status, 0);
+	} else {
+		while (waitpid(child, &status, 0) == -1 && errno == EINTR)
+			;
+
+		/*
+		** A reply of the NAT lookup wins over the local lookup.  If it
+		** claimed the query but found no one to reply for, the local result
+		** is used, as it would be with --masquerade-first.
+		*/
+
+		if (*masq_claim_word == MASQ_CLAIM_NAT &&
+			WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+		{
+			*uid = MISSING_UID;
+			ret = 0;
+		}
+	}
+
+	signal(SIGCHLD, old_handler);
+	munmap(mem, sizeof(*masq_claim_word));
+	masq_claim_word = NULL;
+
+	return ret;
 }
 
 #else
@@ -243,12 +371,7 @@ int fwd_request(	int sock,
 ** Returns non-zero on failure.
 */
 
-int masq(	int sock __notused,
-			in_port_t lport __notused,
-			in_port_t fport __notused,
-			struct sockaddr_storage *local __notused,
-			struct sockaddr_storage *remote __notused)
-{
+int masq(int sock __notused, const struct conn_tuple *tuple __notused) {
 	return -1;
 }
 
@@ -22,7 +22,20 @@
 
 #if MASQ_SUPPORT
 
-int find_masq_entry(struct sockaddr_storage *host,
+/*
+** The order in which the local and NAT lookups of a query are performed.
+*/
+
+enum {
+	MASQ_ORDER_LOCAL,
+	MASQ_ORDER_NAT,
+	MASQ_ORDER_RACE,
+};
+
+struct masq_scope;
+
+int find_masq_entry(	const struct masq_scope *scope,
+					const struct tuple_addr *host,
 					char *user,
 					size_t user_len,
 					char *os,
@@ -35,12 +48,14 @@ int fwd_request(int sock,
 				in_port_t masq_fport,
 				struct sockaddr_storage *mrelay);
 
+int masq_order_parse(const char *list);
+int masq_order(const struct tuple_addr *laddr);
+bool masq_order_used(int order);
+int masq_race(int sock, const struct conn_tuple *tuple, uid_t *uid);
+bool masq_claim(void);
+
 #endif
 
-int masq(	int sock,
-			in_port_t lport,
-			in_port_t fport,
-			struct sockaddr_storage *laddr,
-			struct sockaddr_storage *faddr);
+int masq(int sock, const struct conn_tuple *tuple);
 
 #endif
@@ -0,0 +1,1204 @@
+/*
+** masq_map.c - oidentd compiled masquerading map.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+/*
+** The masquerading map is compiled once, at startup and when oidentd is
+** told to reload, so that looking up the reply for a masqueraded host never
+** touches the file system or the resolver.
+**
+** Rules are stored in path-compressed binary tries, one keyed on the 32 bits
+** of IPv4 addresses and one keyed on the 128 bits of IPv6 addresses.  A
+** lookup walks down from the root of the trie of the family of the host,
+** remembering the last node on its path that holds a rule, which is the
+** most specific rule matching the host.  The depth of a trie is bounded by
+** the length of its keys, and its size by twice the number of rules, so
+** large maps of customer prefixes are searched as quickly as small ones.
+**
+** Overlapping rules are reported when the map is compiled, since a rule
+** nested in the prefix of another, less specific rule is often a mistake
+** in a map that assigns prefixes to customers.
+**
+** Rules may be grouped in sections, each selected by the local address
+** queries arrive at and holding its own pair of tries, so that tenants with
+** overlapping private address ranges are told apart.  A section may also
+** restrict the conntrack entries its queries are matched to by zone and
+** mark.  Rules outside of any section form section 0, which is used for
+** queries arriving at other addresses.  The other sections are sorted by
+** address, and found by binary search.
+**
+** The compiled map is a single block of memory: a header, followed by the
+** trie nodes, the rules and the strings the rules refer to.  It contains
+** no pointers, only indices and offsets into these arrays, so the same
+** block can be written to a file by "--compile-masq" and mapped from it.
+** A mapped map is only checked as far as its header, so that it is loaded
+** in constant time and paged in as it is used; lookups check every index
+** they follow against the bounds given in the header instead.
+*/
+
+#include <config.h>
+
+#if MASQ_SUPPORT
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "inet_util.h"
+#include "masq_map.h"
+
+#define MASQ_MAP_MAGIC		"OIDMASQ"
+#define MASQ_MAP_VERSION	2
+#define MASQ_MAP_ORDER		0x01020304
+#define MASQ_MAP_NONE		((u_int32_t) -1)
+
+#define MASQ_MAP_ZONE_MAX		65535
+
+/*
+** The header of a compiled map.  Compiled maps are only read on hosts with
+** the byte order of the host they were compiled on.
+*/
+
+struct masq_map_hdr {
+	char magic[8];
+	u_int32_t version;
+	u_int32_t order;
+	u_int32_t size;
+	u_int32_t sections;
+	u_int32_t nodes;
+	u_int32_t rules;
+	u_int32_t strings;
+};
+
+/*
+** A section.  "root" holds the indices of the roots of its IPv4 and IPv6
+** tries.  The address of section 0 is unused.
+*/
+
+struct masq_map_section {
+	struct tuple_addr addr;
+	u_int32_t flags;
+	u_int32_t zone;
+	u_int32_t mark;
+	u_int32_t mark_mask;
+	u_int32_t root[2];
+	u_int32_t line;
+};
+
+/*
+** A node of a trie.  The prefix is stored as words in host byte order;
+** IPv4 prefixes use the first word only.  Nodes 0 and 1 are the roots of
+** the tries of section 0, and roots are never children, so a child index
+** of 0 means there is no child.
+*/
+
+struct masq_map_node {
+	u_int32_t prefix[4];
+	u_int32_t child[2];
+	u_int32_t rule;
+	u_int32_t plen;
+};
+
+/*
+** A rule.  The user and OS strings are offsets into the string pool.
+*/
+
+struct masq_map_rule {
+	u_int32_t user;
+	u_int32_t os;
+	u_int32_t line;
+};
+
+struct masq_map_build {
+	struct masq_map_section *section;
+	size_t sections;
+	size_t section_max;
+	struct masq_map_node *node;
+	size_t nodes;
+	size_t node_max;
+	struct masq_map_rule *rule;
+	size_t rules;
+	size_t rule_max;
+	char *str;
+	size_t str_len;
+	size_t str_max;
+	u_int32_t overlaps;
+};
+
+static struct masq_map_hdr *masq_map;
+static size_t masq_map_mapped;
+
+static bool blank_line(const char *buf);
+static inline u_int32_t key_bit(const u_int32_t *key, u_int32_t bit);
+static inline bool key_match(	const u_int32_t *key,
+								const u_int32_t *prefix,
+								u_int32_t plen);
+static u_int32_t key_common(	const u_int32_t *a,
+								const u_int32_t *b,
+								u_int32_t max);
+static void key_mask(u_int32_t *key, u_int32_t plen);
+static u_int32_t build_node(	struct masq_map_build *build,
+								const u_int32_t *key,
+								u_int32_t plen,
+								u_int32_t rule);
+static u_int32_t build_string(struct masq_map_build *build, const char *str);
+static void build_section(	struct masq_map_build *build,
+							const struct tuple_addr *addr,
+							u_int32_t line_num);
+static int build_sort(struct masq_map_build *build, const char *path);
+static int section_cmp(const void *a, const void *b);
+static u_int32_t build_first_rule(	struct masq_map_build *build,
+									u_int32_t cur);
+static u_int32_t build_insert(	struct masq_map_build *build,
+								u_int32_t root,
+								const u_int32_t *key,
+								u_int32_t plen,
+								u_int32_t rule,
+								u_int32_t *outer,
+								u_int32_t *inner);
+static int parse_host(const char *str, struct sockaddr_storage *ss);
+static int parse_mask(const char *str, int family, u_int32_t *plen);
+static int parse_line(	struct masq_map_build *build,
+						const char *path,
+						u_int32_t line_num,
+						char *buf);
+static int parse_section(	struct masq_map_build *build,
+							const char *path,
+							u_int32_t line_num,
+							char *buf);
+static int build_map(	struct masq_map_build *build,
+						FILE *fp,
+						const char *path);
+static struct masq_map_hdr *build_image(struct masq_map_build *build);
+static void build_free(struct masq_map_build *build);
+static int map_file(int fd, const char *path);
+static void map_set(struct masq_map_hdr *map, size_t mapped);
+
+static inline const struct masq_map_section *map_sections(
+	const struct masq_map_hdr *map);
+static inline const struct masq_map_node *map_nodes(
+	const struct masq_map_hdr *map);
+static inline const struct masq_map_rule *map_rules(
+	const struct masq_map_hdr *map);
+static inline const char *map_strings(const struct masq_map_hdr *map);
+
+/*
+** Returns true if the buffer contains only
+** blank characters (spaces and/or tabs).  Returns
+** false otherwise.
+*/
+
+static bool blank_line(const char *buf) {
+	const char *p;
+
+	for (p = buf; *p; ++p) {
+		if (*p != ' ' && *p != '\t')
+			return false;
+	}
+
+	return true;
+}
+
+/*
+** Returns the specified bit of a key, counting from the most significant bit.
+*/
+
+static inline u_int32_t key_bit(const u_int32_t *key, u_int32_t bit) {
+	return (key[bit / 32] >> (31 - bit % 32)) & 1;
+}
+
+/*
+** Returns true if the first "plen" bits of the key and the prefix are equal.
+*/
+
+static inline bool key_match(	const u_int32_t *key,
+								const u_int32_t *prefix,
+								u_int32_t plen)
+{
+	size_t i;
+
+	for (i = 0; plen >= 32; ++i, plen -= 32) {
+		if (key[i] != prefix[i])
+			return false;
+	}
+
+	if (plen == 0)
+		return true;
+
+	return ((key[i] ^ prefix[i]) & ~(0xFFFFFFFFU >> plen)) == 0;
+}
+
+/*
+** Returns the number of leading bits two keys have in common, up to "max".
+*/
+
+static u_int32_t key_common(	const u_int32_t *a,
+								const u_int32_t *b,
+								u_int32_t max)
+{
+	u_int32_t bit;
+
+	for (bit = 0; bit < max; ++bit) {
+		if (key_bit(a, bit) != key_bit(b, bit))
+			break;
+	}
+
+	return bit;
+}
+
+/*
+** Clear the bits of a key that are not part of its first "plen" bits.
+*/
+
+static void key_mask(u_int32_t *key, u_int32_t plen) {
+	size_t i;
+
+	for (i = 0; i < 4; ++i) {
+		if (plen >= 32) {
+			plen -= 32;
+			continue;
+		}
+
+		key[i] &= plen ? ~(0xFFFFFFFFU >> plen) : 0;
+		plen = 0;
+	}
+}
+
+/*
+** Append a node to the trie being built.  Returns the index of the node.
+*/
+
+static u_int32_t build_node(	struct masq_map_build *build,
+								const u_int32_t *key,
+								u_int32_t plen,
+								u_int32_t rule)
+{
+	struct masq_map_node *node;
+
+	if (build->nodes == build->node_max) {
+		build->node_max = build->node_max ? build->node_max * 2 : 64;
+		build->node = xrealloc(build->node,
+			build->node_max * sizeof(*build->node));
+	}
+
+	node = &build->node[build->nodes];
+	memcpy(node->prefix, key, sizeof(node->prefix));
+	key_mask(node->prefix, plen);
+	node->child[0] = 0;
+	node->child[1] = 0;
+	node->rule = rule;
+	node->plen = plen;
+
+	return build->nodes++;
+}
+
+/*
+** Append a string to the string pool.  Returns its offset.
+*/
+
+static u_int32_t build_string(struct masq_map_build *build, const char *str) {
+	size_t len = strlen(str) + 1;
+	u_int32_t off;
+
+	while (build->str_len + len > build->str_max) {
+		build->str_max = build->str_max ? build->str_max * 2 : 1024;
+		build->str = xrealloc(build->str, build->str_max);
+	}
+
+	off = build->str_len;
+	memcpy(build->str + off, str, len);
+	build->str_len += len;
+
+	return off;
+}
+
+/*
+** Start a new section, with empty tries.  Rules are added to the section
+** started last.
+*/
+
+static void build_section(	struct masq_map_build *build,
+							const struct tuple_addr *addr,
+							u_int32_t line_num)
+{
+	static const u_int32_t root[4] = { 0, 0, 0, 0 };
+	struct masq_map_section *section;
+
+	if (build->sections == build->section_max) {
+		build->section_max = build->section_max ? build->section_max * 2 : 16;
+		build->section = xrealloc(build->section,
+			build->section_max * sizeof(*build->section));
+	}
+
+	section = &build->section[build->sections++];
+	memset(section, 0, sizeof(*section));
+	section->addr = *addr;
+	section->line = line_num;
+	section->root[0] = build_node(build, root, 0, MASQ_MAP_NONE);
+	section->root[1] = build_node(build, root, 0, MASQ_MAP_NONE);
+}
+
+static int section_cmp(const void *a, const void *b) {
+	const struct masq_map_section *sa = a;
+	const struct masq_map_section *sb = b;
+
+	return memcmp(&sa->addr, &sb->addr, sizeof(sa->addr));
+}
+
+/*
+** Sort the sections other than section 0 by address, so that they can be
+** found by binary search.  Returns -1 if two sections have the same address.
+*/
+
+static int build_sort(struct masq_map_build *build, const char *path) {
+	size_t i;
+
+	qsort(build->section + 1, build->sections - 1,
+		sizeof(*build->section), section_cmp);
+
+	for (i = 2; i < build->sections; ++i) {
+		const struct masq_map_section *a = &build->section[i - 1];
+		const struct masq_map_section *b = &build->section[i];
+
+		if (!section_cmp(a, b)) {
+			o_log(LOG_CRIT, "[%s:%u] Duplicate section (see line %u)",
+				path, a->line > b->line ? a->line : b->line,
+				a->line > b->line ? b->line : a->line);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+** Returns the index of a rule stored in the subtrie of a node, or
+** MASQ_MAP_NONE if there is none.  Nodes without a rule, other than the
+** roots, have two children, so following either child leads to a rule.
+*/
+
+static u_int32_t build_first_rule(	struct masq_map_build *build,
+									u_int32_t cur)
+{
+	for (;;) {
+		const struct masq_map_node *node = &build->node[cur];
+
+		if (node->rule != MASQ_MAP_NONE)
+			return node->rule;
+
+		cur = node->child[0] ? node->child[0] : node->child[1];
+		if (cur == 0)
+			return MASQ_MAP_NONE;
+	}
+}
+
+/*
+** Insert a rule for the prefix "key/plen" into a trie being built.
+** Returns MASQ_MAP_NONE if the rule was inserted, or the index of the rule
+** already stored for the same prefix.  If the rule was inserted, "outer"
+** is set to the most specific rule for a prefix containing the new one,
+** and "inner" to a rule for a prefix contained in it, if there are any.
+*/
+
+static u_int32_t build_insert(	struct masq_map_build *build,
+								u_int32_t root,
+								const u_int32_t *key,
+								u_int32_t plen,
+								u_int32_t rule,
+								u_int32_t *outer,
+								u_int32_t *inner)
+{
+	u_int32_t cur = root;
+
+	*outer = MASQ_MAP_NONE;
+	*inner = MASQ_MAP_NONE;
+
+	for (;;) {
+		struct masq_map_node *node = &build->node[cur];
+		struct masq_map_node *child;
+		u_int32_t bit, next, common, mid, leaf;
+
+		/* The prefix of every node on the path is a prefix of the key. */
+		if (node->plen == plen) {
+			if (node->rule != MASQ_MAP_NONE)
+				return node->rule;
+
+			/* A node without a rule is a fork of more specific prefixes. */
+			*inner = build_first_rule(build, cur);
+			node->rule = rule;
+			return MASQ_MAP_NONE;
+		}
+
+		if (node->rule != MASQ_MAP_NONE)
+			*outer = node->rule;
+
+		bit = key_bit(key, node->plen);
+		next = node->child[bit];
+
+		if (next == 0) {
+			leaf = build_node(build, key, plen, rule);
+			build->node[cur].child[bit] = leaf;
+			return MASQ_MAP_NONE;
+		}
+
+		child = &build->node[next];
+		common = key_common(key, child->prefix,
+			child->plen < plen ? child->plen : plen);
+
+		if (common == child->plen) {
+			cur = next;
+			continue;
+		}
+
+		if (common == plen) {
+			/* The new prefix lies between the node and its child. */
+			bit = key_bit(child->prefix, plen);
+			*inner = build_first_rule(build, next);
+			mid = build_node(build, key, plen, rule);
+			build->node[mid].child[bit] = next;
+			build->node[cur].child[key_bit(key, build->node[cur].plen)] = mid;
+			return MASQ_MAP_NONE;
+		}
+
+		/* The new prefix and the child diverge below the node. */
+		mid = build_node(build, key, common, MASQ_MAP_NONE);
+		leaf = build_node(build, key, plen, rule);
+		build->node[mid].child[key_bit(key, common)] = leaf;
+		build->node[mid].child[key_bit(build->node[next].prefix, common)] = next;
+		build->node[cur].child[key_bit(key, build->node[cur].plen)] = mid;
+		return MASQ_MAP_NONE;
+	}
+}
+
+/*
+** Parse the address of a rule.  Numeric addresses are converted directly,
+** so that large maps are compiled without a resolver call per line.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int parse_host(const char *str, struct sockaddr_storage *ss) {
+	struct in_addr in;
+#if WANT_IPV6
+	struct in6_addr in6;
+#endif
+
+	if (inet_pton(AF_INET, str, &in) == 1) {
+		sin_setv4(in.s_addr, ss);
+		return 0;
+	}
+
+#if WANT_IPV6
+	if (inet_pton(AF_INET6, str, &in6) == 1) {
+		sin_setv6(&in6, ss);
+		return 0;
+	}
+#endif
+
+	return get_addr(str, ss);
+}
+
+/*
+** Parse the netmask of a rule, given as a prefix length or, for IPv4, in
+** dotted notation.  Returns 0 on success, -1 on failure.
+*/
+
+static int parse_mask(const char *str, int family, u_int32_t *plen) {
+	struct in_addr in;
+	u_int32_t mask;
+	char *end;
+	unsigned long len;
+
+	len = strtoul(str, &end, 10);
+	if (*str != '\0' && *end == '\0') {
+		if (len > (family == AF_INET ? 32 : 128))
+			return -1;
+
+		*plen = len;
+		return 0;
+	}
+
+	if (family != AF_INET || inet_pton(AF_INET, str, &in) != 1)
+		return -1;
+
+	mask = ntohl(in.s_addr);
+
+	/* Only contiguous masks describe a prefix. */
+	if ((~mask & (~mask + 1)) != 0)
+		return -1;
+
+	for (len = 0; mask != 0; mask <<= 1)
+		++len;
+
+	*plen = len;
+	return 0;
+}
+
+/*
+** Parse a line of the masquerading map and add its rule to the trie being
+** built.  Returns 0 on success, -1 on failure.
+*/
+
+static int parse_line(	struct masq_map_build *build,
+						const char *path,
+						u_int32_t line_num,
+						char *buf)
+{
+	struct sockaddr_storage ss;
+	struct tuple_addr addr;
+	struct masq_map_rule *rule;
+	u_int32_t key[4];
+	u_int32_t root;
+	u_int32_t plen;
+	u_int32_t dup, outer, inner;
+	char *host, *mask, *user, *os;
+	size_t i;
+
+	host = strtok(buf, " \t");
+	if (!host) {
+		o_log(LOG_CRIT, "[%s:%u] Missing address parameter", path, line_num);
+		return -1;
+	}
+
+	user = strtok(NULL, " \t");
+	if (!user) {
+		o_log(LOG_CRIT, "[%s:%u] Missing user parameter", path, line_num);
+		return -1;
+	}
+
+	os = strtok(NULL, " \t");
+	if (!os) {
+		o_log(LOG_CRIT, "[%s:%u] Missing OS parameter", path, line_num);
+		return -1;
+	}
+
+	mask = strchr(host, '/');
+	if (mask)
+		*mask++ = '\0';
+
+	if (parse_host(host, &ss) == -1) {
+		o_log(LOG_CRIT, "[%s:%u] Invalid address: %s", path, line_num, host);
+		return -1;
+	}
+
+	/* IPv4-mapped IPv6 addresses are IPv4 addresses here too. */
+	tuple_addr_from_sin(&addr, &ss);
+	memset(key, 0, sizeof(key));
+
+	if (tuple_addr_is_v4(&addr)) {
+		root = build->section[build->sections - 1].root[0];
+		key[0] = ntohl(addr.s32[3]);
+		plen = 32;
+	} else {
+		root = build->section[build->sections - 1].root[1];
+		for (i = 0; i < 4; ++i)
+			key[i] = ntohl(addr.s32[i]);
+		plen = 128;
+	}
+
+	if (mask) {
+		if (parse_mask(mask, ss.ss_family, &plen) == -1) {
+			o_log(LOG_CRIT, "[%s:%u] Invalid mask: %s",
+				path, line_num, mask);
+			return -1;
+		}
+
+		/* The mask of an IPv4-mapped IPv6 address covers its prefix. */
+		if (ss.ss_family == AF_INET6 && tuple_addr_is_v4(&addr)) {
+			if (plen < 96) {
+				o_log(LOG_CRIT, "[%s:%u] Invalid mask: %s",
+					path, line_num, mask);
+				return -1;
+			}
+
+			plen -= 96;
+		}
+	}
+
+	if (build->rules == build->rule_max) {
+		build->rule_max = build->rule_max ? build->rule_max * 2 : 64;
+		build->rule = xrealloc(build->rule,
+			build->rule_max * sizeof(*build->rule));
+	}
+
+	dup = build_insert(build, root, key, plen, build->rules, &outer, &inner);
+	if (dup != MASQ_MAP_NONE) {
+		o_log(LOG_INFO, "[%s:%u] Ignoring rule for the same hosts as line %u",
+			path, line_num, build->rule[dup].line);
+		return 0;
+	}
+
+	if (outer != MASQ_MAP_NONE) {
+		debug("[%s:%u] Rule for %s/%u overlaps less specific rule on line %u",
+			path, line_num, host, plen, build->rule[outer].line);
+	}
+
+	if (inner != MASQ_MAP_NONE) {
+		debug("[%s:%u] Rule for %s/%u overlaps more specific rule on line %u",
+			path, line_num, host, plen, build->rule[inner].line);
+	}
+
+	if (outer != MASQ_MAP_NONE || inner != MASQ_MAP_NONE)
+		++build->overlaps;
+
+	rule = &build->rule[build->rules++];
+	rule->user = build_string(build, user);
+	rule->os = build_string(build, os);
+	rule->line = line_num;
+
+	return 0;
+}
+
+/*
+** Parse a section header, "[address [zone zone] [mark mark[/mask]]]", and
+** start the section.  Returns 0 on success, -1 on failure.
+*/
+
+static int parse_section(	struct masq_map_build *build,
+							const char *path,
+							u_int32_t line_num,
+							char *buf)
+{
+	struct masq_map_section *section;
+	struct sockaddr_storage ss;
+	struct tuple_addr addr;
+	char *p, *end;
+
+	p = strrchr(buf, ']');
+	if (!p || !blank_line(p + 1)) {
+		o_log(LOG_CRIT, "[%s:%u] Unterminated section header", path, line_num);
+		return -1;
+	}
+	*p = '\0';
+
+	p = strtok(strchr(buf, '[') + 1, " \t");
+	if (!p || parse_host(p, &ss) == -1) {
+		o_log(LOG_CRIT, "[%s:%u] Invalid section address: %s",
+			path, line_num, p ? p : "");
+		return -1;
+	}
+
+	tuple_addr_from_sin(&addr, &ss);
+	build_section(build, &addr, line_num);
+	section = &build->section[build->sections - 1];
+
+	while ((p = strtok(NULL, " \t"))) {
+		char *arg = strtok(NULL, " \t");
+		unsigned long val;
+
+		if (!arg) {
+			o_log(LOG_CRIT, "[%s:%u] Missing argument to '%s'",
+				path, line_num, p);
+			return -1;
+		}
+
+		if (!strcmp(p, "zone")) {
+			val = strtoul(arg, &end, 0);
+			if (*arg == '\0' || *end != '\0' || val > MASQ_MAP_ZONE_MAX) {
+				o_log(LOG_CRIT, "[%s:%u] Invalid zone: %s",
+					path, line_num, arg);
+				return -1;
+			}
+
+			section->flags |= MASQ_SCOPE_ZONE;
+			section->zone = val;
+		} else if (!strcmp(p, "mark")) {
+			val = strtoul(arg, &end, 0);
+			if (*arg == '\0' || val > 0xFFFFFFFF ||
+				(*end != '\0' && *end != '/'))
+			{
+				o_log(LOG_CRIT, "[%s:%u] Invalid mark: %s",
+					path, line_num, arg);
+				return -1;
+			}
+
+			section->mark = val;
+			section->mark_mask = 0xFFFFFFFF;
+
+			if (*end == '/') {
+				arg = end + 1;
+				val = strtoul(arg, &end, 0);
+				if (*arg == '\0' || *end != '\0' || val > 0xFFFFFFFF) {
+					o_log(LOG_CRIT, "[%s:%u] Invalid mark mask: %s",
+						path, line_num, arg);
+					return -1;
+				}
+
+				section->mark_mask = val;
+			}
+
+			section->flags |= MASQ_SCOPE_MARK;
+			section->mark &= section->mark_mask;
+		} else {
+			o_log(LOG_CRIT, "[%s:%u] Unknown section parameter: %s",
+				path, line_num, p);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+** Compile the masquerading map read from "fp" into the trie being built.
+** Returns 0 on success, -1 on failure.
+*/
+
+static int build_map(	struct masq_map_build *build,
+						FILE *fp,
+						const char *path)
+{
+	struct tuple_addr any;
+	u_int32_t line_num = 0;
+	char buf[4096];
+
+	memset(build, 0, sizeof(*build));
+	memset(&any, 0, sizeof(any));
+	build_section(build, &any, 0);
+
+	while (fp && fgets(buf, sizeof(buf), fp)) {
+		char *p;
+
+		++line_num;
+		p = strchr(buf, '\n');
+		if (!p) {
+			o_log(LOG_CRIT, "[%s:%u] Line too long", path, line_num);
+			return -1;
+		}
+		*p = '\0';
+
+		p = strchr(buf, '\r');
+		if (p)
+			*p = '\0';
+
+		p = buf + strspn(buf, " \t");
+
+		if (*p == '#' || *p == '\0')
+			continue;
+
+		if (*p == '[') {
+			if (parse_section(build, path, line_num, buf) == -1)
+				return -1;
+
+			continue;
+		}
+
+		if (parse_line(build, path, line_num, buf) == -1)
+			return -1;
+	}
+
+	if (fp && ferror(fp)) {
+		o_log(LOG_CRIT, "Error reading masquerading map: %s: %s",
+			path, strerror(errno));
+		return -1;
+	}
+
+	if (build_sort(build, path) == -1)
+		return -1;
+
+	debug("Compiled masquerading map %s: %zu sections, %zu rules, %zu nodes",
+		path, build->sections, build->rules, build->nodes);
+
+	if (build->overlaps > 0) {
+		o_log(LOG_INFO, "%s: %u overlapping rules; the most specific "
+			"matching rule is used (see --debug)", path, build->overlaps);
+	}
+
+	return 0;
+}
+
+/*
+** Pack the trie being built into a single block of memory.
+*/
+
+static struct masq_map_hdr *build_image(struct masq_map_build *build) {
+	struct masq_map_hdr *map;
+	size_t size;
+	char *p;
+
+	size = sizeof(*map) +
+		build->sections * sizeof(*build->section) +
+		build->nodes * sizeof(*build->node) +
+		build->rules * sizeof(*build->rule) +
+		build->str_len;
+
+	map = xcalloc(1, size);
+	memcpy(map->magic, MASQ_MAP_MAGIC, sizeof(map->magic));
+	map->version = MASQ_MAP_VERSION;
+	map->order = MASQ_MAP_ORDER;
+	map->size = size;
+	map->sections = build->sections;
+	map->nodes = build->nodes;
+	map->rules = build->rules;
+	map->strings = build->str_len;
+
+	p = (char *) (map + 1);
+	memcpy(p, build->section, build->sections * sizeof(*build->section));
+	p += build->sections * sizeof(*build->section);
+	memcpy(p, build->node, build->nodes * sizeof(*build->node));
+	p += build->nodes * sizeof(*build->node);
+	memcpy(p, build->rule, build->rules * sizeof(*build->rule));
+	p += build->rules * sizeof(*build->rule);
+	memcpy(p, build->str, build->str_len);
+
+	return map;
+}
+
+static void build_free(struct masq_map_build *build) {
+	free(build->section);
+	free(build->node);
+	free(build->rule);
+	free(build->str);
+}
+
+static inline const struct masq_map_section *map_sections(
+	const struct masq_map_hdr *map)
+{
+	return (const struct masq_map_section *) (map + 1);
+}
+
+static inline const struct masq_map_node *map_nodes(
+	const struct masq_map_hdr *map)
+{
+	return (const struct masq_map_node *) (map_sections(map) + map->sections);
+}
+
+static inline const struct masq_map_rule *map_rules(
+	const struct masq_map_hdr *map)
+{
+	return (const struct masq_map_rule *) (map_nodes(map) + map->nodes);
+}
+
+static inline const char *map_strings(const struct masq_map_hdr *map) {
+	return (const char *) (map_rules(map) + map->rules);
+}
+
+/*
+** Map a compiled masquerading map from "fd" and use it for subsequent
+** lookups.  Returns 0 on success, -1 on failure.
+*/
+
+static int map_file(int fd, const char *path) {
+	struct masq_map_hdr *map;
+	struct stat st;
+	u_int64_t size;
+
+	if (fstat(fd, &st) != 0) {
+		o_log(LOG_CRIT, "fstat: %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if ((u_int64_t) st.st_size < sizeof(*map) ||
+		(u_int64_t) st.st_size > 0xFFFFFFFF)
+	{
+		o_log(LOG_CRIT, "%s: Invalid compiled masquerading map", path);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		o_log(LOG_CRIT, "mmap: %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (map->version != MASQ_MAP_VERSION || map->order != MASQ_MAP_ORDER) {
+		o_log(LOG_CRIT, "%s: Compiled masquerading map is of another version "
+			"or byte order; recompile it with --compile-masq", path);
+		goto failure;
+	}
+
+	size = sizeof(*map) +
+		(u_int64_t) map->sections * sizeof(struct masq_map_section) +
+		(u_int64_t) map->nodes * sizeof(struct masq_map_node) +
+		(u_int64_t) map->rules * sizeof(struct masq_map_rule) +
+		map->strings;
+
+	if (map->size != (u_int64_t) st.st_size || size != map->size ||
+		map->sections < 1 ||
+		(map->strings > 0 && ((const char *) map)[size - 1] != '\0'))
+	{
+		o_log(LOG_CRIT, "%s: Invalid compiled masquerading map", path);
+		goto failure;
+	}
+
+	/* The trie is searched from its roots, not read front to back. */
+	posix_madvise(map, st.st_size, POSIX_MADV_RANDOM);
+
+	debug("Mapped masquerading map %s: %u sections, %u rules, %u nodes",
+		path, map->sections, map->rules, map->nodes);
+
+	map_set(map, st.st_size);
+	return 0;
+
+failure:
+	munmap(map, st.st_size);
+	return -1;
+}
+
+/*
+** Replace the map used for lookups.  "mapped" is the size of the mapping
+** if the map was mapped from a file, or 0 if it was allocated.
+*/
+
+static void map_set(struct masq_map_hdr *map, size_t mapped) {
+	if (masq_map_mapped)
+		munmap(masq_map, masq_map_mapped);
+	else
+		free(masq_map);
+
+	masq_map = map;
+	masq_map_mapped = mapped;
+}
+
+/*
+** Load the masquerading map at "path" and use it for subsequent lookups.
+** The map is mapped if it was compiled with --compile-masq, or compiled
+** otherwise.  A map that does not exist is treated as empty.  If the map
+** cannot be loaded, the previously loaded map is kept.
+** Returns 0 on success, -1 on failure.
+*/
+
+int masq_map_load(const char *path) {
+	struct masq_map_build build;
+	char magic[sizeof(MASQ_MAP_MAGIC)];
+	FILE *fp = NULL;
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 && errno != ENOENT) {
+		o_log(LOG_CRIT, "Error opening masquerading map: %s: %s",
+			path, strerror(errno));
+		return -1;
+	}
+
+	if (fd != -1 && pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+		!memcmp(magic, MASQ_MAP_MAGIC, sizeof(magic)))
+	{
+		ret = map_file(fd, path);
+		close(fd);
+		return ret;
+	}
+
+	if (fd != -1) {
+		fp = fdopen(fd, "r");
+		if (!fp) {
+			o_log(LOG_CRIT, "fdopen: %s: %s", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
+	ret = build_map(&build, fp, path);
+	if (ret == 0)
+		map_set(build_image(&build), 0);
+
+	if (fp)
+		fclose(fp);
+
+	build_free(&build);
+	return ret;
+}
+
+/*
+** Compile the masquerading map at "path" and write the compiled map to
+** "fd", to be loaded by masq_map_load().
+** Returns 0 on success, -1 on failure.
+*/
+
+int masq_map_compile(const char *path, int fd) {
+	struct masq_map_build build;
+	struct masq_map_hdr *map;
+	const char *p;
+	size_t left;
+	FILE *fp;
+	int ret;
+
+	if (isatty(fd)) {
+		o_log(LOG_CRIT, "Not writing a compiled masquerading map to a terminal");
+		return -1;
+	}
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		o_log(LOG_CRIT, "Error opening masquerading map: %s: %s",
+			path, strerror(errno));
+		return -1;
+	}
+
+	ret = build_map(&build, fp, path);
+	fclose(fp);
+
+	if (ret != 0) {
+		build_free(&build);
+		return -1;
+	}
+
+	map = build_image(&build);
+	build_free(&build);
+
+	for (p = (const char *) map, left = map->size; left > 0;) {
+		ssize_t len = write(fd, p, left);
+
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+
+			o_log(LOG_CRIT, "Error writing compiled masquerading map: %s",
+				strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		p += len;
+		left -= len;
+	}
+
+	free(map);
+	return ret;
+}
+
+/*
+** Select the section of the masquerading map for queries received at the
+** local address "laddr", and fill in the conntrack scope of its queries.
+** Queries received at addresses without a section use section 0, which
+** is not scoped.
+*/
+
+void masq_map_scope(const struct tuple_addr *laddr, struct masq_scope *scope) {
+	const struct masq_map_section *section = NULL;
+	struct masq_map_section key;
+
+	memset(scope, 0, sizeof(*scope));
+
+	if (!masq_map || masq_map->sections < 2)
+		return;
+
+	key.addr = *laddr;
+	section = bsearch(&key, map_sections(masq_map) + 1,
+		masq_map->sections - 1, sizeof(key), section_cmp);
+
+	if (!section)
+		return;
+
+	scope->section = section - map_sections(masq_map);
+	scope->flags = section->flags & (MASQ_SCOPE_ZONE | MASQ_SCOPE_MARK);
+	scope->zone = section->zone;
+	scope->mark = section->mark;
+	scope->mark_mask = section->mark_mask;
+
+	debug("Using masquerading map section of line %u (zone %u, mark %#x/%#x)",
+		section->line, scope->zone, scope->mark, scope->mark_mask);
+}
+
+/*
+** Find the most specific rule of the masquerading map section selected by
+** "scope" matching a host.  Returns 0 and points "user" and "os" to the
+** strings of the rule if one matches, or -1 if none does.
+*/
+
+int masq_map_find(	const struct masq_scope *scope,
+					const struct tuple_addr *host,
+					const char **user,
+					const char **os)
+{
+	const struct masq_map_section *section;
+	const struct masq_map_node *nodes;
+	const struct masq_map_rule *rule;
+	u_int32_t key[4];
+	u_int32_t best = MASQ_MAP_NONE;
+	u_int32_t cur;
+	u_int32_t bits;
+	u_int32_t min_plen = 0;
+	size_t i;
+
+	if (!masq_map || scope->section >= masq_map->sections)
+		return -1;
+
+	section = &map_sections(masq_map)[scope->section];
+
+	if (tuple_addr_is_v4(host)) {
+		cur = section->root[0];
+		bits = 32;
+		key[0] = ntohl(host->s32[3]);
+		key[1] = key[2] = key[3] = 0;
+	} else {
+		cur = section->root[1];
+		bits = 128;
+		for (i = 0; i < 4; ++i)
+			key[i] = ntohl(host->s32[i]);
+	}
+
+	if (cur >= masq_map->nodes)
+		return -1;
+
+	nodes = map_nodes(masq_map);
+
+	do {
+		const struct masq_map_node *node = &nodes[cur];
+
+		/* Prefixes grow along every path of a well-formed map. */
+		if (node->plen > bits || node->plen < min_plen)
+			break;
+
+		min_plen = node->plen + 1;
+
+		/*
+		** Nodes are entered by the bit following the prefix of their
+		** parent, so only the prefixes of nodes holding a rule need to
+		** be compared.  If one differs, so do those of its subtrie.
+		*/
+
+		if (node->rule != MASQ_MAP_NONE) {
+			if (!key_match(key, node->prefix, node->plen))
+				break;
+
+			best = node->rule;
+		}
+
+		if (node->plen == bits)
+			break;
+
+		cur = node->child[key_bit(key, node->plen)];
+	} while (cur != 0 && cur < masq_map->nodes);
+
+	if (best >= masq_map->rules)
+		return -1;
+
+	rule = &map_rules(masq_map)[best];
+	if (rule->user >= masq_map->strings || rule->os >= masq_map->strings)
+		return -1;
+
+	*user = map_strings(masq_map) + rule->user;
+	*os = map_strings(masq_map) + rule->os;
+
+	return 0;
+}
+
+#endif
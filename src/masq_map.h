@@ -0,0 +1,54 @@
+/*
+** masq_map.h - oidentd compiled masquerading map.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_MASQ_MAP_H
+#define __OIDENTD_MASQ_MAP_H
+
+#if MASQ_SUPPORT
+
+#define MASQ_SCOPE_ZONE		(1 << 0)
+#define MASQ_SCOPE_MARK		(1 << 1)
+
+struct tuple_addr;
+
+/*
+** The section of the masquerading map used for a query, and the conntrack
+** zone and mark of the connections it applies to.  A connection is in scope
+** if its zone equals "zone" when MASQ_SCOPE_ZONE is set, and if its mark
+** masked with "mark_mask" equals "mark" when MASQ_SCOPE_MARK is set.
+*/
+
+struct masq_scope {
+	u_int32_t section;
+	u_int32_t flags;
+	u_int32_t zone;
+	u_int32_t mark;
+	u_int32_t mark_mask;
+};
+
+int masq_map_load(const char *path);
+int masq_map_compile(const char *path, int fd);
+void masq_map_scope(const struct tuple_addr *laddr, struct masq_scope *scope);
+int masq_map_find(	const struct masq_scope *scope,
+					const struct tuple_addr *host,
+					const char **user,
+					const char **os);
+
+#endif
+
+#endif
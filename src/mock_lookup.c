@@ -0,0 +1,195 @@
+/*
+** mock_lookup.c - oidentd synthetic socket table lookup backend.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+/*
+** The mock backend answers lookups from a socket table read from a file
+** instead of the kernel, so that the rest of the request pipeline can be
+** tested and benchmarked without real connections.  Each line of the file
+** describes one connection:
+**
+**   <local address> <local port> <foreign address> <foreign port> <uid>
+**
+** Empty lines and lines starting with '#' are ignored.  Connections are
+** matched exactly, as listed.  Connections are stored as tuples, so an
+** IPv4-mapped IPv6 address is the same as the IPv4 address it maps.
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "lookup.h"
+
+struct mock_entry {
+	struct conn_key key;
+	uid_t uid;
+	bool used;
+};
+
+/*
+** Open-addressed hash table of connections.  The number of slots is a
+** power of two and at least twice the number of connections.
+*/
+
+static struct mock_entry *mock_table;
+static size_t mock_slots;
+
+static int mock_open(const char *path);
+static uid_t mock_lookup(const struct conn_tuple *tuple);
+static struct mock_entry *mock_slot(const struct conn_key *key);
+
+const struct lookup_backend mock_backend = {
+	"mock", 0, mock_open, mock_lookup, NULL
+};
+
+/*
+** Returns the slot holding "key", or the empty slot it would be stored in.
+*/
+
+static struct mock_entry *mock_slot(const struct conn_key *key) {
+	size_t i = key->hash & (mock_slots - 1);
+
+	while (mock_table[i].used &&
+		(mock_table[i].key.hash != key->hash ||
+		!tuple_equal(&mock_table[i].key.tuple, &key->tuple)))
+	{
+		i = (i + 1) & (mock_slots - 1);
+	}
+
+	return &mock_table[i];
+}
+
+/*
+** Load the socket table from the file "path".
+** Returns 0 on success, or -1 with errno set.
+*/
+
+static int mock_open(const char *path) {
+	char buf[1024];
+	size_t lines = 0;
+	size_t line = 0;
+	size_t entries = 0;
+	FILE *fp;
+
+	if (!path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		debug("fopen: %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp))
+		++lines;
+
+	for (mock_slots = 16; mock_slots < lines * 2; mock_slots *= 2)
+		;
+
+	free(mock_table);
+	mock_table = xcalloc(mock_slots, sizeof(*mock_table));
+
+	rewind(fp);
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		char laddr_buf[64];
+		char faddr_buf[64];
+		struct sockaddr_storage laddr;
+		struct sockaddr_storage faddr;
+		struct mock_entry *entry;
+		struct conn_tuple tuple;
+		struct conn_key key;
+		in_port_t lport;
+		in_port_t fport;
+		unsigned long uid;
+		char *p = buf;
+
+		++line;
+
+		while (*p == ' ' || *p == '\t')
+			++p;
+
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		if (sscanf(p, "%63s %hu %63s %hu %lu",
+				laddr_buf, &lport, faddr_buf, &fport, &uid) != 5 ||
+			get_addr(laddr_buf, &laddr) == -1 ||
+			get_addr(faddr_buf, &faddr) == -1 ||
+			laddr.ss_family != faddr.ss_family)
+		{
+			o_log(LOG_CRIT, "%s:%lu: Invalid socket table entry",
+				path, (unsigned long) line);
+			fclose(fp);
+			errno = EINVAL;
+			return -1;
+		}
+
+		tuple_set(&tuple, &laddr, &faddr, htons(lport), htons(fport));
+		tuple_key(&key, &tuple);
+
+		entry = mock_slot(&key);
+		entry->key = key;
+		entry->uid = (uid_t) uid;
+		entry->used = true;
+		++entries;
+	}
+
+	fclose(fp);
+
+	debug("Loaded %lu socket table entries from %s",
+		(unsigned long) entries, path);
+
+	return 0;
+}
+
+/*
+** Look up a connection in the socket table.
+*/
+
+static uid_t mock_lookup(const struct conn_tuple *tuple) {
+	struct mock_entry *entry;
+	struct conn_key key;
+
+	if (!mock_table)
+		return MISSING_UID;
+
+	tuple_key(&key, tuple);
+
+	entry = mock_slot(&key);
+	if (entry->used)
+		return entry->uid;
+
+	return MISSING_UID;
+}
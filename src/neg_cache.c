@@ -0,0 +1,307 @@
+/*
+** neg_cache.c - oidentd negative lookup cache.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+/*
+** Queries for connections that do not exist are the most expensive kind of
+** request: every lookup backend is exhausted before NO-USER can be sent.
+** Port scanners and misconfigured clients send such queries in bursts, so
+** misses are remembered for a short time and repeated queries for the same
+** connection are answered without a kernel lookup.  Connections that are
+** established in the meantime are reported as missing until the entry
+** expires, so the cache is only used if a TTL is given.
+**
+** Requests are served by forked children, so the cache lives in anonymous
+** shared memory mapped by the parent.  Every slot is guarded by a sequence
+** counter: writers take it by making it odd and give up if another process
+** holds it, and readers retry if it changed while they read the slot.
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "neg_cache.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+** Number of cache slots; must be a power of two.  A key may be stored in
+** any of the NEG_CACHE_PROBE slots following its hash.
+*/
+
+#define NEG_CACHE_SLOTS		4096
+#define NEG_CACHE_PROBE		4
+
+struct neg_slot {
+	volatile u_int32_t seq;
+	struct conn_key key;
+	u_int64_t expires;
+};
+
+struct neg_cache {
+	volatile unsigned long hits;
+	volatile unsigned long misses;
+	struct neg_slot slots[NEG_CACHE_SLOTS];
+};
+
+static struct neg_cache *neg_cache;
+static u_int32_t neg_ttl;
+
+static u_int64_t neg_now(void);
+static bool neg_key_equal(const struct conn_key *a, const struct conn_key *b);
+static bool neg_slot_read(	struct neg_slot *slot,
+						struct conn_key *key,
+						u_int64_t *expires);
+static bool neg_slot_lock(struct neg_slot *slot);
+static void neg_slot_unlock(struct neg_slot *slot);
+
+/*
+** Map the cache.  Entries expire "ttl" milliseconds after they were added;
+** a TTL of 0 disables the cache.  Must be called before the first child is
+** forked.  Returns 0 on success, or -1 with errno set.
+*/
+
+int neg_cache_init(u_int32_t ttl) {
+	void *mem;
+
+	neg_ttl = ttl;
+
+	if (ttl == 0)
+		return 0;
+
+	mem = mmap(NULL, sizeof(*neg_cache), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		debug("mmap: %s", strerror(errno));
+		return -1;
+	}
+
+	neg_cache = mem;
+	return 0;
+}
+
+/*
+** Returns the value of a monotonic clock in milliseconds.
+*/
+
+static u_int64_t neg_now(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+
+	return (u_int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+** Checks whether two cache keys are equal.  The hashes are compared first,
+** so that keys of other connections are mostly told apart without looking
+** at their tuples.
+*/
+
+static bool neg_key_equal(const struct conn_key *a, const struct conn_key *b) {
+	return a->hash == b->hash && tuple_equal(&a->tuple, &b->tuple);
+}
+
+/*
+** Take a consistent snapshot of a slot.  Returns false if the slot is
+** being written to.
+*/
+
+static bool neg_slot_read(	struct neg_slot *slot,
+						struct conn_key *key,
+						u_int64_t *expires)
+{
+	u_int32_t seq;
+	int tries;
+
+	for (tries = 0; tries < 3; ++tries) {
+		seq = slot->seq;
+		__sync_synchronize();
+
+		if (seq & 1)
+			continue;
+
+		memcpy(key, &slot->key, sizeof(*key));
+		*expires = slot->expires;
+
+		__sync_synchronize();
+		if (slot->seq == seq)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+** Try to lock a slot for writing.  Returns false if another process holds
+** the lock; the write is then skipped, which at worst costs a lookup.
+*/
+
+static bool neg_slot_lock(struct neg_slot *slot) {
+	u_int32_t seq = slot->seq;
+
+	if (seq & 1)
+		return false;
+
+	return __sync_bool_compare_and_swap(&slot->seq, seq, seq + 1);
+}
+
+static void neg_slot_unlock(struct neg_slot *slot) {
+	__sync_synchronize();
+	__sync_fetch_and_add(&slot->seq, 1);
+}
+
+/*
+** Returns true if a lookup of the connection recently failed.
+*/
+
+bool neg_cache_lookup(const struct conn_key *key) {
+	u_int64_t now;
+	size_t i;
+
+	if (!neg_cache)
+		return false;
+
+	now = neg_now();
+
+	for (i = 0; i < NEG_CACHE_PROBE; ++i) {
+		struct neg_slot *slot;
+		struct conn_key cur;
+		u_int64_t expires;
+
+		slot = &neg_cache->slots[(key->hash + i) & (NEG_CACHE_SLOTS - 1)];
+
+		if (!neg_slot_read(slot, &cur, &expires))
+			continue;
+
+		if (expires > now && neg_key_equal(&cur, key)) {
+			__sync_fetch_and_add(&neg_cache->hits, 1);
+			return true;
+		}
+	}
+
+	__sync_fetch_and_add(&neg_cache->misses, 1);
+	return false;
+}
+
+/*
+** Record that a lookup of the connection failed.  The entry replaces an
+** existing entry for the same connection, an expired entry, or the entry
+** that expires first, in that order of preference.
+*/
+
+void neg_cache_insert(const struct conn_key *key) {
+	struct neg_slot *victim = NULL;
+	u_int64_t victim_expires = 0;
+	u_int64_t now;
+	size_t i;
+
+	if (!neg_cache)
+		return;
+
+	now = neg_now();
+
+	for (i = 0; i < NEG_CACHE_PROBE; ++i) {
+		struct neg_slot *slot;
+		struct conn_key cur;
+		u_int64_t expires;
+
+		slot = &neg_cache->slots[(key->hash + i) & (NEG_CACHE_SLOTS - 1)];
+
+		if (!neg_slot_read(slot, &cur, &expires))
+			continue;
+
+		if (neg_key_equal(&cur, key) || expires <= now) {
+			victim = slot;
+			break;
+		}
+
+		if (!victim || expires < victim_expires) {
+			victim = slot;
+			victim_expires = expires;
+		}
+	}
+
+	if (!victim || !neg_slot_lock(victim))
+		return;
+
+	victim->key = *key;
+	victim->expires = now + neg_ttl;
+	neg_slot_unlock(victim);
+}
+
+/*
+** Forget a recorded failure of the connection.  Called when a lookup of
+** the connection succeeds, so that a failure recorded by another process
+** while the connection was being looked up does not outlive it.  Entries
+** that are already live are not looked up again, so a connection that is
+** established after a failed query is reported as missing until the entry
+** expires.
+*/
+
+void neg_cache_remove(const struct conn_key *key) {
+	size_t i;
+
+	if (!neg_cache)
+		return;
+
+	for (i = 0; i < NEG_CACHE_PROBE; ++i) {
+		struct neg_slot *slot;
+		struct conn_key cur;
+		u_int64_t expires;
+
+		slot = &neg_cache->slots[(key->hash + i) & (NEG_CACHE_SLOTS - 1)];
+
+		if (!neg_slot_read(slot, &cur, &expires) ||
+			!neg_key_equal(&cur, key))
+		{
+			continue;
+		}
+
+		if (neg_slot_lock(slot)) {
+			slot->expires = 0;
+			neg_slot_unlock(slot);
+		}
+	}
+}
+
+/*
+** Returns the number of cache hits and misses since the cache was mapped.
+*/
+
+void neg_cache_stats(unsigned long *hits, unsigned long *misses) {
+	*hits = neg_cache ? neg_cache->hits : 0;
+	*misses = neg_cache ? neg_cache->misses : 0;
+}
@@ -18,6 +18,13 @@
 #define NETLINK_TCPDIAG	4
 #define TCPDIAG_GETSOCK	18
 
+/* Request attributes */
+#define TCPDIAG_REQ_BYTECODE	1
+
+/* Reply attributes */
+#define TCPDIAG_MARK		15
+#define TCPDIAG_CGROUP_ID	21
+
 /* Socket identity */
 struct tcpdiag_sockid {
 	u_int16_t tcpdiag_sport;
@@ -54,4 +61,21 @@ struct tcpdiagmsg {
 	u_int32_t tcpdiag_inode;
 };
 
+/* Bytecode filter operations */
+
+struct tcpdiag_bc_op {
+	u_int8_t code;
+	u_int8_t yes;
+	u_int16_t no;
+};
+
+enum {
+	TCPDIAG_BC_NOP,
+	TCPDIAG_BC_JMP,
+	TCPDIAG_BC_S_GE,
+	TCPDIAG_BC_S_LE,
+	TCPDIAG_BC_D_GE,
+	TCPDIAG_BC_D_LE,
+};
+
 #endif
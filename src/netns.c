@@ -0,0 +1,835 @@
+/*
+** netns.c - oidentd Linux network namespace support.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "inet_util.h"
+#include "netlink.h"
+#include "netns.h"
+
+/*
+** Sockets can only be opened in other network namespaces with privileges
+** oidentd does not keep.  Instead, a helper process started before
+** privileges are dropped lists the namespaces, opens sockets in those it
+** has not seen before, and passes them to the parent over a socket.  The
+** parent asks it to do so whenever it refreshes its index of local
+** addresses, and closes the sockets of namespaces that are gone, as they
+** would otherwise keep them alive.
+*/
+
+#if NETNS_SUPPORT
+
+#include <sched.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_addr.h>
+
+/*
+** Number of seconds after which the local address index is rebuilt.
+** Addresses added to or removed from a namespace take at most this long
+** to be taken into account.
+*/
+
+#define NETNS_REFRESH		10
+
+/*
+** Number of milliseconds the parent waits for the helper to list the
+** namespaces.
+*/
+
+#define NETNS_WAIT			1000
+
+/*
+** Index of the namespace that owns an address which is also present in
+** oidentd's own namespace, or in more than one namespace.  Such addresses
+** are looked up in oidentd's own namespace.
+*/
+
+#define NETNS_OWN			0
+
+struct netns {
+	dev_t dev;
+	ino_t ino;
+	int diag_sock;
+	int route_sock;
+	bool seen;
+};
+
+/*
+** A namespace known to the helper.  "sent" is set if its sockets were
+** passed to the parent.
+*/
+
+struct netns_id {
+	dev_t dev;
+	ino_t ino;
+	bool sent;
+};
+
+/*
+** A message of the helper, about the namespace "dev" and "ino" found by the
+** listing requested with "serial".  NETNS_MSG_NEW messages carry its route
+** and sock_diag sockets.
+*/
+
+enum {
+	NETNS_MSG_NEW,
+	NETNS_MSG_KEPT,
+	NETNS_MSG_DONE,
+};
+
+struct netns_msg {
+	u_int64_t dev;
+	u_int64_t ino;
+	u_int32_t type;
+	u_int32_t serial;
+};
+
+struct netns_addr {
+	struct tuple_addr addr;
+	size_t ns;
+};
+
+static struct netns *netns_list;
+static size_t netns_count;
+
+static struct netns_addr *netns_addrs;
+static size_t netns_naddrs;
+static time_t netns_built;
+
+static int netns_helper_fd = -1;
+static u_int32_t netns_serial;
+
+static int netns_socket(int own_fd, int ns_fd, int protocol);
+static void netns_helper(int sock, int own_fd, const char *dir) __noreturn;
+static void netns_list_all(int sock, int own_fd, const char *dir,
+			u_int32_t serial, struct netns_id **ids, size_t *nids);
+static void netns_visit(int sock, int own_fd, const char *path,
+			u_int32_t serial, const struct netns_id *known, size_t nknown,
+			struct netns_id **seen, size_t *nseen);
+static bool netns_send(int sock, const struct netns_msg *msg, const int *fds);
+static int netns_update(void);
+static void netns_receive(const struct netns_msg *msg, const int *fds);
+static int netns_dump_addrs(size_t ns, struct netns_addr **addrs,
+			size_t *naddrs, size_t *size);
+static int netns_addr_key_cmp(const void *a, const void *b);
+static int netns_addr_cmp(const void *a, const void *b);
+static void netns_build_index(void);
+
+/*
+** Open a netlink socket of the given protocol in the namespace referenced
+** by "ns_fd", then switch back to the namespace referenced by "own_fd".
+** Returns the socket, or -1 on failure.
+*/
+
+static int netns_socket(int own_fd, int ns_fd, int protocol) {
+	int sock;
+
+	if (setns(ns_fd, CLONE_NEWNET) != 0) {
+		debug("setns: %s", strerror(errno));
+		return -1;
+	}
+
+	sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, protocol);
+	if (sock == -1)
+		debug("socket: %s", strerror(errno));
+
+	/* Listening sockets would be created in the wrong namespace. */
+	if (setns(own_fd, CLONE_NEWNET) != 0) {
+		o_log(LOG_CRIT, "Fatal: Cannot return to own network namespace: %s",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return sock;
+}
+
+/*
+** Send a message to the parent, along with the two sockets "fds" unless it
+** is NULL.  Returns false on failure.
+*/
+
+static bool netns_send(int sock, const struct netns_msg *msg, const int *fds) {
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+
+	iov.iov_base = (void *) msg;
+	iov.iov_len = sizeof(*msg);
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (fds) {
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+	}
+
+	return sendmsg(sock, &mh, 0) != -1;
+}
+
+/*
+** Report the network namespace referenced by "path" to the parent, unless
+** it is our own or was already reported by this listing.  Sockets are
+** opened in namespaces that are not among the "nknown" namespaces of
+** "known" whose sockets were passed on before.  Namespaces that were
+** reported are added to "seen".
+*/
+
+static void netns_visit(int sock, int own_fd, const char *path,
+			u_int32_t serial, const struct netns_id *known, size_t nknown,
+			struct netns_id **seen, size_t *nseen)
+{
+	struct netns_msg msg;
+	struct netns_id *id;
+	struct stat st;
+	int fds[2];
+	size_t i;
+	int ns_fd;
+
+	if (stat(path, &st) != 0)
+		return;
+
+	if (st.st_dev == netns_list[0].dev && st.st_ino == netns_list[0].ino)
+		return;
+
+	for (i = 0; i < *nseen; ++i) {
+		if ((*seen)[i].dev == st.st_dev && (*seen)[i].ino == st.st_ino)
+			return;
+	}
+
+	if (*nseen % 16 == 0)
+		*seen = xrealloc(*seen, sizeof(**seen) * (*nseen + 16));
+
+	id = &(*seen)[(*nseen)++];
+	id->dev = st.st_dev;
+	id->ino = st.st_ino;
+	id->sent = false;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.dev = (u_int64_t) st.st_dev;
+	msg.ino = (u_int64_t) st.st_ino;
+	msg.serial = serial;
+
+	for (i = 0; i < nknown; ++i) {
+		if (known[i].sent && known[i].dev == st.st_dev && known[i].ino == st.st_ino) {
+			msg.type = NETNS_MSG_KEPT;
+			id->sent = netns_send(sock, &msg, NULL);
+			return;
+		}
+	}
+
+	ns_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (ns_fd == -1) {
+		debug("open: %s: %s", path, strerror(errno));
+		return;
+	}
+
+	fds[0] = netns_socket(own_fd, ns_fd, NETLINK_ROUTE);
+	fds[1] = -1;
+
+	if (fds[0] != -1)
+		fds[1] = netns_socket(own_fd, ns_fd, NETLINK_TCPDIAG);
+
+	close(ns_fd);
+
+	if (fds[1] != -1) {
+		msg.type = NETNS_MSG_NEW;
+		id->sent = netns_send(sock, &msg, fds);
+		close(fds[1]);
+	}
+
+	if (fds[0] != -1)
+		close(fds[0]);
+}
+
+/*
+** List every network namespace that is listed in "dir", or that any
+** process is a member of if "dir" is NULL, report them to the parent, and
+** tell it that the listing requested with "serial" is complete.  "ids"
+** holds the namespaces found by the previous listing, and is replaced with
+** those found by this one.
+*/
+
+static void netns_list_all(int sock, int own_fd, const char *dir,
+			u_int32_t serial, struct netns_id **ids, size_t *nids)
+{
+	char path[PATH_MAX];
+	struct netns_id *seen = NULL;
+	struct netns_msg msg;
+	struct dirent *de;
+	size_t nseen = 0;
+	DIR *dp;
+
+	dp = opendir(dir ? dir : "/proc");
+	if (!dp)
+		debug("opendir: %s: %s", dir ? dir : "/proc", strerror(errno));
+
+	while (dp && (de = readdir(dp))) {
+		if (dir) {
+			if (de->d_name[0] == '.')
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		} else {
+			if (!isdigit((unsigned char) de->d_name[0]))
+				continue;
+
+			snprintf(path, sizeof(path), "/proc/%s/ns/net", de->d_name);
+		}
+
+		netns_visit(sock, own_fd, path, serial, *ids, *nids, &seen, &nseen);
+	}
+
+	if (dp)
+		closedir(dp);
+
+	free(*ids);
+	*ids = seen;
+	*nids = nseen;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = NETNS_MSG_DONE;
+	msg.serial = serial;
+	netns_send(sock, &msg, NULL);
+}
+
+/*
+** Main loop of the helper process.  Every request of the parent carries
+** the serial number of a listing.  Exits once every copy of the parent's
+** end of "sock" has been closed.
+*/
+
+static void netns_helper(int sock, int own_fd, const char *dir) {
+	struct netns_id *ids = NULL;
+	size_t nids = 0;
+
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		u_int32_t serial;
+		ssize_t ret;
+
+		ret = recv(sock, &serial, sizeof(serial), 0);
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret != sizeof(serial))
+			_exit(EXIT_SUCCESS);
+
+		netns_list_all(sock, own_fd, dir, serial, &ids, &nids);
+	}
+}
+
+/*
+** Open a netlink socket in our own network namespace, start the helper
+** process, and have it open sockets in every network namespace that is
+** listed in "dir", or that any process is a member of if "dir" is NULL.
+** Then build the local address index.  Must be called with sufficient
+** privileges to enter the namespaces.
+** Returns the number of namespaces, or -1 with errno set.
+*/
+
+int netns_open(const char *dir) {
+	struct stat st;
+	int fds[2];
+	pid_t child;
+	DIR *dp;
+	int own_fd;
+
+	own_fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+	if (own_fd == -1) {
+		debug("open: /proc/self/ns/net: %s", strerror(errno));
+		return -1;
+	}
+
+	/* Our own namespace is always the first one. */
+	netns_list = xrealloc(netns_list, sizeof(*netns_list) * 16);
+	netns_list[0].diag_sock = -1;
+	netns_list[0].route_sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+									NETLINK_ROUTE);
+
+	if (netns_list[0].route_sock == -1) {
+		debug("socket: %s", strerror(errno));
+		close(own_fd);
+		return -1;
+	}
+
+	if (fstat(own_fd, &st) != 0) {
+		debug("fstat: /proc/self/ns/net: %s", strerror(errno));
+		goto out_fail;
+	}
+
+	netns_list[0].dev = st.st_dev;
+	netns_list[0].ino = st.st_ino;
+	netns_list[0].seen = true;
+
+	dp = opendir(dir ? dir : "/proc");
+	if (!dp) {
+		debug("opendir: %s: %s", dir ? dir : "/proc", strerror(errno));
+		goto out_fail;
+	}
+
+	closedir(dp);
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+		debug("socketpair: %s", strerror(errno));
+		goto out_fail;
+	}
+
+	/*
+	** As with the index processes, the helper is detached by forking
+	** twice.
+	*/
+
+	child = fork();
+	if (child == -1) {
+		debug("fork: %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		goto out_fail;
+	}
+
+	if (child == 0) {
+		close(fds[0]);
+
+		if (fork() == 0)
+			netns_helper(fds[1], own_fd, dir);
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[1]);
+	close(own_fd);
+	waitpid(child, NULL, 0);
+
+	netns_helper_fd = fds[0];
+	netns_count = 1;
+
+	netns_update();
+
+	debug("Opened netlink sockets in %lu network namespaces",
+		(unsigned long) netns_count - 1);
+
+	netns_build_index();
+	return (int) netns_count - 1;
+
+out_fail:
+	close(netns_list[0].route_sock);
+	close(own_fd);
+	return -1;
+}
+
+/*
+** Add the namespace of a NETNS_MSG_NEW message, whose sockets are "fds",
+** or mark the namespace of a NETNS_MSG_KEPT message as still present.
+*/
+
+static void netns_receive(const struct netns_msg *msg, const int *fds) {
+	struct netns *ns;
+	size_t i;
+
+	for (i = 1; i < netns_count; ++i) {
+		if (netns_list[i].dev == (dev_t) msg->dev &&
+			netns_list[i].ino == (ino_t) msg->ino)
+		{
+			netns_list[i].seen = true;
+			break;
+		}
+	}
+
+	if (msg->type != NETNS_MSG_NEW)
+		return;
+
+	/* Sockets of a namespace that is already known are not needed. */
+	if (i < netns_count) {
+		close(fds[0]);
+		close(fds[1]);
+		return;
+	}
+
+	if (netns_count % 16 == 0)
+		netns_list = xrealloc(netns_list, sizeof(*netns_list) * (netns_count + 16));
+
+	ns = &netns_list[netns_count++];
+	ns->dev = (dev_t) msg->dev;
+	ns->ino = (ino_t) msg->ino;
+	ns->route_sock = fds[0];
+	ns->diag_sock = fds[1];
+	ns->seen = true;
+}
+
+/*
+** Have the helper list the network namespaces, add those that are new,
+** and close the sockets of those that are gone.  The local address index
+** must be rebuilt afterwards.
+** Returns 0 on success, or -1 if the listing did not complete; namespaces
+** are then added, but none are removed.
+*/
+
+static int netns_update(void) {
+	u_int32_t serial = ++netns_serial;
+	struct pollfd pfd;
+	size_t i;
+	size_t j;
+
+	for (i = 1; i < netns_count; ++i)
+		netns_list[i].seen = false;
+
+	if (send(netns_helper_fd, &serial, sizeof(serial), MSG_DONTWAIT) == -1) {
+		debug("send: %s", strerror(errno));
+		return -1;
+	}
+
+	pfd.fd = netns_helper_fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		struct netns_msg msg;
+		struct msghdr mh;
+		struct iovec iov;
+		struct cmsghdr *cmsg;
+		char cbuf[CMSG_SPACE(2 * sizeof(int))];
+		int fds[2] = { -1, -1 };
+		ssize_t ret;
+
+		ret = poll(&pfd, 1, NETNS_WAIT);
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret != 1) {
+			debug("Network namespace helper not answering");
+			return -1;
+		}
+
+		iov.iov_base = &msg;
+		iov.iov_len = sizeof(msg);
+
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+
+		ret = recvmsg(netns_helper_fd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+		if (ret == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
+
+		if (ret <= 0) {
+			debug("Network namespace helper gone");
+			return -1;
+		}
+
+		cmsg = CMSG_FIRSTHDR(&mh);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS &&
+			cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+		{
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+		}
+
+		if ((size_t) ret != sizeof(msg) ||
+			(msg.type == NETNS_MSG_NEW && fds[0] == -1))
+		{
+			if (fds[0] != -1) {
+				close(fds[0]);
+				close(fds[1]);
+			}
+
+			continue;
+		}
+
+		/* The sockets of listings given up on are still taken. */
+		if (msg.serial != serial && msg.type != NETNS_MSG_NEW)
+			continue;
+
+		if (msg.type == NETNS_MSG_DONE)
+			break;
+
+		netns_receive(&msg, fds);
+	}
+
+	for (i = 1, j = 1; i < netns_count; ++i) {
+		if (!netns_list[i].seen) {
+			close(netns_list[i].route_sock);
+			close(netns_list[i].diag_sock);
+			continue;
+		}
+
+		netns_list[j++] = netns_list[i];
+	}
+
+	if (j != netns_count) {
+		debug("Closed netlink sockets in %lu network namespaces that are gone",
+			(unsigned long) (netns_count - j));
+	}
+
+	netns_count = j;
+	return 0;
+}
+
+/*
+** Append the local addresses of namespace "ns" to *addrs.
+** Returns 0 on success, or -1 on failure.
+*/
+
+static int netns_dump_addrs(size_t ns, struct netns_addr **addrs,
+			size_t *naddrs, size_t *size)
+{
+	struct sockaddr_nl nladdr;
+	struct {
+		struct nlmsghdr nlh;
+		struct ifaddrmsg ifa;
+	} req;
+	int sock = netns_list[ns].route_sock;
+	char buf[8192];
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = RTM_GETADDR;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = (u_int32_t) netns_built;
+	req.ifa.ifa_family = AF_UNSPEC;
+
+	if (sendto(sock, &req, sizeof(req), 0,
+			(struct sockaddr *) &nladdr, sizeof(nladdr)) < 0)
+	{
+		debug("sendto: %s", strerror(errno));
+		return -1;
+	}
+
+	while (1) {
+		struct nlmsghdr *h;
+		ssize_t ret;
+		size_t uret;
+
+		ret = recv(sock, buf, sizeof(buf), 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+
+			return -1;
+		}
+
+		if (ret == 0)
+			return -1;
+
+		uret = (size_t) ret;
+		for (h = (struct nlmsghdr *) buf; NLMSG_OK(h, uret); h = NLMSG_NEXT(h, uret)) {
+			struct ifaddrmsg *ifa;
+			struct rtattr *rta;
+			size_t rtalen;
+			void *addr = NULL;
+
+			if (h->nlmsg_seq != req.nlh.nlmsg_seq)
+				continue;
+
+			if (h->nlmsg_type == NLMSG_DONE)
+				return 0;
+
+			if (h->nlmsg_type == NLMSG_ERROR)
+				return -1;
+
+			if (h->nlmsg_type != RTM_NEWADDR)
+				continue;
+
+			ifa = NLMSG_DATA(h);
+			if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+				continue;
+
+			rtalen = IFA_PAYLOAD(h);
+			for (rta = IFA_RTA(ifa); RTA_OK(rta, rtalen); rta = RTA_NEXT(rta, rtalen)) {
+				if (rta->rta_type == IFA_LOCAL ||
+					(rta->rta_type == IFA_ADDRESS && !addr))
+				{
+					addr = RTA_DATA(rta);
+				}
+			}
+
+			if (!addr)
+				continue;
+
+			if (*naddrs == *size) {
+				*size = *size ? *size * 2 : 64;
+				*addrs = xrealloc(*addrs, sizeof(**addrs) * *size);
+			}
+
+			tuple_addr_set(&(*addrs)[*naddrs].addr, ifa->ifa_family, addr);
+			(*addrs)[*naddrs].ns = ns;
+
+			++*naddrs;
+		}
+
+		if (uret != 0)
+			return -1;
+	}
+}
+
+/*
+** Order index entries by address.
+*/
+
+static int netns_addr_key_cmp(const void *a, const void *b) {
+	const struct netns_addr *na = a;
+	const struct netns_addr *nb = b;
+
+	return memcmp(&na->addr, &nb->addr, sizeof(na->addr));
+}
+
+/*
+** Order index entries by address, then by namespace.
+*/
+
+static int netns_addr_cmp(const void *a, const void *b) {
+	const struct netns_addr *na = a;
+	const struct netns_addr *nb = b;
+	int ret;
+
+	ret = netns_addr_key_cmp(a, b);
+	if (ret != 0)
+		return ret;
+
+	if (na->ns != nb->ns)
+		return na->ns < nb->ns ? -1 : 1;
+
+	return 0;
+}
+
+/*
+** Rebuild the sorted local address index.  Addresses present in more than
+** one namespace cannot be attributed to any of them and are assigned to
+** oidentd's own namespace.
+*/
+
+static void netns_build_index(void) {
+	struct netns_addr *addrs = NULL;
+	size_t naddrs = 0;
+	size_t size = 0;
+	size_t i;
+	size_t j;
+
+	netns_built = time(NULL);
+
+	for (i = 0; i < netns_count; ++i) {
+		if (netns_dump_addrs(i, &addrs, &naddrs, &size) != 0)
+			debug("Failed to list addresses of network namespace %lu",
+				(unsigned long) i);
+	}
+
+	qsort(addrs, naddrs, sizeof(*addrs), netns_addr_cmp);
+
+	for (i = 0, j = 0; i < naddrs; ++i) {
+		if (j > 0 && !netns_addr_key_cmp(&addrs[j - 1], &addrs[i])) {
+			if (addrs[j - 1].ns != addrs[i].ns)
+				addrs[j - 1].ns = NETNS_OWN;
+
+			continue;
+		}
+
+		addrs[j++] = addrs[i];
+	}
+
+	free(netns_addrs);
+	netns_addrs = addrs;
+	netns_naddrs = j;
+}
+
+/*
+** Pick up the network namespaces that were created or removed, and rebuild
+** the local address index, if it is older than NETNS_REFRESH seconds.
+** Called by the parent process, so that the index is inherited by every
+** process it forks.
+*/
+
+void netns_refresh(void) {
+	time_t now = time(NULL);
+
+	if (netns_count == 0)
+		return;
+
+	if (now >= netns_built && now - netns_built < NETNS_REFRESH)
+		return;
+
+	netns_update();
+	netns_build_index();
+}
+
+/*
+** Returns the sock_diag socket of the network namespace that owns the local
+** address "laddr", or -1 if the address belongs to oidentd's own namespace
+** or to no known namespace.
+*/
+
+int netns_diag_sock(const struct tuple_addr *laddr) {
+	struct netns_addr key;
+	struct netns_addr *found;
+
+	key.addr = *laddr;
+	key.ns = 0;
+
+	found = bsearch(&key, netns_addrs, netns_naddrs, sizeof(*netns_addrs),
+				netns_addr_key_cmp);
+
+	if (!found || found->ns == NETNS_OWN)
+		return -1;
+
+	return netns_list[found->ns].diag_sock;
+}
+
+#endif
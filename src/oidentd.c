@@ -45,20 +45,55 @@
 #include "user_db.h"
 #include "options.h"
 #include "masq.h"
+#include "masq_map.h"
+#include "lookup.h"
+#include "netns.h"
+#include "userns.h"
+#include "neg_cache.h"
+#include "forward.h"
+#include "fwd_pool.h"
+#include "procidx.h"
+#include "ctidx.h"
+#include "ipvsidx.h"
 
 #ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
 static void sig_segv(int unused __notused) __noreturn;
 static void sig_child(int sig);
 static void sig_alarm(int unused __notused) __noreturn;
 static void sig_hup(int unused);
+static void sig_usr1(int unused __notused);
 #endif
 
 static void copy_pw(const struct passwd *pw, struct passwd *pwd);
 static void free_pw(struct passwd *pwd);
 
 static int service_request(int insock, int outsock);
+static bool proxy_peer(int sock);
+static int lookup_owner(int sock, const struct conn_tuple *tuple, uid_t *uid);
+
+#if PROCIDX_SUPPORT
+/*
+** The process holding a socket, looked up in the process index when a
+** rule first asks for it.
+*/
+
+struct conn_proc {
+	unsigned long inode;
+	uid_t uid;
+	bool looked_up;
+	bool found;
+	struct proc_info info;
+};
+
+static const char *conn_proc_comm(void *arg);
+#endif
 
 u_int32_t timeout = DEFAULT_TIMEOUT;
+u_int32_t negative_ttl = DEFAULT_NEGATIVE_TTL;
+u_int32_t forward_timeout = DEFAULT_FORWARD_TIMEOUT;
+u_int32_t forward_limit = DEFAULT_FORWARD_LIMIT;
+u_int32_t forward_cache_ttl = DEFAULT_FORWARD_CACHE_TTL;
+u_int32_t forward_cache_size = DEFAULT_FORWARD_CACHE_SIZE;
 u_int32_t connection_limit;
 u_int32_t current_connections = 0;
 
@@ -69,10 +104,18 @@ char *ret_os;
 char *failuser;
 char *replyall;
 char *config_file;
+char *bpf_cgroup;
+char *netns_dir;
+char *lookup_list;
+#if MASQ_SUPPORT
+char *compile_masq;
+#endif
 
 in_port_t listen_port;
 struct sockaddr_storage **addr;
 
+extern struct sockaddr_storage proxy;
+
 int main(int argc, char **argv) {
 	int *listen_fds = NULL;
 
@@ -81,11 +124,27 @@ int main(int argc, char **argv) {
 
 	openlog(PACKAGE_NAME, LOG_PID | LOG_CONS | LOG_NDELAY, LOG_DAEMON);
 
+#if MASQ_SUPPORT
+	if (compile_masq) {
+		if (masq_map_compile(compile_masq, fileno(stdout)) != 0)
+			exit(EXIT_FAILURE);
+
+		exit(EXIT_SUCCESS);
+	}
+#endif
+
 	if (!replyall && read_config(config_file) != 0) {
 		o_log(LOG_CRIT, "Fatal: Error reading configuration file");
 		exit(EXIT_FAILURE);
 	}
 
+#if MASQ_SUPPORT
+	if (!replyall && opt_enabled(MASQ) && masq_map_load(MASQ_MAP) != 0) {
+		o_log(LOG_CRIT, "Fatal: Error reading masquerading map");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
 	if (!replyall && core_init() != 0) {
 		if (opt_enabled(DEBUG_MSGS)) {
 			o_log(LOG_CRIT, "Fatal: Error initializing core");
@@ -121,15 +180,66 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	if (!replyall && lookup_open(lookup_list) != 0) {
+		o_log(LOG_CRIT, "Fatal: Unable to initialize lookup backends");
+		exit(EXIT_FAILURE);
+	}
+
+#if PROCIDX_SUPPORT
+	if (opt_enabled(PROCIDX)) {
+		if (replyall || opt_enabled(STDIO)) {
+			o_log(LOG_INFO, "The process index is not used with --reply-all or --stdio");
+		} else if (procidx_open() != 0) {
+			o_log(LOG_CRIT, "Fatal: Unable to set up process index: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+
+#if CTIDX_SUPPORT
+	if (opt_enabled(CT_INDEX)) {
+		if (replyall || opt_enabled(STDIO)) {
+			o_log(LOG_INFO, "The conntrack index is not used with --reply-all or --stdio");
+		} else if (ctidx_open() != 0) {
+			o_log(LOG_CRIT, "Fatal: Unable to set up conntrack index: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+
+#if IPVSIDX_SUPPORT
+	if (opt_enabled(IPVS_INDEX)) {
+		if (replyall || opt_enabled(STDIO)) {
+			o_log(LOG_INFO, "The IPVS index is not used with --reply-all or --stdio");
+		} else if (ipvsidx_open() != 0) {
+			o_log(LOG_CRIT, "Fatal: Unable to set up IPVS index: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+
+	if (!replyall && !opt_enabled(STDIO) && neg_cache_init(negative_ttl) != 0)
+		o_log(LOG_INFO, "Unable to set up negative lookup cache; continuing without");
+
+	if (!replyall && !opt_enabled(STDIO) && forward_init() != 0)
+		o_log(LOG_INFO, "Unable to set up forward limit and reply cache; continuing without");
+
 	if (drop_privs(target_uid, target_gid) == -1) {
 		o_log(LOG_CRIT, "Fatal: Failed to drop privileges (global)");
 		exit(EXIT_FAILURE);
 	}
 
+	if (opt_enabled(FORWARD_POOL) && !replyall && !opt_enabled(STDIO) &&
+		fwd_pool_open() != 0)
+	{
+		o_log(LOG_INFO, "Unable to start forward pool; continuing without");
+	}
+
 #ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
 	signal(SIGALRM, sig_alarm);
 	signal(SIGCHLD, sig_child);
 	signal(SIGHUP, sig_hup);
+	signal(SIGUSR1, sig_usr1);
 	signal(SIGSEGV, sig_segv);
 #endif
 
@@ -174,6 +284,18 @@ int main(int argc, char **argv) {
 
 					++current_connections;
 
+					/* Keep the state inherited by the child up to date. */
+					lookup_tune();
+
+#if NETNS_SUPPORT
+					if (opt_enabled(NETNS))
+						netns_refresh();
+#endif
+#if USERNS_SUPPORT
+					if (opt_enabled(USERNS))
+						userns_refresh();
+#endif
+
 					child = fork();
 
 					if (child == -1) {
@@ -186,7 +308,18 @@ int main(int argc, char **argv) {
 
 						free(listen_fds);
 						alarm(timeout);
-						service_request(connectfd, connectfd);
+
+						/*
+						** The proxy may send several queries over a
+						** connection if it has opted in; they are
+						** answered in order.
+						*/
+
+						if (opt_enabled(PROXY_PIPELINE) && proxy_peer(connectfd)) {
+							while (service_request(connectfd, connectfd) == 0)
+								alarm(timeout);
+						} else
+							service_request(connectfd, connectfd);
 
 						exit(EXIT_SUCCESS);
 					}
@@ -214,8 +347,13 @@ static int service_request(int insock, int outsock) {
 	char suser[MAX_ULEN];
 	char host_buf[MAX_HOSTLEN];
 	char ip_buf[MAX_IPLEN];
-	struct sockaddr_storage laddr, laddr6, faddr, faddr6;
+	struct conn_attrs attrs;
+	struct conn_key conn;
+	struct sockaddr_storage laddr, faddr;
 	struct passwd *pw, pwd;
+#if PROCIDX_SUPPORT
+	struct conn_proc proc;
+#endif
 
 #ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
 	in_addr_t fuzz_faddr, fuzz_laddr;
@@ -242,9 +380,6 @@ static int service_request(int insock, int outsock) {
 	fport = htons(sin_port(&faddr));
 
 #if WANT_IPV6
-	laddr6 = laddr;
-	faddr6 = faddr;
-
 	if (laddr.ss_family == AF_INET6 &&
 		IN6_IS_ADDR_V4MAPPED(&SIN6(&laddr)->sin6_addr))
 	{
@@ -298,38 +433,32 @@ static int service_request(int insock, int outsock) {
 	lport = (in_port_t) lport_temp;
 	fport = (in_port_t) fport_temp;
 
-	/* User ID is unknown. */
-	con_uid = MISSING_UID;
-
-	if (con_uid == MISSING_UID && laddr.ss_family == AF_INET)
-		con_uid = get_user4(htons(lport), htons(fport), &laddr, &faddr);
+	tuple_set(&conn.tuple, &laddr, &faddr, htons(lport), htons(fport));
+	conn.hash = tuple_hash(&conn.tuple);
 
-#if WANT_IPV6
 	/*
-	 * Check for IPv6-mapped IPv4 addresses. This ensures that the correct
-	 * Ident response is returned for connections to a mapped address.
+	 * Connections that could not be found a moment ago are not looked up
+	 * again, so that scans do not cost a kernel lookup per query.
 	 */
-	if (con_uid == MISSING_UID && laddr.ss_family == AF_INET) {
-		struct sockaddr_storage laddr_m6, faddr_m6;
-		struct in6_addr in6;
-
-		sin_mapv4to6(&SIN4(&laddr)->sin_addr, &in6);
-		sin_setv6(&in6, &laddr_m6);
-
-		sin_mapv4to6(&SIN4(&faddr)->sin_addr, &in6);
-		sin_setv6(&in6, &faddr_m6);
-
-		con_uid = get_user6(htons(lport), htons(fport), &laddr_m6, &faddr_m6);
-	}
-
-	if (con_uid == MISSING_UID && laddr6.ss_family == AF_INET6)
-		con_uid = get_user6(htons(lport), htons(fport), &laddr6, &faddr6);
-#endif
+	if (neg_cache_lookup(&conn)) {
+		unsigned long hits;
+		unsigned long misses;
+
+		neg_cache_stats(&hits, &misses);
+		debug("[%s] %d , %d : Recently failed (%lu hits, %lu misses)",
+			host_buf, lport, fport, hits, misses);
+
+		con_uid = MISSING_UID;
+	} else {
+		if (lookup_owner(insock, &conn.tuple, &con_uid) == 0) {
+			neg_cache_remove(&conn);
+			return 0;
+		}
 
-	if (opt_enabled(MASQ)) {
-		if (con_uid == MISSING_UID && laddr.ss_family == AF_INET)
-			if (masq(insock, htons(lport), htons(fport), &laddr, &faddr) == 0)
-				return 0;
+		if (con_uid == MISSING_UID)
+			neg_cache_insert(&conn);
+		else
+			neg_cache_remove(&conn);
 	}
 
 	if (con_uid == MISSING_UID) {
@@ -350,6 +479,28 @@ static int service_request(int insock, int outsock) {
 		return 0;
 	}
 
+	memset(&attrs, 0, sizeof(attrs));
+	attrs.cgroup_id = lookup_last_sock()->cgroup_id;
+	attrs.mark = lookup_last_sock()->mark;
+	attrs.have_cgroup = lookup_last_sock()->have_cgroup;
+	attrs.have_mark = lookup_last_sock()->have_mark;
+
+#if PROCIDX_SUPPORT
+	if (opt_enabled(PROCIDX)) {
+		memset(&proc, 0, sizeof(proc));
+		proc.inode = lookup_last_sock()->inode;
+		proc.uid = con_uid;
+
+		attrs.comm = conn_proc_comm;
+		attrs.comm_arg = &proc;
+	}
+#endif
+
+#if USERNS_SUPPORT
+	if (opt_enabled(USERNS))
+		con_uid = userns_owner(con_uid);
+#endif
+
 	pw = getpwuid(con_uid);
 	if (!pw) {
 		sockprintf(outsock, "%d,%d:ERROR:%s\r\n",
@@ -365,7 +516,7 @@ static int service_request(int insock, int outsock) {
 		goto out_fail;
 	}
 
-	ret = get_ident(&pwd, lport, fport, &laddr, &faddr, suser, sizeof(suser));
+	ret = get_ident(&pwd, &conn.tuple, &attrs, suser, sizeof(suser));
 	if (ret == -1) {
 		sockprintf(outsock, "%d,%d:ERROR:%s\r\n",
 			lport, fport, ERROR("HIDDEN-USER"));
@@ -391,6 +542,28 @@ out_fail:
 	return -1;
 }
 
+/*
+** Returns true if "sock" is connected to the host given with --proxy.
+*/
+
+static bool proxy_peer(int sock) {
+	struct sockaddr_storage peer;
+	struct tuple_addr peer_addr;
+	struct tuple_addr proxy_addr;
+	socklen_t len = sizeof(peer);
+
+	if (!opt_enabled(PROXY))
+		return false;
+
+	if (getpeername(sock, (struct sockaddr *) &peer, &len) != 0)
+		return false;
+
+	tuple_addr_from_sin(&peer_addr, &peer);
+	tuple_addr_from_sin(&proxy_addr, &proxy);
+
+	return tuple_addr_equal(&peer_addr, &proxy_addr);
+}
+
 /*
 ** Copy the needed fields from a passwd struct.
 */
@@ -432,6 +605,64 @@ static void sig_child(int sig) {
 	signal(SIGCHLD, sig_child);
 }
 
+/*
+** Look up the owner of a connection, and look it up as a NAT connection if
+** masquerading is enabled, in the order configured for the local address
+** of the query.
+** Returns 0 if the query was answered as a NAT connection.  Otherwise,
+** returns -1 and stores the UID of the owner, or MISSING_UID, in "uid".
+*/
+
+static int lookup_owner(int sock, const struct conn_tuple *tuple, uid_t *uid) {
+#if MASQ_SUPPORT
+	if (opt_enabled(MASQ)) {
+		switch (masq_order(&tuple->laddr)) {
+			case MASQ_ORDER_NAT:
+				if (masq(sock, tuple) == 0)
+					return 0;
+
+				*uid = get_user(tuple);
+				return -1;
+
+			case MASQ_ORDER_RACE:
+				return masq_race(sock, tuple, uid);
+		}
+	}
+#endif
+
+	/*
+	 * This also finds IPv4 connections of dual-stack sockets, which are
+	 * listed under IPv4-mapped IPv6 addresses.
+	 */
+	*uid = get_user(tuple);
+
+	if (opt_enabled(MASQ) && *uid == MISSING_UID && masq(sock, tuple) == 0)
+		return 0;
+
+	return -1;
+}
+
+#if PROCIDX_SUPPORT
+
+/*
+** Returns the name of the process holding the socket described by "arg",
+** a struct conn_proc, or NULL if it cannot be found.  The process index is
+** only consulted once per connection.
+*/
+
+static const char *conn_proc_comm(void *arg) {
+	struct conn_proc *proc = arg;
+
+	if (!proc->looked_up) {
+		proc->found = procidx_lookup(proc->inode, proc->uid, &proc->info);
+		proc->looked_up = true;
+	}
+
+	return proc->found ? proc->info.comm : NULL;
+}
+
+#endif
+
 /*
 ** Handle SIGALRM.
 */
@@ -459,5 +690,25 @@ static void sig_hup(int unused __notused) {
 		o_log(LOG_CRIT, "Error parsing configuration file");
 		exit(EXIT_FAILURE);
 	}
+
+#if MASQ_SUPPORT
+	if (opt_enabled(MASQ) && masq_map_load(MASQ_MAP) != 0)
+		o_log(LOG_CRIT, "Error reading masquerading map; keeping previous map");
+#endif
+}
+
+/*
+** Handle SIGUSR1 - This causes oidentd to log its lookup statistics.
+*/
+
+static void sig_usr1(int unused __notused) {
+	lookup_report();
+#if CTIDX_SUPPORT
+	ctidx_report();
+#endif
+#if IPVSIDX_SUPPORT
+	ipvsidx_report();
+#endif
+	signal(SIGUSR1, sig_usr1);
 }
 #endif
@@ -55,6 +55,23 @@
 
 #define USER_CONF		".oidentd.conf"
 
+/*
+** cgroup v2 hierarchy the eBPF socket ownership map program is attached to
+** when no other cgroup is given.  Connections made by processes outside of
+** this cgroup are not recorded in the map.
+*/
+
+#define DEFAULT_BPF_CGROUP	"/sys/fs/cgroup"
+
+/*
+** Possible mount points of the cgroup v2 hierarchy, relative to which the
+** paths given in "cgroup" range filters are resolved: that of a unified
+** hierarchy, and that of the cgroup v2 part of a hybrid hierarchy.
+*/
+
+#define CGROUP2_ROOT		"/sys/fs/cgroup"
+#define CGROUP2_HYBRID_ROOT	"/sys/fs/cgroup/unified"
+
 /*
 ** Maximum length of Ident replies.
 */
@@ -75,6 +92,12 @@
 
 #define MAX_RANDOM_REPLIES	20
 
+/*
+** Maximum number of hosts a "forward" statement may forward queries to.
+*/
+
+#define MAX_FORWARD_HOSTS	8
+
 /*
 ** The default UID and GID, respectively, that oidentd will
 ** run with.
@@ -100,6 +123,39 @@
 
 #define DEFAULT_TIMEOUT	30
 
+/*
+** The number of milliseconds for which a failed lookup is remembered.
+** Repeated queries for the same connection are answered with an error
+** without looking it up again during this time, even if the connection has
+** been established in the meantime, so the cache is disabled by default.
+*/
+
+#define DEFAULT_NEGATIVE_TTL	0
+
+/*
+** The number of milliseconds oidentd will wait for the reply to a forwarded
+** request, and the number of requests it will forward to a host at once.
+*/
+
+#define DEFAULT_FORWARD_TIMEOUT	5000
+#define DEFAULT_FORWARD_LIMIT	16
+
+/*
+** The number of milliseconds for which successful replies to forwarded
+** requests are remembered, and the number of replies remembered at once.
+*/
+
+#define DEFAULT_FORWARD_CACHE_TTL	5000
+#define DEFAULT_FORWARD_CACHE_SIZE	1024
+
+/*
+** The number of milliseconds oidentd will wait for the reply from one of
+** several hosts a request is forwarded to before also forwarding it to the
+** next one.
+*/
+
+#define FORWARD_STAGGER	250
+
 /*
 ** Nothing below here should need to be changed.
 */
@@ -107,6 +163,7 @@
 #define DEFAULT_UMASK	0022
 
 #define MAX_HOSTLEN		256
+#define MAX_COMM_LEN	16
 
 #ifndef INET_ADDRSTRLEN
 #	define INET_ADDRSTRLEN		16
@@ -120,13 +177,11 @@
 #		error "INET6_ADDRSTRLEN is too small"
 #	endif
 #	define MAX_IPLEN	INET6_ADDRSTRLEN
-#	define IP_SCAN_SPEC	"%45s"
 #else
 #	if INET_ADDRSTRLEN < 16
 #		error "INET_ADDRSTRLEN is too small"
 #	endif
 #	define MAX_IPLEN	INET_ADDRSTRLEN
-#	define IP_SCAN_SPEC	"%15s"
 #endif
 
 #define PORT_MAX		0xffff
@@ -205,6 +260,8 @@ struct sockaddr_storage {
 
 int core_init(void);
 
+#if !KERNEL_BACKENDS
+
 /*
 ** Returns the UID of the owner of an IPv4 connection,
 ** or MISSING_UID on failure.
@@ -225,6 +282,18 @@ uid_t get_user6(	in_port_t lport,
 				struct sockaddr_storage *laddr,
 				struct sockaddr_storage *faddr);
 
+#endif
+
+/*
+** Returns the UID of the owner of a connection, or MISSING_UID on failure.
+** The connection is looked up under every address family it may be listed
+** under.
+*/
+
+struct conn_tuple;
+
+uid_t get_user(const struct conn_tuple *tuple);
+
 int read_config(const char *config_file);
 
 #endif
@@ -27,6 +27,7 @@
 #include <pwd.h>
 #include <syslog.h>
 #include <getopt.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -39,12 +40,14 @@
 #include "inet_util.h"
 #include "user_db.h"
 #include "options.h"
+#include "masq.h"
 
 #if MASQ_SUPPORT
-#	define OPTSTRING "a:c:C:def::g:hiIl:mMo::p:P:qr:R:St:u:Uv"
+#	define OPTSTRING "a:B::c:C:dDef::F:g:hiIj:k:Kl:L:mMn::No::O:p:P:qr:R:St:T:u:UvVW:xXY"
 	extern in_port_t fwdport;
+	extern char *compile_masq;
 #else
-#	define OPTSTRING "a:c:C:deg:hiIl:o::p:P:qr:R:St:u:Uv"
+#	define OPTSTRING "a:B::c:C:deF:g:hiIj:Kl:L:n::No::p:P:qr:R:St:T:u:UvW:xY"
 #endif
 
 extern struct sockaddr_storage proxy;
@@ -53,11 +56,19 @@ extern char *replyall;
 extern char *ret_os;
 extern char *config_file;
 extern u_int32_t timeout;
+extern u_int32_t negative_ttl;
+extern u_int32_t forward_timeout;
+extern u_int32_t forward_limit;
+extern u_int32_t forward_cache_ttl;
+extern u_int32_t forward_cache_size;
 extern u_int32_t connection_limit;
 extern in_port_t listen_port;
 extern struct sockaddr_storage **addr;
 extern uid_t target_uid;
 extern gid_t target_gid;
+extern char *bpf_cgroup;
+extern char *netns_dir;
+extern char *lookup_list;
 
 static void print_usage(void);
 static void print_version_str(const char *desc, const char *val);
@@ -67,15 +78,23 @@ static inline void enable_opt(u_int32_t option);
 
 static const struct option longopts[] = {
 	{"address",          required_argument, 0, 'a'},
+	{"bpf",              optional_argument, 0, 'B'},
 	{"charset",          required_argument, 0, 'c'},
 	{"config",           required_argument, 0, 'C'},
 	{"debug",            no_argument,       0, 'd'},
 	{"error",            no_argument,       0, 'e'},
+	{"forward-timeout",  required_argument, 0, 'F'},
+	{"forward-limit",    required_argument, 0, 'j'},
+	{"forward-cache",    required_argument, 0, 'W'},
+	{"forward-pool",     no_argument,       0, 'K'},
 	{"group",            required_argument, 0, 'g'},
 	{"help",             no_argument,       0, 'h'},
 	{"foreground",       no_argument,       0, 'i'},
 	{"stdio",            no_argument,       0, 'I'},
 	{"limit",            required_argument, 0, 'l'},
+	{"lookup",           required_argument, 0, 'L'},
+	{"netns",            optional_argument, 0, 'n'},
+	{"userns",           no_argument,       0, 'N'},
 	{"other",            optional_argument, 0, 'o'},
 	{"port",             required_argument, 0, 'p'},
 	{"quiet",            no_argument,       0, 'q'},
@@ -83,14 +102,22 @@ static const struct option longopts[] = {
 	{"reply-all",        required_argument, 0, 'R'},
 	{"nosyslog",         no_argument,       0, 'S'},
 	{"timeout",          required_argument, 0, 't'},
+	{"negative-ttl",     required_argument, 0, 'T'},
 	{"user",             required_argument, 0, 'u'},
 	{"version",          no_argument,       0, 'v'},
+	{"process-index",    no_argument,       0, 'x'},
 #if MASQ_SUPPORT
+	{"compile-masq",     required_argument, 0, 'k'},
+	{"conntrack-dump",   no_argument,       0, 'D'},
+	{"conntrack-index",  no_argument,       0, 'X'},
+	{"ipvs-index",       no_argument,       0, 'V'},
 	{"forward",          optional_argument, 0, 'f'},
 	{"masquerade",       no_argument,       0, 'm'},
 	{"masquerade-first", no_argument,       0, 'M'},
+	{"masquerade-order", required_argument, 0, 'O'},
 #endif
 	{"proxy",            required_argument, 0, 'P'},
+	{"proxy-pipeline",   no_argument,       0, 'Y'},
 	{NULL, 0, NULL, 0}
 };
 
@@ -167,6 +194,16 @@ int get_options(int argc, char *const argv[]) {
 				break;
 			}
 
+			case 'B':
+				free(bpf_cgroup);
+				bpf_cgroup = xstrdup(optarg ? optarg : DEFAULT_BPF_CGROUP);
+				enable_opt(BPF);
+#if !BPF_SUPPORT
+				o_log(LOG_CRIT, "Fatal: " PACKAGE_NAME " was compiled without eBPF support");
+				return -1;
+#endif
+				break;
+
 			case 'c':
 				free(charset);
 				charset = xstrdup(optarg);
@@ -203,6 +240,11 @@ int get_options(int argc, char *const argv[]) {
 				break;
 			}
 
+			case 'k':
+				free(compile_masq);
+				compile_masq = xstrdup(optarg);
+				break;
+
 			case 'm':
 				enable_opt(MASQ);
 				break;
@@ -211,6 +253,37 @@ int get_options(int argc, char *const argv[]) {
 				enable_opt(MASQ | FORWARD | MASQ_OVERRIDE);
 				break;
 
+			case 'O':
+				if (masq_order_parse(optarg) != 0)
+					return -1;
+
+				enable_opt(MASQ);
+				break;
+
+			case 'D':
+				enable_opt(CT_DUMP);
+#if !LIBNFCT_SUPPORT
+				o_log(LOG_CRIT, "Fatal: " PACKAGE_NAME " was compiled without libnetfilter_conntrack support");
+				return -1;
+#endif
+				break;
+
+			case 'X':
+				enable_opt(MASQ | CT_INDEX);
+#if !CTIDX_SUPPORT
+				o_log(LOG_CRIT, "Fatal: " PACKAGE_NAME " was compiled without conntrack index support");
+				return -1;
+#endif
+				break;
+
+			case 'V':
+				enable_opt(MASQ | IPVS_INDEX);
+#if !IPVSIDX_SUPPORT
+				o_log(LOG_CRIT, "Fatal: " PACKAGE_NAME " was compiled without IPVS index support");
+				return -1;
+#endif
+				break;
+
 #endif
 			case 'P':
 			{
@@ -223,6 +296,10 @@ int get_options(int argc, char *const argv[]) {
 				break;
 			}
 
+			case 'Y':
+				enable_opt(PROXY_PIPELINE);
+				break;
+
 			case 'g':
 				enable_opt(CHANGE_GID);
 				if (find_group(optarg, &target_gid) != 0) {
@@ -241,6 +318,37 @@ int get_options(int argc, char *const argv[]) {
 				enable_opt(FOREGROUND);
 				break;
 
+			case 'L':
+				free(lookup_list);
+				lookup_list = xstrdup(optarg);
+				break;
+
+			case 'n':
+				free(netns_dir);
+				netns_dir = optarg ? xstrdup(optarg) : NULL;
+				enable_opt(NETNS);
+#if !NETNS_SUPPORT
+				o_log(LOG_CRIT, "Fatal: " PACKAGE_NAME " was compiled without network namespace support");
+				return -1;
+#endif
+				break;
+
+			case 'N':
+				enable_opt(USERNS);
+#if !USERNS_SUPPORT
+				o_log(LOG_CRIT, "Fatal: " PACKAGE_NAME " was compiled without user namespace support");
+				return -1;
+#endif
+				break;
+
+			case 'x':
+				enable_opt(PROCIDX);
+#if !PROCIDX_SUPPORT
+				o_log(LOG_CRIT, "Fatal: " PACKAGE_NAME " was compiled without process index support");
+				return -1;
+#endif
+				break;
+
 			case 'l':
 			{
 				u_int32_t temp_limit;
@@ -313,6 +421,61 @@ int get_options(int argc, char *const argv[]) {
 				break;
 			}
 
+			case 'T':
+			{
+				char *end;
+
+				negative_ttl = strtoul(optarg, &end, 10);
+				if (*end != '\0') {
+					o_log(LOG_CRIT, "Fatal: Bad negative TTL value: \"%s\"", optarg);
+					return -1;
+				}
+				break;
+			}
+
+			case 'F':
+			{
+				char *end;
+
+				forward_timeout = strtoul(optarg, &end, 10);
+				if (*end != '\0' || forward_timeout == 0 || forward_timeout > INT_MAX) {
+					o_log(LOG_CRIT, "Fatal: Bad forward timeout value: \"%s\"", optarg);
+					return -1;
+				}
+				break;
+			}
+
+			case 'j':
+			{
+				char *end;
+
+				forward_limit = strtoul(optarg, &end, 10);
+				if (*end != '\0') {
+					o_log(LOG_CRIT, "Fatal: Bad forward limit: \"%s\"", optarg);
+					return -1;
+				}
+				break;
+			}
+
+			case 'K':
+				enable_opt(FORWARD_POOL);
+				break;
+
+			case 'W':
+			{
+				char *end;
+
+				forward_cache_ttl = strtoul(optarg, &end, 10);
+				if (*end == ':')
+					forward_cache_size = strtoul(end + 1, &end, 10);
+
+				if (*end != '\0' || forward_cache_size > (1 << 20)) {
+					o_log(LOG_CRIT, "Fatal: Bad forward cache value: \"%s\"", optarg);
+					return -1;
+				}
+				break;
+			}
+
 			case 'u':
 				enable_opt(CHANGE_UID);
 				if (find_user(optarg, &target_uid) != 0) {
@@ -353,6 +516,19 @@ int get_options(int argc, char *const argv[]) {
 		return -1;
 	}
 
+#if MASQ_SUPPORT
+	/*
+	** The NAT lookup of a raced query runs in a child, which would share
+	** the sock_diag sockets of other network namespaces with its parent.
+	*/
+
+	if (opt_enabled(NETNS) && masq_order_used(MASQ_ORDER_RACE)) {
+		o_log(LOG_CRIT, "Fatal: The '--masquerade-order=race' and '--netns' "
+		                "options are incompatible");
+		return -1;
+	}
+#endif
+
 #if NEED_ROOT
 	if (geteuid() != 0) {
 		o_log(LOG_CRIT, "Fatal: " PACKAGE_NAME " needs to run as root on this system");
@@ -416,6 +592,13 @@ static void print_usage(void) {
 	const char usage[] =
 "\nUsage: " PACKAGE_NAME " [options]\n"
 "-a or --address <address>    Bind to <address> (can be specified multiple times)\n"
+
+#if BPF_SUPPORT
+"-B or --bpf [<cgroup>]       Record connection owners in an eBPF map attached to <cgroup>\n"
+#else
+"-B or --bpf [<cgroup>]       Record connection owners in an eBPF map (not available in this build)\n"
+#endif
+
 "-c or --charset <charset>    Specify an alternate charset\n"
 "-C or --config <config file> Use the specified configuration file instead of the default\n"
 
@@ -428,23 +611,62 @@ static void print_usage(void) {
 "-e or --error                Return \"UNKNOWN-ERROR\" for all errors\n"
 
 #if MASQ_SUPPORT
+#if LIBNFCT_SUPPORT
+"-D or --conntrack-dump       Search the whole conntrack table for masqueraded connections not found directly\n"
+#else
+"-D or --conntrack-dump       Search the whole conntrack table for masqueraded connections not found directly (not available in this build)\n"
+#endif
+#if CTIDX_SUPPORT
+"-X or --conntrack-index      Look up masqueraded connections in an index maintained from conntrack events\n"
+#else
+"-X or --conntrack-index      Look up masqueraded connections in an index maintained from conntrack events (not available in this build)\n"
+#endif
+#if IPVSIDX_SUPPORT
+"-V or --ipvs-index           Forward queries for IPVS connections to their real servers\n"
+#else
+"-V or --ipvs-index           Forward queries for IPVS connections to their real servers (not available in this build)\n"
+#endif
 "-f or --forward [<port>]     Forward requests for masqueraded hosts to the host on port <port>\n"
+"-k or --compile-masq <file>  Write the masquerading map <file> to stdout in compiled form and exit\n"
 "-m or --masquerade           Enable support for IP masquerading\n"
 "-M or --masquerade-first     Check IP masquerading file before forwarding\n"
+"-O or --masquerade-order <o> Order local and NAT lookups by <o>[:<address>][,...]: local, nat or race\n"
 #endif
 
 "-P or --proxy <host>         Let <host> act as a proxy, forwarding connections to us\n"
+"-Y or --proxy-pipeline       Answer every query sent over a connection from the --proxy host\n"
+"-F or --forward-timeout <ms> Give up on forwarded requests after <ms> milliseconds\n"
+"-j or --forward-limit <n>    Forward at most <n> requests to a host at once (0 for no limit)\n"
+"-W or --forward-cache <ms>[:<n>] Cache up to <n> replies to forwarded requests for <ms> milliseconds\n"
+"-K or --forward-pool         Keep connections to hosts requests are forwarded to open, and reuse them\n"
 "-g or --group <group>        Run with specified group or GID\n"
 "-i or --foreground           Don't run as a daemon\n"
 "-I or --stdio                Service a single client connected to stdin/stdout, then exit (use with inetd/xinetd/etc.)\n"
 "-l or --limit <number>       Limit the number of open connections to the specified number\n"
+"-L or --lookup <backends>    Look up connections using the comma-separated list of <backends>\n"
+#if NETNS_SUPPORT
+"-n or --netns [<dir>]        Look up connections in all network namespaces, or those in <dir>\n"
+#else
+"-n or --netns [<dir>]        Look up connections in all network namespaces (not available in this build)\n"
+#endif
+#if USERNS_SUPPORT
+"-N or --userns               Report connections from rootless containers as their owners\n"
+#else
+"-N or --userns               Report connections from rootless containers as their owners (not available in this build)\n"
+#endif
 "-o or --other [<os>]         Return <os> instead of the operating system.  Uses \"OTHER\" if no argument is given.\n"
 "-p or --port <port>          Listen for connections on specified port\n"
 "-q or --quiet                Suppress normal logging\n"
 "-S or --nosyslog             Write messages to stderr instead of syslog\n"
 "-t or --timeout <seconds>    Wait at most <seconds> before closing connections\n"
+"-T or --negative-ttl <ms>    Answer repeated queries for unknown connections from a cache for <ms> milliseconds\n"
 "-u or --user <user>          Run as specified user or UID\n"
 "-v or --version              Display version information and exit\n"
+#if PROCIDX_SUPPORT
+"-x or --process-index        Find the processes owning connections, for use in 'comm' rules\n"
+#else
+"-x or --process-index        Find the processes owning connections (not available in this build)\n"
+#endif
 "-r or --reply <string>       If a query fails, pretend it succeeded, returning <string>\n"
 "-R or --reply-all <string>   Always return <string> without performing connection lookups\n"
 "-h or --help                 Display this help and exit\n";
@@ -476,6 +698,12 @@ static void print_version(bool verbose) {
 		print_version_bool("Masquerading support", MASQ_SUPPORT);
 		print_version_bool("IPv6 support", WANT_IPV6);
 		print_version_bool("Linux libnfct support", LIBNFCT_SUPPORT);
+		print_version_bool("Linux eBPF support", BPF_SUPPORT);
+		print_version_bool("Linux network namespace support", NETNS_SUPPORT);
+		print_version_bool("Linux user namespace support", USERNS_SUPPORT);
+		print_version_bool("Linux process index support", PROCIDX_SUPPORT);
+		print_version_bool("Linux conntrack index support", CTIDX_SUPPORT);
+		print_version_bool("Linux IPVS index support", IPVSIDX_SUPPORT);
 
 		printf("\nBuild settings:\n");
 		print_version_str("Configuration directory", SYSCONFDIR);
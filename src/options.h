@@ -34,6 +34,15 @@
 #define NOSYSLOG      (1 << 0x09)
 #define STDIO         (1 << 0x0a)
 #define MASQ_OVERRIDE (1 << 0x0b)
+#define BPF           (1 << 0x0c)
+#define NETNS         (1 << 0x0d)
+#define USERNS        (1 << 0x0e)
+#define PROCIDX       (1 << 0x0f)
+#define CT_DUMP       (1 << 0x10)
+#define CT_INDEX      (1 << 0x11)
+#define IPVS_INDEX    (1 << 0x12)
+#define FORWARD_POOL  (1 << 0x13)
+#define PROXY_PIPELINE (1 << 0x14)
 
 #ifndef LIBNFCT_SUPPORT
 #define LIBNFCT_SUPPORT 0
@@ -0,0 +1,915 @@
+/*
+** procidx.c - oidentd Linux socket to process index.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+/*
+** The process owning a socket can only be found by reading the file
+** descriptor tables of all processes in /proc, which is far too slow to do
+** for every query, and requires privileges oidentd does not keep.
+**
+** Instead, a privileged indexer process is started before privileges are
+** dropped.  It builds an index from socket inodes to the processes holding
+** them in shared memory, and keeps it up to date using the events of the
+** kernel's process connector: the descriptors of processes that fork, exec
+** or change their name are rescanned in batches, and the sockets of
+** processes that exit are removed.  Sockets created without any such
+** event are indexed lazily: when a lookup misses, the indexer is asked to
+** rescan the processes of the UID owning the connection.  The request
+** carries a socket that the indexer closes once it is done, which the
+** lookup waits for before looking again.  If the process
+** connector is unavailable, the index is rebuilt periodically instead.
+**
+** The index consists of two open-addressed hash tables.  Incremental
+** updates are made to the active table; full rebuilds fill the inactive
+** one and then swap them, so that lookups are never blocked for long.
+** The indexer is the only writer; readers retry if the sequence counter
+** of the table they read changed while they read it.
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <ctype.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "procidx.h"
+
+#if PROCIDX_SUPPORT
+
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+/*
+** Number of slots of each table; must be a power of two.  A table is
+** rebuilt once three quarters of its slots are in use.
+*/
+
+#define PROCIDX_SLOTS		65536
+
+/*
+** Process events are handled in batches, at most this many milliseconds
+** after they were received.
+*/
+
+#define PROCIDX_BATCH_MS	100
+
+/*
+** Maximum number of processes with pending events.  The index is rebuilt
+** if more processes change within a batch.
+*/
+
+#define PROCIDX_PENDING		1024
+
+/*
+** Number of seconds after which the index is rebuilt if the process
+** connector is unavailable.
+*/
+
+#define PROCIDX_REFRESH		10
+
+/*
+** Number of milliseconds a lookup waits for the indexer to rescan the
+** processes of the owner of a socket that is not yet indexed.
+*/
+
+#define PROCIDX_WAIT_MS		100
+
+/*
+** Number of times a lookup is retried while the indexer modifies the table.
+*/
+
+#define PROCIDX_RETRIES		16
+
+/*
+** Maximum number of requests handled at once.
+*/
+
+#define PROCIDX_REQUESTS	64
+
+struct procidx_entry {
+	u_int64_t inode;
+	int32_t pid;
+	char comm[MAX_COMM_LEN];
+};
+
+struct procidx_table {
+	volatile u_int32_t seq;
+	u_int32_t used;
+	struct procidx_entry entries[PROCIDX_SLOTS];
+};
+
+struct procidx_shared {
+	volatile u_int32_t active;
+	struct procidx_table tables[2];
+};
+
+struct procidx_request {
+	u_int64_t inode;
+	u_int32_t uid;
+	u_int32_t pad;
+};
+
+static struct procidx_shared *procidx_shm;
+static int procidx_req_fd = -1;
+
+static void procidx_indexer(int req_fd) __noreturn;
+static int procidx_cn_open(void);
+static void procidx_cn_read(int sock, pid_t *dirty, size_t *ndirty,
+			pid_t *exited, size_t *nexited, bool *rebuild);
+static u_int64_t procidx_now(void);
+static size_t procidx_hash(u_int64_t inode);
+static int procidx_find(u_int64_t inode, struct proc_info *info);
+static bool procidx_get(u_int64_t inode, struct proc_info *info);
+static int procidx_request(u_int64_t inode, uid_t uid);
+static size_t procidx_serve(int req_sock, struct procidx_table *table,
+			int *replies, bool *rebuild);
+static void procidx_begin(struct procidx_table *table);
+static void procidx_end(struct procidx_table *table);
+static bool procidx_put(struct procidx_table *table, u_int64_t inode,
+			pid_t pid, const char *comm);
+static bool procidx_scan_pid(struct procidx_table *table, pid_t pid);
+static bool procidx_scan_uid(struct procidx_table *table, uid_t uid);
+static void procidx_rebuild(void);
+static void procidx_remove(struct procidx_table *table,
+			pid_t *exited, size_t nexited);
+static int procidx_pid_cmp(const void *a, const void *b);
+
+/*
+** Set up the index and start the indexer process.
+** Called before privileges are dropped.
+** Returns 0 on success, or -1 with errno set.
+*/
+
+int procidx_open(void) {
+	int fds[2];
+	pid_t child;
+	void *mem;
+
+	mem = mmap(NULL, sizeof(*procidx_shm), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		debug("mmap: %s", strerror(errno));
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == -1) {
+		debug("socketpair: %s", strerror(errno));
+		munmap(mem, sizeof(*procidx_shm));
+		return -1;
+	}
+
+	procidx_shm = mem;
+
+	/*
+	** The indexer is detached by forking twice, so that it is not counted
+	** as a connection when it exits.  It exits once every copy of our end
+	** of the request socket has been closed.
+	*/
+
+	child = fork();
+	if (child == -1) {
+		debug("fork: %s", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		munmap(mem, sizeof(*procidx_shm));
+		procidx_shm = NULL;
+		return -1;
+	}
+
+	if (child == 0) {
+		close(fds[1]);
+
+		if (fork() == 0)
+			procidx_indexer(fds[0]);
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(fds[0]);
+	waitpid(child, NULL, 0);
+
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	procidx_req_fd = fds[1];
+
+	return 0;
+}
+
+/*
+** Returns the value of a monotonic clock in milliseconds.
+*/
+
+static u_int64_t procidx_now(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+
+	return (u_int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t procidx_hash(u_int64_t inode) {
+	return (size_t) ((inode * 0x9e3779b97f4a7c15ULL) >> 32) & (PROCIDX_SLOTS - 1);
+}
+
+/*
+** Look up a socket in the active table.  Returns 1 if it was found, 0 if
+** it was not, or -1 if the table was modified during the lookup.
+*/
+
+static int procidx_find(u_int64_t inode, struct proc_info *info) {
+	struct procidx_table *table;
+	u_int32_t active;
+	u_int32_t seq;
+	size_t i;
+	size_t n;
+	int ret = 0;
+
+	active = procidx_shm->active;
+	table = &procidx_shm->tables[active & 1];
+
+	seq = table->seq;
+	__sync_synchronize();
+
+	if (seq & 1)
+		return -1;
+
+	for (i = procidx_hash(inode), n = 0; n < PROCIDX_SLOTS; i = (i + 1) & (PROCIDX_SLOTS - 1), ++n) {
+		const struct procidx_entry *entry = &table->entries[i];
+
+		if (entry->inode == 0)
+			break;
+
+		if (entry->inode == inode) {
+			if (entry->pid != 0) {
+				info->pid = entry->pid;
+				memcpy(info->comm, entry->comm, sizeof(info->comm));
+				info->comm[sizeof(info->comm) - 1] = '\0';
+				ret = 1;
+			}
+
+			break;
+		}
+	}
+
+	__sync_synchronize();
+	if (table->seq != seq || procidx_shm->active != active)
+		return -1;
+
+	return ret;
+}
+
+/*
+** Look up a socket in the active table, retrying while the indexer
+** modifies it.  Returns true if it was found.
+*/
+
+static bool procidx_get(u_int64_t inode, struct proc_info *info) {
+	size_t i;
+
+	for (i = 0; i < PROCIDX_RETRIES; ++i) {
+		int ret = procidx_find(inode, info);
+
+		if (ret != -1)
+			return ret == 1;
+
+		sched_yield();
+	}
+
+	return false;
+}
+
+/*
+** Ask the indexer to rescan the processes of "uid" for the socket with
+** inode "inode".  Returns a socket that is closed by the indexer once it
+** is done, or -1 on failure.
+*/
+
+static int procidx_request(u_int64_t inode, uid_t uid) {
+	struct procidx_request req;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int pair[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+		debug("socketpair: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.inode = inode;
+	req.uid = (u_int32_t) uid;
+
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &pair[1], sizeof(int));
+
+	if (sendmsg(procidx_req_fd, &msg, MSG_DONTWAIT) == -1) {
+		debug("sendmsg: %s", strerror(errno));
+		close(pair[0]);
+		close(pair[1]);
+		return -1;
+	}
+
+	close(pair[1]);
+	return pair[0];
+}
+
+/*
+** Find the process holding the socket with inode "inode", which is owned
+** by "uid".  If the socket is not indexed, the indexer is asked to rescan
+** the processes of "uid", and the socket is looked up again once it is
+** done, or after PROCIDX_WAIT_MS milliseconds.
+** Returns true if the process was found.
+*/
+
+bool procidx_lookup(unsigned long inode, uid_t uid, struct proc_info *info) {
+	struct pollfd pfd;
+	int reply;
+
+	if (!procidx_shm || inode == 0)
+		return false;
+
+	if (!procidx_get(inode, info)) {
+		reply = procidx_request(inode, uid);
+		if (reply == -1)
+			return false;
+
+		pfd.fd = reply;
+		pfd.events = POLLIN;
+
+		while (poll(&pfd, 1, PROCIDX_WAIT_MS) == -1 && errno == EINTR)
+			;
+
+		close(reply);
+
+		if (!procidx_get(inode, info)) {
+			debug("Socket %lu not found in process index", inode);
+			return false;
+		}
+	}
+
+	debug("Socket %lu belongs to process %ld (%s)",
+		inode, (long) info->pid, info->comm);
+
+	return true;
+}
+
+/*
+** Mark a table as being modified.
+*/
+
+static void procidx_begin(struct procidx_table *table) {
+	++table->seq;
+	__sync_synchronize();
+}
+
+static void procidx_end(struct procidx_table *table) {
+	__sync_synchronize();
+	++table->seq;
+}
+
+/*
+** Record that process "pid", called "comm", holds the socket "inode".
+** A socket held by several processes, such as one inherited by a child
+** process, stays attributed to the process it was first found in.
+** Returns false if the table is full.
+*/
+
+static bool procidx_put(struct procidx_table *table, u_int64_t inode,
+			pid_t pid, const char *comm)
+{
+	struct procidx_entry *entry;
+	size_t i = procidx_hash(inode);
+
+	while (table->entries[i].inode != 0 && table->entries[i].inode != inode)
+		i = (i + 1) & (PROCIDX_SLOTS - 1);
+
+	entry = &table->entries[i];
+
+	if (entry->inode == 0) {
+		if (table->used >= PROCIDX_SLOTS / 4 * 3)
+			return false;
+
+		++table->used;
+	} else if (entry->pid != 0 && entry->pid != pid) {
+		return true;
+	}
+
+	entry->pid = pid;
+	xstrncpy(entry->comm, comm, sizeof(entry->comm));
+	__sync_synchronize();
+	entry->inode = inode;
+
+	return true;
+}
+
+/*
+** Index the sockets held by process "pid".
+** Returns false if the table is full.
+*/
+
+static bool procidx_scan_pid(struct procidx_table *table, pid_t pid) {
+	char comm[MAX_COMM_LEN];
+	char path[64];
+	struct dirent *de;
+	DIR *dp;
+	FILE *fp;
+	bool ret = true;
+
+	snprintf(path, sizeof(path), "/proc/%ld/comm", (long) pid);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return true;
+
+	if (!fgets(comm, sizeof(comm), fp))
+		comm[0] = '\0';
+
+	fclose(fp);
+	comm[strcspn(comm, "\n")] = '\0';
+
+	snprintf(path, sizeof(path), "/proc/%ld/fd", (long) pid);
+
+	dp = opendir(path);
+	if (!dp)
+		return true;
+
+	while ((de = readdir(dp))) {
+		char link[64];
+		unsigned long long inode;
+		ssize_t len;
+
+		if (de->d_name[0] == '.')
+			continue;
+
+		len = readlinkat(dirfd(dp), de->d_name, link, sizeof(link) - 1);
+		if (len <= 0)
+			continue;
+
+		link[len] = '\0';
+
+		if (sscanf(link, "socket:[%llu]", &inode) != 1 || inode == 0)
+			continue;
+
+		if (!procidx_put(table, inode, pid, comm)) {
+			ret = false;
+			break;
+		}
+	}
+
+	closedir(dp);
+	return ret;
+}
+
+/*
+** Index the sockets held by the processes of "uid".
+** Returns false if the table is full.
+*/
+
+static bool procidx_scan_uid(struct procidx_table *table, uid_t uid) {
+	struct dirent *de;
+	DIR *dp;
+	bool ret = true;
+
+	dp = opendir("/proc");
+	if (!dp) {
+		debug("opendir: /proc: %s", strerror(errno));
+		return true;
+	}
+
+	while ((de = readdir(dp))) {
+		struct stat st;
+
+		if (!isdigit((unsigned char) de->d_name[0]))
+			continue;
+
+		if (fstatat(dirfd(dp), de->d_name, &st, 0) == -1 || st.st_uid != uid)
+			continue;
+
+		if (!procidx_scan_pid(table, (pid_t) atol(de->d_name))) {
+			ret = false;
+			break;
+		}
+	}
+
+	closedir(dp);
+	return ret;
+}
+
+/*
+** Rebuild the index from the descriptor tables of all processes into the
+** inactive table, and make it the active one.
+*/
+
+static void procidx_rebuild(void) {
+	u_int32_t active = procidx_shm->active;
+	struct procidx_table *table = &procidx_shm->tables[!(active & 1)];
+	struct dirent *de;
+	DIR *dp;
+
+	procidx_begin(table);
+	memset(table->entries, 0, sizeof(table->entries));
+	table->used = 0;
+
+	dp = opendir("/proc");
+	if (dp) {
+		while ((de = readdir(dp))) {
+			if (!isdigit((unsigned char) de->d_name[0]))
+				continue;
+
+			if (!procidx_scan_pid(table, (pid_t) atol(de->d_name))) {
+				o_log(LOG_INFO, "Process index full; not all sockets are indexed");
+				break;
+			}
+		}
+
+		closedir(dp);
+	} else
+		debug("opendir: /proc: %s", strerror(errno));
+
+	procidx_end(table);
+
+	__sync_synchronize();
+	procidx_shm->active = !(active & 1);
+
+	debug("Rebuilt process index: %lu sockets", (unsigned long) table->used);
+}
+
+static int procidx_pid_cmp(const void *a, const void *b) {
+	pid_t pa = *(const pid_t *) a;
+	pid_t pb = *(const pid_t *) b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+/*
+** Remove the sockets of the processes in "exited", which must be sorted.
+** The entries are kept as tombstones until the next rebuild, so that
+** lookups of other sockets are not cut short.
+*/
+
+static void procidx_remove(struct procidx_table *table,
+			pid_t *exited, size_t nexited)
+{
+	size_t i;
+
+	for (i = 0; i < PROCIDX_SLOTS; ++i) {
+		struct procidx_entry *entry = &table->entries[i];
+
+		if (entry->pid == 0)
+			continue;
+
+		if (bsearch(&entry->pid, exited, nexited, sizeof(*exited), procidx_pid_cmp))
+			entry->pid = 0;
+	}
+}
+
+/*
+** Subscribe to the events of the process connector.
+** Returns the socket, or -1 with errno set.
+*/
+
+static int procidx_cn_open(void) {
+	struct sockaddr_nl nladdr;
+	struct {
+		struct nlmsghdr nlh;
+		struct cn_msg cn;
+		enum proc_cn_mcast_op op;
+	} __attribute__((packed)) req;
+	int sock;
+
+	sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (sock == -1)
+		return -1;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+	nladdr.nl_groups = CN_IDX_PROC;
+	nladdr.nl_pid = getpid();
+
+	if (bind(sock, (struct sockaddr *) &nladdr, sizeof(nladdr)) == -1)
+		goto out_fail;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = NLMSG_DONE;
+	req.nlh.nlmsg_pid = getpid();
+	req.cn.id.idx = CN_IDX_PROC;
+	req.cn.id.val = CN_VAL_PROC;
+	req.cn.len = sizeof(req.op);
+	req.op = PROC_CN_MCAST_LISTEN;
+
+	if (send(sock, &req, sizeof(req), 0) == -1)
+		goto out_fail;
+
+	return sock;
+
+out_fail:
+	close(sock);
+	return -1;
+}
+
+/*
+** Read the pending events of the process connector.  Processes that
+** forked, exec'd or were renamed are added to "dirty", processes that
+** exited to "exited".
+*/
+
+static void procidx_cn_read(int sock, pid_t *dirty, size_t *ndirty,
+			pid_t *exited, size_t *nexited, bool *rebuild)
+{
+	char buf[8192];
+
+	for (;;) {
+		struct nlmsghdr *h;
+		ssize_t ret;
+		size_t len;
+
+		ret = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret == -1) {
+			/* Events were lost. */
+			if (errno == ENOBUFS)
+				*rebuild = true;
+
+			return;
+		}
+
+		h = (struct nlmsghdr *) buf;
+		len = (size_t) ret;
+
+		for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			struct cn_msg *cn = NLMSG_DATA(h);
+			struct proc_event *ev = (struct proc_event *) cn->data;
+			pid_t pid;
+
+			switch (ev->what) {
+				case PROC_EVENT_FORK:
+					if (ev->event_data.fork.child_pid != ev->event_data.fork.child_tgid)
+						continue;
+
+					pid = ev->event_data.fork.child_tgid;
+					break;
+
+				case PROC_EVENT_EXEC:
+					pid = ev->event_data.exec.process_tgid;
+					break;
+
+				case PROC_EVENT_COMM:
+					pid = ev->event_data.comm.process_tgid;
+					break;
+
+				case PROC_EVENT_EXIT:
+					if (ev->event_data.exit.process_pid != ev->event_data.exit.process_tgid)
+						continue;
+
+					if (*nexited == PROCIDX_PENDING)
+						*rebuild = true;
+					else
+						exited[(*nexited)++] = ev->event_data.exit.process_tgid;
+
+					continue;
+
+				default:
+					continue;
+			}
+
+			if (*ndirty == PROCIDX_PENDING)
+				*rebuild = true;
+			else
+				dirty[(*ndirty)++] = pid;
+		}
+	}
+}
+
+/*
+** Handle the pending requests to rescan the processes of a UID.  The
+** sockets to close once they have been handled are stored in "replies",
+** which has room for PROCIDX_REQUESTS of them, and their number is
+** returned.  Exits once every copy of the other end of "req_sock" has been
+** closed.
+*/
+
+static size_t procidx_serve(int req_sock, struct procidx_table *table,
+			int *replies, bool *rebuild)
+{
+	size_t nreplies = 0;
+
+	while (nreplies < PROCIDX_REQUESTS) {
+		struct procidx_request req;
+		struct proc_info info;
+		struct msghdr msg;
+		struct iovec iov;
+		struct cmsghdr *cmsg;
+		char cbuf[CMSG_SPACE(sizeof(int))];
+		ssize_t ret;
+
+		iov.iov_base = &req;
+		iov.iov_len = sizeof(req);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		ret = recvmsg(req_sock, &msg, MSG_DONTWAIT);
+		if (ret == 0)
+			_exit(EXIT_SUCCESS);
+
+		if (ret == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				_exit(EXIT_SUCCESS);
+
+			break;
+		}
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			memcpy(&replies[nreplies++], CMSG_DATA(cmsg), sizeof(int));
+		}
+
+		if ((size_t) ret != sizeof(req) || procidx_find(req.inode, &info) == 1)
+			continue;
+
+		procidx_begin(table);
+		if (!procidx_scan_uid(table, (uid_t) req.uid))
+			*rebuild = true;
+		procidx_end(table);
+	}
+
+	return nreplies;
+}
+
+/*
+** Main loop of the indexer process.
+*/
+
+static void procidx_indexer(int req_fd) {
+	pid_t dirty[PROCIDX_PENDING];
+	pid_t exited[PROCIDX_PENDING];
+	size_t ndirty = 0;
+	size_t nexited = 0;
+	u_int64_t batch_start = 0;
+	u_int64_t last_rebuild;
+	bool rebuild = false;
+	int cn_sock;
+
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	cn_sock = procidx_cn_open();
+	if (cn_sock == -1) {
+		o_log(LOG_INFO, "Process connector unavailable (%s); "
+			"rebuilding process index every %d seconds",
+			strerror(errno), PROCIDX_REFRESH);
+	}
+
+	procidx_rebuild();
+	last_rebuild = procidx_now();
+
+	for (;;) {
+		struct pollfd pfd[2];
+		struct procidx_table *table;
+		int replies[PROCIDX_REQUESTS];
+		size_t nreplies = 0;
+		nfds_t nfds = 1;
+		int timeout = -1;
+		u_int64_t now;
+
+		pfd[0].fd = req_fd;
+		pfd[0].events = POLLIN;
+
+		if (cn_sock != -1) {
+			pfd[1].fd = cn_sock;
+			pfd[1].events = POLLIN;
+			++nfds;
+		} else
+			timeout = PROCIDX_REFRESH * 1000;
+
+		if (ndirty != 0 || nexited != 0)
+			timeout = PROCIDX_BATCH_MS;
+
+		if (poll(pfd, nfds, timeout) == -1 && errno != EINTR)
+			_exit(EXIT_FAILURE);
+
+		table = &procidx_shm->tables[procidx_shm->active & 1];
+
+		if (pfd[0].revents != 0)
+			nreplies = procidx_serve(req_fd, table, replies, &rebuild);
+
+		if (cn_sock != -1 && (pfd[1].revents & POLLIN)) {
+			procidx_cn_read(cn_sock, dirty, &ndirty, exited, &nexited, &rebuild);
+
+			if (batch_start == 0 && (ndirty != 0 || nexited != 0))
+				batch_start = procidx_now();
+		}
+
+		now = procidx_now();
+
+		if (cn_sock == -1 && now - last_rebuild >= PROCIDX_REFRESH * 1000)
+			rebuild = true;
+
+		if (rebuild) {
+			procidx_rebuild();
+			last_rebuild = now;
+			rebuild = false;
+			ndirty = 0;
+			nexited = 0;
+			batch_start = 0;
+		}
+
+		/* The lookups that made the requests look again. */
+		while (nreplies > 0)
+			close(replies[--nreplies]);
+
+		if (batch_start == 0 || now - batch_start < PROCIDX_BATCH_MS)
+			continue;
+
+		/*
+		** Remove the sockets of exited processes first, so that sockets
+		** they shared with a process that is still running are attributed
+		** to that process when it is rescanned.
+		*/
+
+		qsort(exited, nexited, sizeof(*exited), procidx_pid_cmp);
+
+		procidx_begin(table);
+
+		if (nexited != 0)
+			procidx_remove(table, exited, nexited);
+
+		while (ndirty > 0) {
+			pid_t pid = dirty[--ndirty];
+
+			if (bsearch(&pid, exited, nexited, sizeof(*exited), procidx_pid_cmp))
+				continue;
+
+			if (!procidx_scan_pid(table, pid)) {
+				rebuild = true;
+				break;
+			}
+		}
+
+		procidx_end(table);
+
+		ndirty = 0;
+		nexited = 0;
+		batch_start = 0;
+	}
+}
+
+#endif
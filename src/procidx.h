@@ -0,0 +1,34 @@
+/*
+** procidx.h - oidentd Linux socket to process index.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef __OIDENTD_PROCIDX_H
+#define __OIDENTD_PROCIDX_H
+
+#if PROCIDX_SUPPORT
+
+struct proc_info {
+	pid_t pid;
+	char comm[MAX_COMM_LEN];
+};
+
+int procidx_open(void);
+bool procidx_lookup(unsigned long inode, uid_t uid, struct proc_info *info);
+
+#endif
+
+#endif
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <syslog.h>
 #include <pwd.h>
 #include <netdb.h>
@@ -54,8 +55,11 @@ static char *select_reply(const struct user_cap *user);
 static void db_destroy_user_cb(void *data);
 
 static bool port_match(in_port_t port, const struct port_range *cap_ports);
-static bool addr_match(	struct sockaddr_storage *addr,
-						struct sockaddr_storage *cap_addr);
+static bool addr_match(	const struct tuple_addr *addr,
+						const struct tuple_addr *cap_addr);
+static bool attrs_match(	const struct conn_attrs *attrs,
+						const struct user_cap *user_cap);
+static const char *cgroup2_root(void);
 
 static bool user_db_have_cap(	const struct user_cap *user_cap,
 								u_int16_t cap_flag);
@@ -66,16 +70,12 @@ static bool user_db_can_reply(	const struct user_cap *user_cap,
 								in_port_t fport);
 
 static struct user_cap *user_db_cap_lookup(	struct user_info *user_info,
-											in_port_t lport,
-											in_port_t fport,
-											struct sockaddr_storage *laddr,
-											struct sockaddr_storage *faddr);
+											const struct conn_tuple *tuple,
+											const struct conn_attrs *attrs);
 
 static struct user_cap *user_db_get_pref(	const struct passwd *pw,
-											in_port_t lport,
-											in_port_t fport,
-											struct sockaddr_storage *laddr,
-											struct sockaddr_storage *faddr);
+											const struct conn_tuple *tuple,
+											const struct conn_attrs *attrs);
 
 /*
 ** Generate a pseudo-random Ident response consisting of a string of "len"
@@ -130,25 +130,26 @@ static inline bool user_db_have_cap(const struct user_cap *user_cap,
 
 /*
 ** Stores the appropriate Ident reply in "reply."
+** "attrs" describes the connection further, or is NULL if nothing else is
+** known about it.
 ** Returns 0 if user is not hidden, -1 if the user is hidden.
 */
 
 int get_ident(	const struct passwd *pwd,
-				in_port_t lport,
-				in_port_t fport,
-				struct sockaddr_storage *laddr,
-				struct sockaddr_storage *faddr,
+				const struct conn_tuple *tuple,
+				const struct conn_attrs *attrs,
 				char *reply,
 				size_t len)
 {
+	in_port_t lport = ntohs(tuple->lport);
+	in_port_t fport = ntohs(tuple->fport);
 	struct user_cap *user_cap;
 	struct user_cap *user_pref;
 
-	user_cap = user_db_cap_lookup(user_db_lookup(pwd->pw_uid),
-				lport, fport, laddr, faddr);
+	user_cap = user_db_cap_lookup(user_db_lookup(pwd->pw_uid), tuple, attrs);
 
 	if (!user_cap)
-		user_cap = user_db_cap_lookup(default_user, lport, fport, laddr, faddr);
+		user_cap = user_db_cap_lookup(default_user, tuple, attrs);
 
 	if (user_cap->action == ACTION_FORCE) {
 		switch (user_cap->caps) {
@@ -158,7 +159,8 @@ int get_ident(	const struct passwd *pwd,
 
 			case CAP_FORWARD:
 				return forward_request(user_cap->data.forward.host,
-					user_cap->data.forward.port, lport, fport, reply, len);
+					user_cap->data.forward.num, user_cap->data.forward.port,
+					lport, fport, reply, len);
 				break;
 
 			case CAP_HIDE:
@@ -184,7 +186,7 @@ int get_ident(	const struct passwd *pwd,
 		return 0;
 	}
 
-	user_pref = user_db_get_pref(pwd, lport, fport, laddr, faddr);
+	user_pref = user_db_get_pref(pwd, tuple, attrs);
 	if (user_pref) {
 		u_int16_t caps = user_pref->caps;
 
@@ -213,8 +215,8 @@ int get_ident(	const struct passwd *pwd,
 					int ret;
 
 					ret = forward_request(user_pref->data.forward.host,
-						user_pref->data.forward.port, lport, fport,
-						reply, len);
+						user_pref->data.forward.num, user_pref->data.forward.port,
+						lport, fport, reply, len);
 
 					if (ret == 0) {
 						if (user_db_can_reply(user_cap, pwd, reply, fport))
@@ -289,6 +291,13 @@ void user_db_cap_destroy_data(void *data) {
 	free(user_cap->fport);
 	free(user_cap->src);
 	free(user_cap->dest);
+	free(user_cap->comm);
+	free(user_cap->mark);
+
+	if (user_cap->cgroup) {
+		free(user_cap->cgroup->path);
+		free(user_cap->cgroup);
+	}
 
 	if (user_cap->caps == CAP_REPLY) {
 		size_t i;
@@ -407,11 +416,11 @@ struct user_info *user_db_lookup(uid_t uid) {
 */
 
 static struct user_cap *user_db_cap_lookup(	struct user_info *user_info,
-											in_port_t lport,
-											in_port_t fport,
-											struct sockaddr_storage *laddr,
-											struct sockaddr_storage *faddr)
+											const struct conn_tuple *tuple,
+											const struct conn_attrs *attrs)
 {
+	in_port_t lport = ntohs(tuple->lport);
+	in_port_t fport = ntohs(tuple->fport);
 	list_t *cur;
 
 	if (!user_info)
@@ -426,10 +435,13 @@ static struct user_cap *user_db_cap_lookup(	struct user_info *user_info,
 		if (!port_match(fport, user_cap->fport))
 			continue;
 
-		if (!addr_match(laddr, user_cap->src))
+		if (!addr_match(&tuple->laddr, user_cap->src))
+			continue;
+
+		if (!addr_match(&tuple->faddr, user_cap->dest))
 			continue;
 
-		if (!addr_match(faddr, user_cap->dest))
+		if (!attrs_match(attrs, user_cap))
 			continue;
 
 		return user_cap;
@@ -474,11 +486,11 @@ void user_db_set_default(struct user_info *user_info) {
 */
 
 static struct user_cap *user_db_get_pref(	const struct passwd *pw,
-											in_port_t lport,
-											in_port_t fport,
-											struct sockaddr_storage *laddr,
-											struct sockaddr_storage *faddr)
+											const struct conn_tuple *tuple,
+											const struct conn_attrs *attrs)
 {
+	in_port_t lport = ntohs(tuple->lport);
+	in_port_t fport = ntohs(tuple->fport);
 	list_t *cap_list;
 	list_t *cur;
 
@@ -493,10 +505,13 @@ static struct user_cap *user_db_get_pref(	const struct passwd *pw,
 		if (!port_match(fport, cur_cap->fport))
 			continue;
 
-		if (!addr_match(laddr, cur_cap->src))
+		if (!addr_match(&tuple->laddr, cur_cap->src))
+			continue;
+
+		if (!addr_match(&tuple->faddr, cur_cap->dest))
 			continue;
 
-		if (!addr_match(faddr, cur_cap->dest))
+		if (!attrs_match(attrs, cur_cap))
 			continue;
 
 		/*
@@ -517,13 +532,13 @@ static struct user_cap *user_db_get_pref(	const struct passwd *pw,
 ** wildcard.
 */
 
-static bool addr_match(	struct sockaddr_storage *addr,
-						struct sockaddr_storage *cap_addr)
+static bool addr_match(	const struct tuple_addr *addr,
+						const struct tuple_addr *cap_addr)
 {
 	if (!cap_addr)
 		return true;
 
-	return sin_equal(addr, cap_addr);
+	return tuple_addr_equal(addr, cap_addr);
 }
 
 /*
@@ -540,3 +555,81 @@ static bool port_match(in_port_t port, const struct port_range *cap_ports) {
 
 	return false;
 }
+
+/*
+** Returns the mount point of the cgroup v2 hierarchy.
+*/
+
+static const char *cgroup2_root(void) {
+	static const char *root;
+
+	if (!root) {
+		if (access(CGROUP2_ROOT "/cgroup.controllers", F_OK) == 0)
+			root = CGROUP2_ROOT;
+		else
+			root = CGROUP2_HYBRID_ROOT;
+	}
+
+	return root;
+}
+
+/*
+** Checks whether the process name, cgroup and mark filters of a capability
+** match a connection.  A filter matches nothing if the corresponding
+** property of the connection is not known.  Omitted filters match
+** anything.
+*/
+
+static bool attrs_match(	const struct conn_attrs *attrs,
+						const struct user_cap *user_cap)
+{
+	if (user_cap->comm) {
+		const char *comm;
+
+		if (!attrs || !attrs->comm)
+			return false;
+
+		comm = attrs->comm(attrs->comm_arg);
+		if (!comm || strcmp(comm, user_cap->comm))
+			return false;
+	}
+
+	if (user_cap->mark) {
+		if (!attrs || !attrs->have_mark)
+			return false;
+
+		if ((attrs->mark & user_cap->mark->mask) != user_cap->mark->value)
+			return false;
+	}
+
+	if (user_cap->cgroup) {
+		u_int64_t id = user_cap->cgroup->id;
+
+		if (!attrs || !attrs->have_cgroup)
+			return false;
+
+		/*
+		** Cgroups given by path are resolved every time, since the cgroup
+		** of a service is recreated whenever the service is restarted.
+		** The ID of a cgroup v2 is the inode number of its directory.
+		*/
+
+		if (user_cap->cgroup->path) {
+			char path[PATH_MAX];
+			struct stat st;
+
+			snprintf(path, sizeof(path), "%s%s",
+				cgroup2_root(), user_cap->cgroup->path);
+
+			if (stat(path, &st) != 0)
+				return false;
+
+			id = (u_int64_t) st.st_ino;
+		}
+
+		if (attrs->cgroup_id != id)
+			return false;
+	}
+
+	return true;
+}
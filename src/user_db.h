@@ -45,8 +45,19 @@ struct user_cap {
 		in_port_t max;
 	} *lport, *fport;
 
-	struct sockaddr_storage *src;
-	struct sockaddr_storage	*dest;
+	struct tuple_addr *src;
+	struct tuple_addr *dest;
+	char *comm;
+
+	struct cgroup_match {
+		char *path;
+		u_int64_t id;
+	} *cgroup;
+
+	struct mark_match {
+		u_int32_t value;
+		u_int32_t mask;
+	} *mark;
 
 	u_int16_t caps;
 	u_int16_t action;
@@ -58,11 +69,29 @@ struct user_cap {
 		} replies;
 		struct forward_data {
 			struct sockaddr_storage *host;
+			u_int8_t num;
 			in_port_t port;
 		} forward;
 	} data;
 };
 
+/*
+** What is known about a connection besides its addresses, ports and owner.
+** Finding the owning process may be slow, so "comm" is only called, with
+** "comm_arg", once a rule filters on it.  It returns the name of the
+** process, or NULL if it is not known; "comm" itself is NULL if the process
+** cannot be found.
+*/
+
+struct conn_attrs {
+	const char *(*comm)(void *arg);
+	void *comm_arg;
+	u_int64_t cgroup_id;
+	u_int32_t mark;
+	bool have_cgroup;
+	bool have_mark;
+};
+
 struct user_info {
 	uid_t user;
 	list_t *cap_list;
@@ -76,10 +105,8 @@ void user_db_set_default(struct user_info *user_info);
 struct user_info *user_db_create_default(void);
 
 int get_ident(	const struct passwd *pwd,
-				in_port_t lport,
-				in_port_t fport,
-				struct sockaddr_storage *laddr,
-				struct sockaddr_storage *faddr,
+				const struct conn_tuple *tuple,
+				const struct conn_attrs *attrs,
 				char *reply,
 				size_t len);
 
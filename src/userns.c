@@ -0,0 +1,375 @@
+/*
+** userns.c - oidentd Linux user namespace UID translation.
+** Copyright (c) 2026 agent  <agent@local>
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License, version 2,
+** as published by the Free Software Foundation.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <config.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "oidentd.h"
+#include "util.h"
+#include "missing.h"
+#include "userns.h"
+
+#if USERNS_SUPPORT
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef NS_GET_OWNER_UID
+#	define NS_GET_OWNER_UID _IO(0xb7, 0x4)
+#endif
+
+/*
+** Number of seconds after which the idmap index is rebuilt.  Mappings of
+** user namespaces that have been destroyed are dropped after at most this
+** long.  Unknown UIDs, such as those of namespaces created in the
+** meantime, cause a rebuild at most once every USERNS_MISS_REFRESH
+** seconds; see userns_owner().
+*/
+
+#define USERNS_REFRESH		10
+#define USERNS_MISS_REFRESH	1
+
+/*
+** A range of "count" host UIDs starting at "host_start" that is mapped to
+** the UIDs starting at "ns_start" in a user namespace.  "owner" is the host
+** UID of the user accountable for the namespace, or MISSING_UID.
+*/
+
+struct userns_range {
+	u_int32_t host_start;
+	u_int32_t ns_start;
+	u_int32_t count;
+	uid_t owner;
+};
+
+static struct userns_range *userns_ranges;
+static size_t userns_nranges;
+static time_t userns_built;
+
+/*
+** The time at which a process last rebuilt the index because of an unknown
+** UID, shared by all processes.
+*/
+
+static time_t *userns_missed;
+
+static void userns_build_index(void);
+static bool userns_may_rebuild(void);
+static uid_t userns_ns_owner(const char *pid, uid_t root_uid);
+static void userns_read_map(const char *pid, struct userns_range **ranges,
+			size_t *nranges, size_t *size);
+static int userns_range_cmp(const void *a, const void *b);
+static const struct userns_range *userns_find(uid_t uid);
+
+/*
+** Returns the host UID of the user accountable for the user namespace of
+** process "pid": the user that created it, or, if it was created by root
+** or its creator cannot be determined, the host UID that root inside the
+** namespace ("root_uid") is mapped to.  Returns MISSING_UID if this is root
+** or unknown too, since host root is never accountable for the users of a
+** namespace.
+*/
+
+static uid_t userns_ns_owner(const char *pid, uid_t root_uid) {
+	char path[PATH_MAX];
+	uid_t owner = MISSING_UID;
+	int fd;
+
+	/* Opening the namespaces of other users requires privileges. */
+	snprintf(path, sizeof(path), "/proc/%s/ns/user", pid);
+	fd = open(path, O_RDONLY);
+	if (fd != -1) {
+		if (ioctl(fd, NS_GET_OWNER_UID, &owner) == -1)
+			owner = MISSING_UID;
+
+		close(fd);
+	}
+
+	if (owner == MISSING_UID || owner == 0)
+		owner = root_uid;
+
+	if (owner == 0)
+		return MISSING_UID;
+
+	return owner;
+}
+
+/*
+** Append the mappings listed in the uid_map file of process "pid" to
+** *ranges.  Identity mappings, such as that of the initial user namespace,
+** are skipped.
+*/
+
+static void userns_read_map(const char *pid, struct userns_range **ranges,
+			size_t *nranges, size_t *size)
+{
+	char path[PATH_MAX];
+	char buf[128];
+	uid_t root_uid = MISSING_UID;
+	uid_t owner;
+	size_t first = *nranges;
+	size_t i;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%s/uid_map", pid);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		unsigned long ns_start;
+		unsigned long host_start;
+		unsigned long count;
+
+		if (sscanf(buf, "%lu %lu %lu", &ns_start, &host_start, &count) != 3)
+			continue;
+
+		if (ns_start == 0 && count > 0)
+			root_uid = (uid_t) host_start;
+
+		if (ns_start == host_start || count == 0)
+			continue;
+
+		if (*nranges == *size) {
+			*size = *size ? *size * 2 : 64;
+			*ranges = xrealloc(*ranges, sizeof(**ranges) * *size);
+		}
+
+		(*ranges)[*nranges].host_start = (u_int32_t) host_start;
+		(*ranges)[*nranges].ns_start = (u_int32_t) ns_start;
+		(*ranges)[*nranges].count = (u_int32_t) count;
+		++*nranges;
+	}
+
+	fclose(fp);
+
+	if (first == *nranges)
+		return;
+
+	owner = userns_ns_owner(pid, root_uid);
+	for (i = first; i < *nranges; ++i)
+		(*ranges)[i].owner = owner;
+}
+
+/*
+** Order ranges by their first host UID.
+*/
+
+static int userns_range_cmp(const void *a, const void *b) {
+	const struct userns_range *ra = a;
+	const struct userns_range *rb = b;
+
+	if (ra->host_start != rb->host_start)
+		return ra->host_start < rb->host_start ? -1 : 1;
+
+	if (ra->ns_start != rb->ns_start)
+		return ra->ns_start < rb->ns_start ? -1 : 1;
+
+	if (ra->count != rb->count)
+		return ra->count < rb->count ? -1 : 1;
+
+	return 0;
+}
+
+/*
+** Rebuild the sorted index of host UID ranges from the uid_map files of
+** all running processes.  The files are world-readable, so no privileges
+** are required.  Processes sharing a user namespace list the same ranges;
+** duplicates are merged.  Ranges that overlap an earlier range are dropped,
+** since their host UIDs cannot be attributed to a single namespace UID.
+*/
+
+static void userns_build_index(void) {
+	struct userns_range *ranges = NULL;
+	size_t nranges = 0;
+	size_t size = 0;
+	struct dirent *de;
+	DIR *dp;
+	size_t i;
+	size_t j;
+
+	userns_built = time(NULL);
+
+	dp = opendir("/proc");
+	if (!dp) {
+		debug("opendir: /proc: %s", strerror(errno));
+		return;
+	}
+
+	while ((de = readdir(dp))) {
+		if (!isdigit((unsigned char) de->d_name[0]))
+			continue;
+
+		userns_read_map(de->d_name, &ranges, &nranges, &size);
+	}
+
+	closedir(dp);
+
+	qsort(ranges, nranges, sizeof(*ranges), userns_range_cmp);
+
+	for (i = 0, j = 0; i < nranges; ++i) {
+		if (j > 0) {
+			struct userns_range *prev = &ranges[j - 1];
+
+			if (ranges[i].host_start - prev->host_start < prev->count)
+				continue;
+		}
+
+		ranges[j++] = ranges[i];
+	}
+
+	free(userns_ranges);
+	userns_ranges = ranges;
+	userns_nranges = j;
+}
+
+/*
+** Rebuild the idmap index if it is older than USERNS_REFRESH seconds, or
+** if another process has rebuilt it since because of an unknown UID.
+** Called by the parent process, so that the index is inherited by every
+** process it forks.
+*/
+
+void userns_refresh(void) {
+	time_t now = time(NULL);
+
+	if (!userns_missed) {
+		void *mem = mmap(NULL, sizeof(*userns_missed), PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+		if (mem == MAP_FAILED)
+			debug("mmap: %s", strerror(errno));
+		else
+			userns_missed = mem;
+	}
+
+	if (userns_built != 0 && now >= userns_built &&
+		now - userns_built < USERNS_REFRESH &&
+		(!userns_missed || *userns_missed < userns_built))
+	{
+		return;
+	}
+
+	userns_build_index();
+}
+
+/*
+** Returns true if the calling process may rebuild the index because of an
+** unknown UID.  Only one process may do so every USERNS_MISS_REFRESH
+** seconds, so that connections of unknown UIDs do not each cause all
+** uid_map files to be read.
+*/
+
+static bool userns_may_rebuild(void) {
+	time_t now = time(NULL);
+	time_t last;
+
+	if (!userns_missed)
+		return false;
+
+	last = *userns_missed;
+	if (now >= last && now - last < USERNS_MISS_REFRESH)
+		return false;
+
+	return __sync_bool_compare_and_swap(userns_missed, last, now);
+}
+
+/*
+** Returns the range containing host UID "uid", or NULL if there is none.
+*/
+
+static const struct userns_range *userns_find(uid_t uid) {
+	size_t lo = 0;
+	size_t hi = userns_nranges;
+
+	/* Find the first range starting after "uid". */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (userns_ranges[mid].host_start <= uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0)
+		return NULL;
+
+	if (uid - userns_ranges[lo - 1].host_start >= userns_ranges[lo - 1].count)
+		return NULL;
+
+	return &userns_ranges[lo - 1];
+}
+
+/*
+** Returns the host UID of the user accountable for the host UID "uid": "uid"
+** itself if it is not mapped into any user namespace or belongs to a host
+** user, or else the owner of the user namespace it is mapped into (see
+** userns_ns_owner()).  UIDs inside a namespace are never looked up in the
+** host's user database, since they belong to unrelated host users.
+** Returns MISSING_UID if no host user is accountable for "uid".
+*/
+
+uid_t userns_owner(uid_t uid) {
+	const struct userns_range *range;
+
+	if (getpwuid(uid))
+		return uid;
+
+	/* The index is built by the parent process unless there is none. */
+	if (userns_built == 0)
+		userns_refresh();
+
+	/* The UID may belong to a namespace created since the last rebuild. */
+	range = userns_find(uid);
+	if (!range && userns_may_rebuild()) {
+		userns_build_index();
+		range = userns_find(uid);
+	}
+
+	if (!range)
+		return uid;
+
+	debug("Host UID %lu is UID %lu in a user namespace owned by UID %ld",
+		(unsigned long) uid,
+		(unsigned long) (range->ns_start + (uid - range->host_start)),
+		range->owner == MISSING_UID ? -1L : (long) range->owner);
+
+	return range->owner;
+}
+
+#endif